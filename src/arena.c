@@ -0,0 +1,161 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "arena.h"
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ALIGNMENT 16
+/** Largest block kept by arena_reset */
+#define MAX_KEPT_SIZE (64 * 1024)
+
+typedef struct block {
+  struct block *next;
+  size_t size;
+  size_t used;
+  char *data;
+} block_t;
+
+struct arena {
+  block_t *block; /**< Current block, older ones follow */
+  void *last; /**< Latest allocation */
+};
+
+static block_t *block_new(size_t size, block_t *next)
+{
+  block_t *block = malloc(sizeof(block_t) + size + ALIGNMENT);
+  block->next = next;
+  block->size = size;
+  block->used = 0;
+  /* Data follows the header, aligned */
+  block->data = (char *)(((uintptr_t)(block + 1) + ALIGNMENT - 1)
+                         & ~(uintptr_t)(ALIGNMENT - 1));
+  return block;
+}
+
+static size_t align(size_t offset)
+{
+  return (offset + ALIGNMENT - 1) & ~(size_t)(ALIGNMENT - 1);
+}
+
+arena_t *arena_new(size_t size)
+{
+  arena_t *arena = malloc(sizeof(arena_t));
+  arena->block = block_new(size, NULL);
+  arena->last = NULL;
+  return arena;
+}
+
+void arena_free(arena_t *arena)
+{
+  block_t *block, *next;
+
+  if (!arena) {
+    return;
+  }
+
+  for (block = arena->block; block; block = next) {
+    next = block->next;
+    free(block);
+  }
+  free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+  block_t *block = arena->block;
+  size_t offset = align(block->used);
+
+  if (offset + size > block->size) {
+    arena->block = block = block_new(size > block->size * 2
+                                     ? size : block->size * 2, block);
+    offset = 0;
+  }
+
+  block->used = offset + size;
+  arena->last = block->data + offset;
+  return arena->last;
+}
+
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t size)
+{
+  block_t *block = arena->block;
+  void *result;
+
+  if (ptr && ptr == arena->last
+   && (char *)ptr + size <= block->data + block->size) {
+    block->used = (char *)ptr - block->data + size;
+    return ptr;
+  }
+
+  result = arena_alloc(arena, size);
+  if (ptr) {
+    memcpy(result, ptr, old_size < size ? old_size : size);
+  }
+  return result;
+}
+
+char *arena_stringf(arena_t *arena, const char *format, ...)
+{
+  block_t *block = arena->block;
+  size_t offset = align(block->used),
+         available = offset < block->size ? block->size - offset : 0;
+  char *result = block->data + offset;
+  int n;
+  va_list va_args;
+
+  /* Format straight to the free space, again only if it doesn't fit */
+  va_start(va_args, format);
+  n = vsnprintf(available ? result : NULL, available, format, va_args);
+  va_end(va_args);
+
+  if ((size_t)n < available) {
+    block->used = offset + n + 1;
+    arena->last = result;
+    return result;
+  }
+
+  result = arena_alloc(arena, n + 1);
+  va_start(va_args, format);
+  vsnprintf(result, n + 1, format, va_args);
+  va_end(va_args);
+  return result;
+}
+
+void arena_reset(arena_t *arena)
+{
+  block_t *block, *next;
+  size_t size = 0;
+
+  arena->last = NULL;
+
+  if (!arena->block->next) {
+    arena->block->used = 0;
+    return;
+  }
+
+  for (block = arena->block; block; block = next) {
+    next = block->next;
+    size += block->size;
+    free(block);
+  }
+  arena->block = block_new(size < MAX_KEPT_SIZE ? size : MAX_KEPT_SIZE, NULL);
+}
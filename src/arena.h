@@ -0,0 +1,55 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_ARENA_H
+#define MUSICD_ARENA_H
+
+#include <stddef.h>
+
+/**
+ * Bump allocator for short-lived allocations. Everything allocated from an
+ * arena is freed at once with arena_reset.
+ */
+typedef struct arena arena_t;
+
+/**
+ * @returns new arena with @p size bytes available before it grows.
+ */
+arena_t *arena_new(size_t size);
+void arena_free(arena_t *arena);
+
+/**
+ * @returns @p size bytes valid until the arena is reset. Never fails.
+ */
+void *arena_alloc(arena_t *arena, size_t size);
+
+/**
+ * Resizes @p ptr of @p old_size bytes to @p size bytes. The latest allocation
+ * grows in place if possible, others are copied.
+ */
+void *arena_realloc(arena_t *arena, void *ptr, size_t old_size, size_t size);
+
+/** Like stringf, but allocates from @p arena. */
+char *arena_stringf(arena_t *arena, const char *format, ...);
+
+/**
+ * Frees everything allocated from @p arena. If the arena had to grow, it
+ * keeps one larger block for the next round.
+ */
+void arena_reset(arena_t *arena);
+
+#endif
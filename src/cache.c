@@ -1,116 +1,812 @@
 /*
  * This file is part of musicd.
  * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
- * 
+ *
  * Musicd is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
  * (at your option) any later version.
- * 
+ *
  * Musicd is distributed in the hope that it will be useful,
  * but WITHOUT ANY WARRANTY; without even the implied warranty of
  * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  * GNU General Public License for more details.
- * 
+ *
  * You should have received a copy of the GNU General Public License
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
+
+/* For mkstemp, fdopen and mmap */
+#define _POSIX_C_SOURCE 200809L
+
 #include "cache.h"
 
 #include "config.h"
 #include "log.h"
 #include "strings.h"
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Entries are stored in <cache-dir>/<kind>/<shard>/<name>, the shard being
+ * two hex digits of the name's hash. Every entry is kept in an index in
+ * memory, so lookups never touch the file system.
+ *
+ * Only derived entries are in the LRU list and count against cache-size.
+ * Originals are counted separately and never evicted.
+ */
+
+#define SHARDS 256
+#define BUCKETS 4096
+
+/** Default cache-size in megabytes */
+#define DEFAULT_SIZE 512
+
+/*
+ * Entries up to MEMORY_OBJECT_MAX bytes are also kept in memory, split into
+ * stripes with a lock, buckets and LRU list of their own. Larger entries are
+ * mapped from their file when acquired.
+ */
+#define STRIPES 16
+#define STRIPE_BUCKETS 256
+#define MEMORY_OBJECT_MAX (128 * 1024)
+
+/** Default cache-memory in megabytes */
+#define DEFAULT_MEMORY 32
+
+static const char *kind_dirs[CACHE_KINDS] = { "derived", "original" };
+
+typedef struct entry {
+  char *name;
+  int64_t size;
+  time_t access;
+  cache_kind_t kind;
+  /** Changes whenever the entry is stored, see cache_acquire */
+  uint64_t generation;
+
+  struct entry *bucket_next;
+  /* Least recently used list, most recent first, only derived entries */
+  struct entry *lru_prev;
+  struct entry *lru_next;
+} entry_t;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static entry_t *buckets[BUCKETS];
+static entry_t *lru_first = NULL, *lru_last = NULL;
 
+/** Bytes of derived entries, which are kept under budget */
+static int64_t used = 0, budget = 0;
+/** Bytes of original entries */
+static int64_t original_used = 0;
 
-static char *build_path(const char *name)
+static uint64_t generations = 0;
+
+typedef struct memory_entry {
+  char *name;
+  cache_data_t *data;
+  time_t touched; /**< When the entry's place in the disk LRU was refreshed */
+
+  struct memory_entry *bucket_next;
+  struct memory_entry *lru_prev;
+  struct memory_entry *lru_next;
+} memory_entry_t;
+
+typedef struct stripe {
+  pthread_mutex_t mutex;
+  memory_entry_t *buckets[STRIPE_BUCKETS];
+  memory_entry_t *lru_first, *lru_last;
+  int64_t used;
+} __attribute__((aligned(64))) stripe_t;
+
+static stripe_t stripes[STRIPES];
+static int64_t stripe_budget = 0;
+
+
+static uint32_t hash_name(const char *name)
 {
-  const char *directory = config_to_path("cache-dir");
-  return stringf("%s/%s", directory, name);
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for (; *name; ++name) {
+    hash = (hash ^ (uint8_t)*name) * 16777619u;
+  }
+  return hash;
+}
+
+static char *build_path(const char *name, cache_kind_t kind)
+{
+  return stringf("%s/%s/%02x/%s", config_to_path("cache-dir"),
+                 kind_dirs[kind], hash_name(name) % SHARDS, name);
+}
+
+
+static void lru_unlink(entry_t *entry)
+{
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    lru_first = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    lru_last = entry->lru_prev;
+  }
+}
+
+static void lru_push(entry_t *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = lru_first;
+  if (lru_first) {
+    lru_first->lru_prev = entry;
+  } else {
+    lru_last = entry;
+  }
+  lru_first = entry;
+}
+
+/**
+ * Moves @p entry to the front of the LRU list and marks it accessed.
+ */
+static void touch(entry_t *entry)
+{
+  if (entry->kind == CACHE_KIND_DERIVED) {
+    lru_unlink(entry);
+    lru_push(entry);
+  }
+  entry->access = time(NULL);
+}
+
+static int64_t *usage(cache_kind_t kind)
+{
+  return kind == CACHE_KIND_DERIVED ? &used : &original_used;
+}
+
+static entry_t *find(const char *name)
+{
+  entry_t *entry;
+  for (entry = buckets[hash_name(name) % BUCKETS]; entry;
+       entry = entry->bucket_next) {
+    if (!strcmp(entry->name, name)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static entry_t *insert(const char *name, cache_kind_t kind)
+{
+  entry_t *entry = calloc(1, sizeof(entry_t)), **bucket;
+
+  bucket = &buckets[hash_name(name) % BUCKETS];
+  entry->name = strcopy(name);
+  entry->kind = kind;
+  entry->bucket_next = *bucket;
+  *bucket = entry;
+  if (kind == CACHE_KIND_DERIVED) {
+    lru_push(entry);
+  }
+  return entry;
+}
+
+static void remove_entry(entry_t *entry)
+{
+  entry_t **p;
+  for (p = &buckets[hash_name(entry->name) % BUCKETS]; *p != entry;
+       p = &(*p)->bucket_next) { }
+  *p = entry->bucket_next;
+  if (entry->kind == CACHE_KIND_DERIVED) {
+    lru_unlink(entry);
+  }
+  *usage(entry->kind) -= entry->size;
+  free(entry->name);
+  free(entry);
+}
+
+
+static void memory_lru_unlink(stripe_t *stripe, memory_entry_t *entry)
+{
+  if (entry->lru_prev) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    stripe->lru_first = entry->lru_next;
+  }
+  if (entry->lru_next) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    stripe->lru_last = entry->lru_prev;
+  }
+}
+
+static void memory_unlink(stripe_t *stripe, memory_entry_t *entry)
+{
+  memory_entry_t **p;
+
+  for (p = &stripe->buckets[hash_name(entry->name) / STRIPES % STRIPE_BUCKETS];
+       *p != entry; p = &(*p)->bucket_next) { }
+  *p = entry->bucket_next;
+
+  memory_lru_unlink(stripe, entry);
+  stripe->used -= entry->data->size + sizeof(memory_entry_t);
+}
+
+static void memory_push(stripe_t *stripe, memory_entry_t *entry)
+{
+  entry->lru_prev = NULL;
+  entry->lru_next = stripe->lru_first;
+  if (stripe->lru_first) {
+    stripe->lru_first->lru_prev = entry;
+  } else {
+    stripe->lru_last = entry;
+  }
+  stripe->lru_first = entry;
+}
+
+static memory_entry_t *memory_find(stripe_t *stripe, const char *name,
+                                   uint32_t hash)
+{
+  memory_entry_t *entry;
+  for (entry = stripe->buckets[hash / STRIPES % STRIPE_BUCKETS]; entry;
+       entry = entry->bucket_next) {
+    if (!strcmp(entry->name, name)) {
+      return entry;
+    }
+  }
+  return NULL;
+}
+
+static void memory_free(memory_entry_t *entry)
+{
+  cache_release(entry->data);
+  free(entry->name);
+  free(entry);
+}
+
+/**
+ * @returns referenced data of @p name if kept in memory. @p touch is set if
+ * the entry's place in the disk LRU hasn't been refreshed in this second.
+ */
+static cache_data_t *memory_get(const char *name, bool *touch)
+{
+  time_t now = time(NULL);
+  uint32_t hash = hash_name(name);
+  stripe_t *stripe = &stripes[hash % STRIPES];
+  memory_entry_t *entry;
+  cache_data_t *result = NULL;
+
+  pthread_mutex_lock(&stripe->mutex);
+  entry = memory_find(stripe, name, hash);
+  if (entry) {
+    memory_lru_unlink(stripe, entry);
+    memory_push(stripe, entry);
+    result = entry->data;
+    __atomic_add_fetch(&result->refs, 1, __ATOMIC_RELAXED);
+    *touch = entry->touched != now;
+    entry->touched = now;
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+  return result;
+}
+
+/**
+ * Keeps @p data of @p name in memory, evicting the least recently used
+ * entries of the stripe if it grows too large.
+ */
+static void memory_put(const char *name, cache_data_t *data)
+{
+  uint32_t hash = hash_name(name);
+  stripe_t *stripe = &stripes[hash % STRIPES];
+  memory_entry_t *entry, *evicted = NULL;
+  int64_t size = data->size + sizeof(memory_entry_t);
+
+  if (size > stripe_budget) {
+    return;
+  }
+
+  pthread_mutex_lock(&stripe->mutex);
+  if (memory_find(stripe, name, hash)) {
+    /* Another thread was quicker */
+    pthread_mutex_unlock(&stripe->mutex);
+    return;
+  }
+
+  while (stripe->used + size > stripe_budget) {
+    entry = stripe->lru_last;
+    memory_unlink(stripe, entry);
+    entry->bucket_next = evicted;
+    evicted = entry;
+  }
+
+  entry = malloc(sizeof(memory_entry_t));
+  entry->name = strcopy(name);
+  entry->data = data;
+  entry->touched = time(NULL);
+  __atomic_add_fetch(&data->refs, 1, __ATOMIC_RELAXED);
+  entry->bucket_next = stripe->buckets[hash / STRIPES % STRIPE_BUCKETS];
+  stripe->buckets[hash / STRIPES % STRIPE_BUCKETS] = entry;
+  memory_push(stripe, entry);
+  stripe->used += size;
+  pthread_mutex_unlock(&stripe->mutex);
+
+  for (; evicted; evicted = entry) {
+    entry = evicted->bucket_next;
+    memory_free(evicted);
+  }
+}
+
+/**
+ * Forgets in-memory copy of @p name.
+ */
+static void memory_drop(const char *name)
+{
+  uint32_t hash = hash_name(name);
+  stripe_t *stripe = &stripes[hash % STRIPES];
+  memory_entry_t *entry;
+
+  pthread_mutex_lock(&stripe->mutex);
+  entry = memory_find(stripe, name, hash);
+  if (entry) {
+    memory_unlink(stripe, entry);
+  }
+  pthread_mutex_unlock(&stripe->mutex);
+
+  if (entry) {
+    memory_free(entry);
+  }
+}
+
+
+/**
+ * Removes least recently used derived entries until they fit in cache-size.
+ * @note Must be called with mutex locked.
+ */
+static void evict()
+{
+  entry_t *entry, *prev;
+  char *path;
+  int count = 0;
+
+  for (entry = lru_last; entry && used > budget; entry = prev) {
+    prev = entry->lru_prev;
+    path = build_path(entry->name, entry->kind);
+    unlink(path);
+    free(path);
+    memory_drop(entry->name);
+    remove_entry(entry);
+    ++count;
+  }
+
+  if (count) {
+    musicd_log(LOG_DEBUG, "cache", "evicted %d entries", count);
+  }
+}
+
+
+static int make_directory(const char *path)
+{
+  if (mkdir(path, 0777) && errno != EEXIST) {
+    musicd_perror(LOG_ERROR, "cache", "could not create directory %s", path);
+    return -1;
+  }
+  return 0;
+}
+
+static int compare_access(const void *a, const void *b)
+{
+  time_t a_access = (*(entry_t **)a)->access,
+         b_access = (*(entry_t **)b)->access;
+  return a_access < b_access ? -1 : a_access > b_access;
+}
+
+/**
+ * Adds entries found in shard directory @p path to @p loaded.
+ */
+static void load_shard(const char *path, cache_kind_t kind,
+                       entry_t ***loaded, int *count, int *size)
+{
+  DIR *dir;
+  struct dirent *dirent;
+  struct stat status;
+  entry_t *entry;
+  char *file;
+
+  dir = opendir(path);
+  if (!dir) {
+    return;
+  }
+
+  while ((dirent = readdir(dir))) {
+    if (dirent->d_name[0] == '.') {
+      continue;
+    }
+    file = stringf("%s/%s", path, dirent->d_name);
+
+    if (strstr(dirent->d_name, ".tmp-")) {
+      /* Left behind by an interrupted write */
+      unlink(file);
+    } else if (!stat(file, &status) && S_ISREG(status.st_mode)) {
+      if (*count == *size) {
+        *size = *size ? *size * 2 : 1024;
+        *loaded = realloc(*loaded, *size * sizeof(entry_t *));
+      }
+      entry = calloc(1, sizeof(entry_t));
+      entry->name = strcopy(dirent->d_name);
+      entry->size = status.st_size;
+      entry->access = status.st_atime;
+      entry->kind = kind;
+      (*loaded)[(*count)++] = entry;
+    }
+
+    free(file);
+  }
+  closedir(dir);
+}
+
+/**
+ * Moves entries of the old flat layout, <cache-dir>/<name>, to their shards.
+ */
+static void migrate_flat(const char *directory)
+{
+  DIR *dir;
+  struct dirent *dirent;
+  struct stat status;
+  cache_kind_t kind;
+  char *file, *path;
+  int count = 0;
+
+  dir = opendir(directory);
+  if (!dir) {
+    return;
+  }
+
+  while ((dirent = readdir(dir))) {
+    if (dirent->d_name[0] == '.') {
+      continue;
+    }
+    file = stringf("%s/%s", directory, dirent->d_name);
+
+    if (!stat(file, &status) && S_ISREG(status.st_mode)) {
+      /* Embedded cover art was the only kind of original */
+      kind = strbeginswith(dirent->d_name, "embedded_")
+           ? CACHE_KIND_ORIGINAL : CACHE_KIND_DERIVED;
+      path = build_path(dirent->d_name, kind);
+      if (strstr(dirent->d_name, ".tmp-") || rename(file, path)) {
+        unlink(file);
+      } else {
+        ++count;
+      }
+      free(path);
+    }
+
+    free(file);
+  }
+  closedir(dir);
+
+  if (count) {
+    musicd_log(LOG_INFO, "cache", "moved %d entries to the sharded layout",
+               count);
+  }
 }
 
 int cache_open()
 {
   const char *directory = config_to_path("cache-dir");
-  struct stat status;
-  if (stat(directory, &status)) {            
-    if (mkdir(directory, 0777)) {
-      musicd_perror(LOG_ERROR, "cache", "could not create directory %s",
-                    directory);
+  entry_t **loaded = NULL, **bucket;
+  char *path;
+  int kind, shard, count = 0, size = 0, i;
+
+  budget = config_to_int("cache-size");
+  if (budget <= 0) {
+    budget = DEFAULT_SIZE;
+  }
+  budget *= 1024 * 1024;
+
+  stripe_budget = config_to_int("cache-memory");
+  if (stripe_budget <= 0) {
+    stripe_budget = DEFAULT_MEMORY;
+  }
+  stripe_budget = stripe_budget * 1024 * 1024 / STRIPES;
+  for (i = 0; i < STRIPES; ++i) {
+    pthread_mutex_init(&stripes[i].mutex, NULL);
+  }
+
+  if (make_directory(directory)) {
+    return -1;
+  }
+
+  for (kind = 0; kind < CACHE_KINDS; ++kind) {
+    path = stringf("%s/%s", directory, kind_dirs[kind]);
+    if (make_directory(path)) {
+      free(path);
       return -1;
     }
+    free(path);
+
+    for (shard = 0; shard < SHARDS; ++shard) {
+      path = stringf("%s/%s/%02x", directory, kind_dirs[kind], shard);
+      if (make_directory(path)) {
+        free(path);
+        return -1;
+      }
+      free(path);
+    }
+  }
+
+  migrate_flat(directory);
+
+  for (kind = 0; kind < CACHE_KINDS; ++kind) {
+    for (shard = 0; shard < SHARDS; ++shard) {
+      path = stringf("%s/%s/%02x", directory, kind_dirs[kind], shard);
+      load_shard(path, kind, &loaded, &count, &size);
+      free(path);
+    }
   }
+
+  /* Oldest first, so that the most recently accessed end up first in LRU */
+  if (count) {
+    qsort(loaded, count, sizeof(entry_t *), compare_access);
+  }
+
+  pthread_mutex_lock(&mutex);
+  for (i = 0; i < count; ++i) {
+    bucket = &buckets[hash_name(loaded[i]->name) % BUCKETS];
+    loaded[i]->bucket_next = *bucket;
+    *bucket = loaded[i];
+    if (loaded[i]->kind == CACHE_KIND_DERIVED) {
+      lru_push(loaded[i]);
+    }
+    *usage(loaded[i]->kind) += loaded[i]->size;
+  }
+  evict();
+  musicd_log(LOG_VERBOSE, "cache", "%d entries, %" PRId64 " of %" PRId64
+             " bytes derived, %" PRId64 " bytes original", count, used,
+             budget, original_used);
+  pthread_mutex_unlock(&mutex);
+
+  free(loaded);
   return 0;
 }
 
-bool cache_exists(const char* name)
+char *cache_path(const char *name)
 {
-  char *path;
-  struct stat status;
+  entry_t *entry;
+  char *result = NULL;
 
-  path = build_path(name);
-  
-  if (stat(path, &status)) {
-    free(path);
-    return false;
+  pthread_mutex_lock(&mutex);
+  entry = find(name);
+  if (entry) {
+    result = build_path(name, entry->kind);
   }
-  free(path);
-  return true;
+  pthread_mutex_unlock(&mutex);
+  return result;
+}
+
+bool cache_exists(const char* name)
+{
+  bool result;
+  pthread_mutex_lock(&mutex);
+  result = find(name) != NULL;
+  pthread_mutex_unlock(&mutex);
+  return result;
 }
 
 
-char *cache_get(const char *name, int *size)
+static cache_data_t *read_data(int fd, int size)
 {
+  cache_data_t *data = calloc(1, sizeof(cache_data_t));
+  char *buf = NULL;
+  void *map;
+  ssize_t n;
+  int done = 0;
+
+  data->refs = 1;
+
+  if (size > MEMORY_OBJECT_MAX) {
+    map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      musicd_perror(LOG_ERROR, "cache", "can't map entry");
+      free(data);
+      return NULL;
+    }
+    data->map = map;
+    data->data = map;
+    data->size = size;
+    return data;
+  }
+
+  if (size > 0) {
+    buf = malloc(size);
+    while (done < size && (n = read(fd, buf + done, size - done)) > 0) {
+      done += n;
+    }
+  }
+  data->data = buf;
+  data->size = done;
+  return data;
+}
+
+cache_data_t *cache_acquire(const char *name)
+{
+  entry_t *entry;
+  cache_data_t *data;
+  struct stat status;
   char *path;
-  FILE *file;
-  char *data = NULL;
-  
-  if (!cache_exists(name)) {
+  bool refresh = false;
+  uint64_t generation;
+  int fd;
+
+  data = memory_get(name, &refresh);
+  if (data) {
+    /* Keep hot entries from being evicted from disk, and so from memory */
+    if (refresh) {
+      pthread_mutex_lock(&mutex);
+      entry = find(name);
+      if (entry) {
+        touch(entry);
+      }
+      pthread_mutex_unlock(&mutex);
+    }
+    return data;
+  }
+
+  pthread_mutex_lock(&mutex);
+  entry = find(name);
+  if (!entry) {
+    pthread_mutex_unlock(&mutex);
     return NULL;
   }
-  
-  path = build_path(name);
-  
-  file = fopen(path, "rb");
+  touch(entry);
+  path = build_path(name, entry->kind);
+  generation = entry->generation;
+  pthread_mutex_unlock(&mutex);
+
+  fd = open(path, O_RDONLY);
   free(path);
-  if (!file) {
-    /* What? */
+  if (fd < 0) {
+    /* Removed behind our back */
+    pthread_mutex_lock(&mutex);
+    entry = find(name);
+    if (entry) {
+      remove_entry(entry);
+    }
+    pthread_mutex_unlock(&mutex);
     return NULL;
   }
-  
-  fseek(file, 0, SEEK_END);
-  *size = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  
-  if (*size > 0) {
-    data = malloc(*size);
-    *size = fread(data, 1, *size, file);
-  }
-  fclose(file);
-  
+
+  data = NULL;
+  if (!fstat(fd, &status)) {
+    data = read_data(fd, status.st_size);
+  }
+  close(fd);
+
+  if (data && !data->map) {
+    /* If the entry was replaced while reading, the data is stale and must
+     * not outlive this reference. cache_set drops the memory copy with the
+     * mutex held, so checking under it is enough. */
+    pthread_mutex_lock(&mutex);
+    entry = find(name);
+    if (entry && entry->generation == generation) {
+      memory_put(name, data);
+    }
+    pthread_mutex_unlock(&mutex);
+  }
   return data;
 }
 
-void cache_set(const char *name, const char *data, int size)
+void cache_release(cache_data_t *data)
 {
-  char *path;
+  if (!data || __atomic_sub_fetch(&data->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (data->map) {
+    munmap(data->map, data->size);
+  } else {
+    free((char *)data->data);
+  }
+  free(data);
+}
+
+void cache_set(const char *name, cache_kind_t kind, const char *data,
+               int size)
+{
+  entry_t *entry;
+  char *path, *tmp_path;
   FILE *file;
-  
-  path = build_path(name);
-  
-  file = fopen(path, "wb");
-  free(path);
+  int fd;
+
+  path = build_path(name, kind);
+  tmp_path = stringf("%s.tmp-XXXXXX", path);
+
+  /* Readers must never see a partially written entry */
+  fd = mkstemp(tmp_path);
+  if (fd < 0) {
+    musicd_perror(LOG_ERROR, "cache", "could not create %s", tmp_path);
+    goto finish;
+  }
+  file = fdopen(fd, "wb");
   if (!file) {
-    /* What? */
-    return;
+    close(fd);
+    unlink(tmp_path);
+    goto finish;
+  }
+
+  if ((size > 0 && fwrite(data, 1, size, file) != (size_t)size)
+   || fclose(file)) {
+    musicd_perror(LOG_ERROR, "cache", "could not write %s", tmp_path);
+    unlink(tmp_path);
+    goto finish;
   }
-  
-  fwrite(data, 1, size, file);
-  
-  fclose(file);
+
+  pthread_mutex_lock(&mutex);
+  if (rename(tmp_path, path)) {
+    musicd_perror(LOG_ERROR, "cache", "could not rename %s", tmp_path);
+    unlink(tmp_path);
+    pthread_mutex_unlock(&mutex);
+    goto finish;
+  }
+
+  memory_drop(name);
+
+  entry = find(name);
+  if (entry && entry->kind != kind) {
+    /* Stored elsewhere under the other kind */
+    free(path);
+    path = build_path(name, entry->kind);
+    unlink(path);
+    remove_entry(entry);
+    entry = NULL;
+  }
+  if (!entry) {
+    entry = insert(name, kind);
+  } else {
+    touch(entry);
+  }
+  *usage(kind) += size - entry->size;
+  entry->size = size;
+  entry->access = time(NULL);
+  entry->generation = ++generations;
+
+  evict();
+  pthread_mutex_unlock(&mutex);
+
+finish:
+  free(tmp_path);
+  free(path);
 }
 
+int cache_remove_unused(cache_kind_t kind, bool (*used)(const char *name))
+{
+  entry_t *entry, *next;
+  char *path;
+  int count = 0, i;
 
+  pthread_mutex_lock(&mutex);
+  for (i = 0; i < BUCKETS; ++i) {
+    for (entry = buckets[i]; entry; entry = next) {
+      next = entry->bucket_next;
+      if (entry->kind != kind || used(entry->name)) {
+        continue;
+      }
+      path = build_path(entry->name, entry->kind);
+      unlink(path);
+      free(path);
+      memory_drop(entry->name);
+      remove_entry(entry);
+      ++count;
+    }
+  }
+  pthread_mutex_unlock(&mutex);
+  return count;
+}
@@ -21,18 +21,67 @@
 #include <stdbool.h>
 
 /**
- * Ensures cache-dir exists.
+ * Reference to cached data, released with cache_release.
+ */
+typedef struct cache_data {
+  /** NULL if the entry is empty */
+  const char *data;
+  int size;
+
+  /* Private */
+  int refs;
+  /** Mapped region if the entry is too large to be kept in memory */
+  void *map;
+} cache_data_t;
+
+typedef enum cache_kind {
+  /** Can be made again, evicted least recently used first */
+  CACHE_KIND_DERIVED = 0,
+  /** The only copy of the data, never evicted */
+  CACHE_KIND_ORIGINAL,
+  CACHE_KINDS
+} cache_kind_t;
+
+/**
+ * Ensures cache-dir exists and indexes its entries, moving entries of the
+ * old flat layout in place. Derived entries are evicted when they grow over
+ * cache-size megabytes, original entries don't count toward it. Small
+ * entries are also kept in up to cache-memory megabytes of memory.
  */
 int cache_open();
 
+/**
+ * @returns path of @p name in cache-dir, which must be freed, or NULL if
+ * @p name is not cached.
+ */
+char *cache_path(const char *name);
+
 bool cache_exists(const char *name);
 
 /**
- * @Returns data @p name from cache or NULL if doesn't exist.
+ * @returns data of @p name which must be released with cache_release or NULL
+ * if not cached. Data of entries in memory is shared without copying or
+ * system calls.
  */
-char *cache_get(const char *name, int *size);
+cache_data_t *cache_acquire(const char *name);
+/**
+ * Releases @p data, which may be NULL.
+ */
+void cache_release(cache_data_t *data);
 
-void cache_set(const char *name, const char *data, int size);
+/**
+ * Stores @p data as @p name. The entry is replaced atomically, so readers see
+ * either the old or the new data in full.
+ */
+void cache_set(const char *name, cache_kind_t kind, const char *data,
+               int size);
+
+/**
+ * Removes entries of @p kind for which @p used returns false. @p used is
+ * called with the cache locked and must not call back into the cache.
+ * @returns amount of removed entries
+ */
+int cache_remove_unused(cache_kind_t kind, bool (*used)(const char *name));
 
 
 #endif
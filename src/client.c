@@ -110,6 +110,11 @@ client_t *client_new(int fd)
 
 void client_close(client_t *client)
 {
+  if (client->state == CLIENT_STATE_WAIT_TASK) {
+    /* Nobody will be waiting for the result */
+    task_cancel(client->wait_task);
+    free(client->wait_data);
+  }
   if (client->protocol) {
     client->protocol->close(client->self);
   }
@@ -122,9 +127,6 @@ void client_close(client_t *client)
 
 int client_poll_fd(client_t *client)
 {
-  if (client->state == CLIENT_STATE_WAIT_TASK) {
-    return task_pollfd(client->wait_task);
-  }
   return client->fd;
 }
 
@@ -165,6 +167,11 @@ int client_process(client_t *client)
     return result;
   }
 
+  if (client->state == CLIENT_STATE_WAIT_TASK) {
+    /* Only watching for disconnection, client_task_finished resumes */
+    return 0;
+  }
+
   if (!client->protocol) {
     /* The client has no protocol detected yet */
 
@@ -183,16 +190,6 @@ int client_process(client_t *client)
     client->self = client->protocol->open(client);
   }
 
-  if (client->state == CLIENT_STATE_WAIT_TASK) {
-    /* Client was waiting for task to finish and now the task manager signaled
-     * through the pipe. */
-    client->state = CLIENT_STATE_NORMAL;
-    task_free(client->wait_task);
-    if (client->wait_callback(client->self, client->wait_data) < 0) {
-      return -1;
-    }
-  }
-
   /* (Try to) purge the entire outgoing buffer. */
 
   if (string_size(client->outbuf) > 0) {
@@ -262,6 +259,7 @@ int client_send(client_t *client, const char *format, ...)
     buf = realloc(buf, size);
   }
   string_append(client->outbuf, buf);
+  client->sent += n;
   free(buf);
   return n;
 }
@@ -269,6 +267,7 @@ int client_send(client_t *client, const char *format, ...)
 int client_write(client_t *client, const char *data, size_t n)
 {
   string_nappend(client->outbuf, data, n);
+  client->sent += n;
   return n;
 }
 
@@ -285,12 +284,24 @@ void client_stop_feed(client_t *client)
 void client_wait_task(client_t *client, task_t *task,
                       client_callback_t callback, void *data)
 {
+  task->owner = client;
   client->wait_task = task;
   client->wait_callback = callback;
   client->wait_data = data;
   client->state = CLIENT_STATE_WAIT_TASK;
 }
 
+int client_task_finished(client_t *client)
+{
+  client->state = CLIENT_STATE_NORMAL;
+  task_free(client->wait_task);
+  client->wait_task = NULL;
+  if (client->wait_callback(client->self, client->wait_data) < 0) {
+    return -1;
+  }
+  return client_process(client);
+}
+
 void client_drain(client_t *client)
 {
   client->state = CLIENT_STATE_DRAIN;
@@ -38,7 +38,8 @@ typedef enum client_state {
   /** Task state: the client is waiting for a task to complete */
   CLIENT_STATE_WAIT_TASK,
   /** Drain state: connection should be terminated once outbuf is empty */
-  CLIENT_STATE_DRAIN
+  CLIENT_STATE_DRAIN,
+  CLIENT_STATE_COUNT /**< Amount of states, not a state */
 } client_state_t;
 
 typedef int (*client_callback_t)(void *self, void *data);
@@ -50,6 +51,7 @@ typedef struct client {
 
   string_t *inbuf;
   string_t *outbuf;
+  int64_t sent; /**< Bytes queued to outbuf in total */
 
   protocol_t *protocol;
   void *self;
@@ -90,8 +92,18 @@ int client_write(client_t *client, const char *data, size_t n);
 void client_start_feed(client_t *client);
 void client_stop_feed(client_t *client);
 
+/**
+ * Makes @p client wait for @p task, once finished @p callback is called
+ * with @p data by client_task_finished. If the client disconnects before,
+ * the task is cancelled and @p data is freed with free().
+ */
 void client_wait_task(client_t *client, task_t *task,
                       client_callback_t callback, void *data);
+/**
+ * Resumes @p client after the task it was waiting for has finished.
+ * @returns nonzero if the client should be terminated
+ */
+int client_task_finished(client_t *client);
 
 void client_drain(client_t *client);
 
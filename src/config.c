@@ -96,12 +96,22 @@ static char *read_value(const char *line)
   return result;
 }
 
+/*
+ * Other threads read values without locking while SIGHUP replaces them, so
+ * replaced values and their paths are never freed. They only change on
+ * reload, which keeps them few.
+ */
+
 typedef struct setting {
   char *key;
+  /** NULL if only a hook is set */
   char *value;
   
-  /* Stores value returned by config_to_path */
+  /** value with '~' expanded to $HOME, NULL if it doesn't begin with '~' */
   char *path_value;
+
+  /** Given on the command line, config file values are ignored */
+  int from_args;
   
   void (*hook)(char *value);
   
@@ -112,6 +122,8 @@ TAILQ_HEAD(setting_list, setting);
 
 static struct setting_list settings;
 
+static void set(const char *key, const char *value, int from_args);
+
 
 static setting_t *setting_by_key(const char *key)
 {
@@ -133,8 +145,10 @@ void config_set_hook(const char *key, void (*hook)(char *value))
 {
   setting_t *setting = setting_by_key(key);
   if (!setting) {
-    config_set(key, "");
-    setting = setting_by_key(key);
+    setting = malloc(sizeof(setting_t));
+    memset(setting, 0, sizeof(setting_t));
+    setting->key = strcopy(key);
+    TAILQ_INSERT_TAIL(&settings, setting, settings);
   }
   setting->hook = hook;
 }
@@ -209,7 +223,7 @@ int config_load_args(int argc, char **argv)
     } else {
       value = "true";
     }
-    config_set(key + 2, value);
+    set(key + 2, value, 1);
   }
   return 0;
 }
@@ -225,32 +239,29 @@ const char *config_get(const char *key)
 char *config_get_value(const char *key)
 {
   setting_t *setting = setting_by_key(key);
-  if (!setting) {
+  if (!setting || !setting->value) {
     return NULL;
   }
   return setting->value;
 }
 
-char *config_to_path(const char *key)
+/**
+ * @returns @p value with '~' in the beginning resolved to $HOME, NULL if
+ * there is no '~' or $HOME is not set.
+ */
+static char *expand_home(const char *value)
 {
-  char *home, *value;
+  char *home, *result;
   int str_len;
-  setting_t *setting;
   
-  setting = setting_by_key(key);
-  if (!setting) {
+  if (value[0] != '~') {
     return NULL;
   }
   
-  if (setting->value[0] != '~') {
-    return setting->value;
-  }
-  
-  value = setting->value + 1;
+  ++value;
   
   home = getenv("HOME");
   if (!home) {
-    musicd_log(LOG_ERROR, "config", "$HOME not set");
     return NULL;
   }
   
@@ -264,15 +275,30 @@ char *config_to_path(const char *key)
     ++value;
   }
   
-  if (setting->path_value) {
-    free(setting->path_value);
-  }
-  
   str_len = strlen(home) + strlen(value) + 2;
   
-  setting->path_value = calloc(str_len, sizeof(char));
-  snprintf(setting->path_value, str_len, "%s/%s", home, value);
+  result = calloc(str_len, sizeof(char));
+  snprintf(result, str_len, "%s/%s", home, value);
   
+  return result;
+}
+
+char *config_to_path(const char *key)
+{
+  setting_t *setting;
+  
+  setting = setting_by_key(key);
+  if (!setting || !setting->value) {
+    return NULL;
+  }
+  
+  if (setting->value[0] != '~') {
+    return setting->value;
+  }
+  
+  if (!setting->path_value) {
+    musicd_log(LOG_ERROR, "config", "$HOME not set");
+  }
   return setting->path_value;
 }
 
@@ -280,7 +306,7 @@ int config_to_int(const char *key)
 {
   int result = 0;
   setting_t *setting = setting_by_key(key);
-  if (!setting) {
+  if (!setting || !setting->value) {
     return 0;
   }
   sscanf(setting->value, "%d", &result);
@@ -290,7 +316,7 @@ int config_to_int(const char *key)
 int config_to_bool(const char *key)
 {
   setting_t *setting = setting_by_key(key);
-  if (!setting) {
+  if (!setting || !setting->value) {
     return 0;
   }
   if (!strcmp("false", setting->value)) {
@@ -300,7 +326,11 @@ int config_to_bool(const char *key)
 }
 
 
-void config_set(const char *key, const char *value)
+/**
+ * Sets @p key to @p value, unless it was given on the command line and
+ * @p from_args is not set.
+ */
+static void set(const char *key, const char *value, int from_args)
 {
   setting_t *setting = setting_by_key(key);
   if (!setting) {
@@ -310,15 +340,30 @@ void config_set(const char *key, const char *value)
     setting->key = strcopy(key);
     TAILQ_INSERT_TAIL(&settings, setting, settings);
   } else {
+    if (setting->from_args && !from_args) {
+      /* The command line has the highest priority */
+      return;
+    }
+    setting->from_args = from_args;
+    if (setting->value && !strcmp(setting->value, value)) {
+      /* Unchanged, as for most settings when reloading */
+      return;
+    }
     musicd_log(LOG_DEBUG, "config", "set setting: %s %s", key, value);
-    free(setting->value);
   }
   
   setting->value = strcopy(value);
+  setting->path_value = expand_home(value);
+  setting->from_args = from_args;
   
   if (setting->hook) {
     setting->hook(setting->value);
   }
 }
 
+void config_set(const char *key, const char *value)
+{
+  set(key, value, 0);
+}
+
 
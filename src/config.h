@@ -21,11 +21,16 @@
 void config_init();
 
 /**
- * @p hook will be called when setting @p key changes.
+ * @p hook will be called when setting @p key changes. Setting a hook doesn't
+ * set the value.
  */
 void config_set_hook(const char *key, void (*hook)(char *value));
 
 int config_load_file(const char *path);
+/**
+ * Sets the keys given on the command line. Only the command line can change
+ * them afterwards.
+ */
 int config_load_args(int argc, char **argv);
 
 /**
@@ -53,6 +58,10 @@ int config_to_int(const char *key);
 
 int config_to_bool(const char *key);
 
+/**
+ * Sets @p key to @p value. Nothing happens if the value doesn't change or
+ * @p key was given on the command line. Values returned earlier stay valid.
+ */
 void config_set(const char *key, const char *value);
 
 #endif
@@ -89,6 +89,17 @@ static int read_string(const char *src, char *dst)
   return p - src;
 }
 
+/**
+ * Appends @p track to the NULL-terminated array @p tracks of @p count tracks.
+ */
+static track_t **tracks_append(track_t **tracks, int *count, track_t *track)
+{
+  tracks = realloc(tracks, (*count + 2) * sizeof(track_t *));
+  tracks[(*count)++] = track;
+  tracks[*count] = NULL;
+  return tracks;
+}
+
 /**
  * @todo FIXME Multiple files in same cue sheet
  * @todo FIXME Rewrite this garbage
@@ -107,7 +118,7 @@ bool cue_read(const char *cuepath, int64_t directory)
   
   int64_t track_file;
   
-  struct stat status;
+  struct stat status, status2;
   
   //char file[strlen(path) + 1024 + 2], cuefile[strlen(path) + 1024 + 2];
   
@@ -118,6 +129,9 @@ bool cue_read(const char *cuepath, int64_t directory)
    * This is mandatory for figuring out the track's length. Last track's
    * length is calculated from file's total length. */
   track_t *prev_track = NULL, *track = NULL, *file_track = NULL;
+  /* Tracks are added to the library in a single batch. */
+  track_t **tracks = NULL;
+  int tracks_count = 0;
   
   file = fopen(cuepath, "r");
   if (!file) {
@@ -205,7 +219,7 @@ bool cue_read(const char *cuepath, int64_t directory)
       strncpy(path2, path, i);
       strcpy(path2 + i, ".cue");
       
-      if (strcmp(path2, cuepath) && stat(path2, &status) == 0) {
+      if (strcmp(path2, cuepath) && stat(path2, &status2) == 0) {
         musicd_log(LOG_DEBUG, "cue",
                    "multiple cue sheets for '%s', trying '%s'",
                    path, path2);
@@ -231,7 +245,7 @@ bool cue_read(const char *cuepath, int64_t directory)
         }
       }
       
-      library_file_mtime_set(track_file, status.st_mtime);
+      library_file_stat_set(track_file, &status);
       
       musicd_log(LOG_DEBUG, "cue", "audio: %s", path);
       continue;
@@ -250,9 +264,7 @@ bool cue_read(const char *cuepath, int64_t directory)
           prev_track = track;
         } else {
           prev_track->duration = track->start - prev_track->start;
-          library_track_add(prev_track, directory);
-          scan_track_added();
-          track_free(prev_track);
+          tracks = tracks_append(tracks, &tracks_count, prev_track);
           prev_track = track;
         }
       }
@@ -281,15 +293,20 @@ bool cue_read(const char *cuepath, int64_t directory)
   
   if (prev_track) {
     prev_track->duration = track->start - prev_track->start;
-    library_track_add(prev_track, directory);
-    scan_track_added();
-    track_free(prev_track);
+    tracks = tracks_append(tracks, &tracks_count, prev_track);
   }
   if (track) {
     track->duration = file_track->duration - track->start;
-    library_track_add(track, directory);
-    scan_track_added();
-    track_free(track);
+    tracks = tracks_append(tracks, &tracks_count, track);
+  }
+  
+  if (tracks) {
+    if (library_tracks_add(tracks, directory) > 0) {
+      for (i = 0; i < tracks_count; ++i) {
+        scan_track_added();
+      }
+    }
+    tracks_free(tracks);
   }
   
   track_free(file_track);
@@ -19,6 +19,7 @@
 
 #include "config.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
 #include <inttypes.h>
@@ -33,6 +34,9 @@ static sqlite3 *db;
 
 static char *uid;
 
+/** Time the thread has spent in db_step */
+static __thread int64_t thread_step_usec = 0;
+
 static int create_schema();
 
 int db_open()
@@ -90,6 +94,19 @@ sqlite3 *db_handle()
 }
 
 
+int db_step(sqlite3_stmt *stmt)
+{
+  int64_t start = metrics_usec();
+  int result = sqlite3_step(stmt);
+  thread_step_usec += metrics_usec() - start;
+  return result;
+}
+
+int64_t db_thread_usec()
+{
+  return thread_step_usec;
+}
+
 void db_simple_exec(const char *sql, int *error)
 {
   int result = sqlite3_exec(db_handle(), sql, NULL, NULL, NULL);
@@ -121,7 +138,7 @@ static sqlite3_stmt *meta_get(const char *key)
   
   sqlite3_bind_text(stmt, 1, key, -1, NULL);
   
-  result = sqlite3_step(stmt);
+  result = db_step(stmt);
   if (result == SQLITE_DONE) {
     sqlite3_finalize(stmt);
     return NULL;
@@ -171,7 +188,7 @@ void db_meta_set_int(const char *key, int value)
   sqlite3_bind_text(stmt, 1, key, -1, NULL);
   sqlite3_bind_int(stmt, 2, value);
 
-  sqlite3_step(stmt);
+  db_step(stmt);
   sqlite3_finalize(stmt);
 }
 
@@ -199,7 +216,7 @@ void db_meta_set_string(const char *key, const char *value)
   sqlite3_bind_text(stmt, 1, key, -1, NULL);
   sqlite3_bind_text(stmt, 2, value, -1, NULL);
 
-  sqlite3_step(stmt);
+  db_step(stmt);
   sqlite3_finalize(stmt);
 }
 
@@ -244,13 +261,16 @@ static int create_schema()
     db_simple_exec("DROP TABLE IF EXISTS lyrics", &error);
     
     db_simple_exec("CREATE TABLE directories (path TEXT UNIQUE, mtime INT64, parentid INT64)", &error);
-    db_simple_exec("CREATE TABLE files (path TEXT UNIQUE, mtime INT64, directoryid INT64)", &error);
+    db_simple_exec("CREATE TABLE files (path TEXT UNIQUE, size INT64, mtime INT64, inode INT64, device INT64, directoryid INT64)", &error);
     db_simple_exec("CREATE TABLE artists (name TEXT UNIQUE)", &error);
     db_simple_exec("CREATE TABLE albums (name TEXT UNIQUE, artistid INT64, imageid INT64, tracks INT DEFAULT 0)", &error);
     db_simple_exec("CREATE TABLE tracks (fileid INT64, file TEXT, cuefileid INT64, cuefile TEXT, track INT, title TEXT, artistid INT64, artist TEXT, albumid INT64, album TEXT, start DOUBLE, duration DOUBLE, trackindex INT64)", &error);
-    db_simple_exec("CREATE TABLE images (fileid INT64, albumid INT64)", &error);
+    db_simple_exec("CREATE TABLE images (fileid INT64, albumid INT64, embedded TEXT, description TEXT)", &error);
     db_simple_exec("CREATE TABLE lyrics (trackid INT64 UNIQUE, lyrics TEXT, provider TEXT, source TEXT, mtime INT64)", &error);
 
+    /* Index for recognizing moved files */
+    db_simple_exec("CREATE INDEX files_inode_index ON files (device, inode)", &error);
+
     /* Index for good default sorting */
     db_simple_exec("CREATE INDEX tracks_default_index ON tracks (album COLLATE NOCASE ASC, track COLLATE NOCASE ASC, title COLLATE NOCASE ASC)", &error);
 
@@ -258,6 +278,9 @@ static int create_schema()
     db_meta_set_string("uid", uid);
   }
   
+  /* Sessions don't depend on the library, keep them over schema changes */
+  db_simple_exec("CREATE TABLE IF NOT EXISTS sessions (id TEXT PRIMARY KEY, user TEXT, last_request INT64)", &error);
+
   if (error) {
     musicd_log(LOG_ERROR, "db", "can't create database tables");
     return -1;
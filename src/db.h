@@ -21,7 +21,7 @@
 #include <stdint.h>
 #include <sqlite3.h>
 
-#define MUSICD_DB_SCHEMA 4
+#define MUSICD_DB_SCHEMA 6
 
 int db_open();
 void db_close();
@@ -30,6 +30,15 @@ const char *db_error();
 
 sqlite3 *db_handle();
 
+/**
+ * sqlite3_step accounting the time spent to the calling thread.
+ */
+int db_step(sqlite3_stmt *stmt);
+/**
+ * @returns microseconds the calling thread has spent in db_step.
+ */
+int64_t db_thread_usec();
+
 void db_simple_exec(const char *sql, int *error);
 
 const char *db_uid();
@@ -0,0 +1,80 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_HTTP_ROUTES_H
+#define MUSICD_HTTP_ROUTES_H
+
+/**
+ * HTTP routes. The router is generated at compile time by
+ * tools/http_builtin_pack from HTTP_METHODS and the builtin files, and walks
+ * the path once character by character.
+ */
+
+#define NO_AUTH 0x02 // Allow access without authorisation
+#define SHARE_CAPABLE 0x04 // Supports restricted share access
+#define ONLY_PREFIX 0x08 // Will be called as long as path begins with the name
+
+/**
+ * API methods as X(name, handler, flags). A route's method is its index in
+ * this list.
+ */
+#define HTTP_METHODS(X) \
+  X("/musicd", method_musicd, NO_AUTH) \
+  X("/auth", method_auth, NO_AUTH) \
+  \
+  X("/status", method_status, 0) \
+  \
+  X("/rescan", method_rescan, 0) \
+  \
+  X("/tracks", method_tracks, 0) \
+  X("/track/index", method_track_index, 0) \
+  X("/artists", method_artists, 0) \
+  X("/albums", method_albums, 0) \
+  \
+  X("/image", method_image, 0) \
+  X("/album/image", method_album_image, 0) \
+  X("/album/images", method_album_images, 0) \
+  \
+  X("/track/lyrics", method_track_lyrics, 0) \
+  \
+  X("/root", method_root, ONLY_PREFIX) \
+  \
+  X("/open", method_open, 0) \
+  \
+  X("/metrics", method_metrics, NO_AUTH)
+
+typedef enum http_route_type {
+  HTTP_ROUTE_METHOD = 1,
+  HTTP_ROUTE_BUILTIN
+} http_route_type_t;
+
+typedef struct http_route {
+  http_route_type_t type;
+  int method; /**< Index in HTTP_METHODS */
+  const char *url; /**< Builtin file, "/" is served as "/index.html" */
+  const char *data;
+  int length;
+} http_route_t;
+
+/**
+ * @returns route of @p path or NULL if there is none. Exact matches take
+ * precedence over ONLY_PREFIX methods, and methods over builtin files.
+ * @note Found in the generated http_routes.c
+ */
+const http_route_t *http_route_find(const char *path);
+
+#endif
@@ -28,11 +28,49 @@
 
 #include <FreeImage.h>
 
-char *image_cache_name(int64_t image, int size)
+static const struct {
+  FREE_IMAGE_FORMAT fif;
+  int flags;
+  const char *extension;
+  const char *mime;
+} formats[IMAGE_FORMATS] = {
+  { FIF_JPEG, JPEG_DEFAULT, "jpg", "image/jpeg" },
+  { FIF_WEBP, WEBP_DEFAULT, "webp", "image/webp" },
+};
+
+static bool supported[IMAGE_FORMATS];
+
+void image_init()
+{
+  image_format_t format;
+
+  for (format = 0; format < IMAGE_FORMATS; ++format) {
+    supported[format] = FreeImage_FIFSupportsWriting(formats[format].fif)
+                     && FreeImage_FIFSupportsExportBPP(formats[format].fif, 24);
+    if (!supported[format]) {
+      musicd_log(LOG_WARNING, "image", "FreeImage can't write %s, not "
+                 "making %s thumbnails", formats[format].mime,
+                 formats[format].extension);
+    }
+  }
+}
+
+bool image_format_supported(image_format_t format)
+{
+  return supported[format];
+}
+
+char *image_cache_name(int64_t image, int size, image_format_t format)
 { 
   /* Round to closest power of two */
   size = pow(2, ceil(log(size)/log(2)));
-  return stringf("%" PRId64 "_%d.jpg", image, size);
+  return stringf("%" PRId64 "_%d.%s", image, size,
+                 formats[format].extension);
+}
+
+const char *image_format_mime(image_format_t format)
+{
+  return formats[format].mime;
 }
 
 
@@ -41,21 +79,29 @@ const char *image_mime_type(const char *path)
   return FreeImage_GetFIFMimeType(FreeImage_GetFileType(path, 0));
 }
 
-char *image_create_thumbnail(const char *path, int size, int *data_size)
+/**
+ * Loads image in @p path so that it still covers @p size. JPEG images are
+ * scaled while decoding, which is a lot cheaper than decoding them in full.
+ * Images with very wide aspect ratio are cropped.
+ */
+static FIBITMAP *load_image(const char *path, int size)
 {
   FIBITMAP *img1, *img2;
-  FIMEMORY *memory;
   double ratio;
-  uint32_t msize;
-  char *mbuf, *buf;
-  
+  int flags = 0;
+
   FREE_IMAGE_FORMAT format = FreeImage_GetFileType(path, 0);
   if (format == FIF_UNKNOWN) {
     musicd_log(LOG_ERROR, "image", "unrecognized filetype '%s'", path);
     return NULL;
   }
-  
-  img1 = FreeImage_Load(format, path, 0);
+
+  if (format == FIF_JPEG) {
+    /* Upper 16 bits request DCT-domain scaling to at least this size */
+    flags = size << 16;
+  }
+
+  img1 = FreeImage_Load(format, path, flags);
   if (!img1) {
     musicd_log(LOG_ERROR, "image", "can't open image '%s'", path);
     return NULL;
@@ -80,19 +126,37 @@ char *image_create_thumbnail(const char *path, int size, int *data_size)
     }
   }
 
-  img2 = FreeImage_MakeThumbnail(img1, size, 1);
-  if (!img2) {
-    musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
-    FreeImage_Unload(img1);
-    return NULL;
-  }
+  return img1;
+}
 
-  FreeImage_Unload(img1);
-  img1 = img2;
+static char *save_image(FIBITMAP *img, image_format_t format, int *data_size)
+{
+  FIBITMAP *converted = NULL;
+  FIMEMORY *memory;
+  uint32_t msize;
+  char *mbuf, *buf;
+
+  if (format == IMAGE_FORMAT_WEBP
+   && FreeImage_GetBPP(img) != 24 && FreeImage_GetBPP(img) != 32) {
+    /* WebP encoder only takes RGB and RGBA */
+    img = converted = FreeImage_ConvertTo24Bits(img);
+    if (!img) {
+      return NULL;
+    }
+  }
 
   memory = FreeImage_OpenMemory(NULL, 0);
   
-  FreeImage_SaveToMemory(FIF_JPEG, img1, memory, 0);
+  if (!FreeImage_SaveToMemory(formats[format].fif, img, memory,
+                              formats[format].flags)) {
+    musicd_log(LOG_ERROR, "image", "can't encode %s",
+               formats[format].extension);
+    FreeImage_CloseMemory(memory);
+    if (converted) {
+      FreeImage_Unload(converted);
+    }
+    return NULL;
+  }
   
   FreeImage_AcquireMemory(memory, (BYTE **)&mbuf, &msize);
   
@@ -101,51 +165,116 @@ char *image_create_thumbnail(const char *path, int size, int *data_size)
   *data_size = msize;
   
   FreeImage_CloseMemory(memory);
+  if (converted) {
+    FreeImage_Unload(converted);
+  }
+  
+  return buf;
+}
+
+char *image_create_thumbnail(const char *path, int size, int *data_size)
+{
+  FIBITMAP *img1, *img2;
+  char *buf;
+  
+  img1 = load_image(path, size);
+  if (!img1) {
+    return NULL;
+  }
+
+  img2 = FreeImage_MakeThumbnail(img1, size, 1);
   FreeImage_Unload(img1);
+  if (!img2) {
+    musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
+    return NULL;
+  }
+
+  buf = save_image(img2, IMAGE_FORMAT_JPEG, data_size);
+  FreeImage_Unload(img2);
   
   return buf;
 }
 
+int image_create_thumbnails(int64_t image, const char *path,
+                            image_format_t format)
+{
+  FIBITMAP *img, *next;
+  char *cache_name, *buf;
+  int size, data_size, result = 0;
+
+  img = path ? load_image(path, IMAGE_SIZE_MAX) : NULL;
+  if (!img) {
+    /* An empty entry marks the thumbnail as not available */
+    for (size = IMAGE_SIZE_MAX; size >= IMAGE_SIZE_MIN; size /= 2) {
+      cache_name = image_cache_name(image, size, format);
+      cache_set(cache_name, CACHE_KIND_DERIVED, NULL, 0);
+      free(cache_name);
+    }
+    return -1;
+  }
+
+  /* Each size is scaled from the previous one, halving it every time */
+  for (size = IMAGE_SIZE_MAX; size >= IMAGE_SIZE_MIN; size /= 2) {
+    next = FreeImage_MakeThumbnail(img, size, 1);
+    FreeImage_Unload(img);
+    img = next;
+    if (!img) {
+      musicd_log(LOG_ERROR, "image", "can't scale image '%s'", path);
+      return -1;
+    }
+
+    /* The source is fine, so an encoding failure isn't cached */
+    buf = save_image(img, format, &data_size);
+    if (!buf) {
+      result = -1;
+      continue;
+    }
+
+    cache_name = image_cache_name(image, size, format);
+    cache_set(cache_name, CACHE_KIND_DERIVED, buf, data_size);
+    free(cache_name);
+    free(buf);
+  }
+
+  FreeImage_Unload(img);
+  return result;
+}
+
 
 struct task_args {
   int64_t id;
-  int size;
+  image_format_t format;
 };
 
 static void *task_func(struct task_args *args)
 {
-  char *cache_name, *source_path, *buf = NULL;
-  int size = 0;
-
-  /* Round to closest power of two */
-  args->size = pow(2, ceil(log(args->size)/log(2)));
+  char *source_path;
 
-  source_path = library_image_path(args->id);
-  if (source_path) {
-    buf = image_create_thumbnail(source_path, args->size, &size);
+  if (task_cancelled()) {
+    free(args);
+    return NULL;
   }
 
-  cache_name = image_cache_name(args->id, args->size);
-
-  cache_set(cache_name, buf, size);
+  source_path = library_image_path(args->id);
+  image_create_thumbnails(args->id, source_path, args->format);
   
   free(source_path);
-  free(cache_name);
-  free(buf);
   free(args);
   return NULL;
 }
 
-task_t *image_task(int64_t id, int size)
+task_t *image_task(int64_t id, image_format_t format)
 {
   task_t *task = task_new();
   struct task_args *args = malloc(sizeof(struct task_args));
   args->id = id;
-  args->size = size;
+  args->format = format;
 
   task->func = (void *(*)(void *))task_func;
   task->data = args;
-  task->worker = 1;
+  task->lane = TASK_LANE_CPU;
+  task->discard = free;
+  task->key = stringf("image:%" PRId64 ":%s", id, formats[format].extension);
 
   return task;
 }
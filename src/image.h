@@ -20,12 +20,36 @@
 
 #include "task.h"
 
+#include <stdbool.h>
 #include <stdint.h>
 
+/** Thumbnail sizes are powers of two between these */
+#define IMAGE_SIZE_MIN 16
+#define IMAGE_SIZE_MAX 512
+
+/** Thumbnail output formats */
+typedef enum image_format {
+  IMAGE_FORMAT_JPEG = 0,
+  IMAGE_FORMAT_WEBP,
+  IMAGE_FORMATS /**< Amount of formats, not a format */
+} image_format_t;
+
 /**
- * @Returns cache name for image of id @p image of @p size size.
+ * Checks which thumbnail formats FreeImage can write. Called once at startup.
  */
-char *image_cache_name(int64_t image, int size);
+void image_init();
+
+/**
+ * @returns true if thumbnails can be made in @p format
+ */
+bool image_format_supported(image_format_t format);
+
+/**
+ * @Returns cache name for image of id @p image of @p size size in @p format.
+ */
+char *image_cache_name(int64_t image, int size, image_format_t format);
+
+const char *image_format_mime(image_format_t format);
 
 const char *image_mime_type(const char *path);
 
@@ -35,7 +59,20 @@ const char *image_mime_type(const char *path);
  */
 char *image_create_thumbnail(const char *path, int size, int *data_size);
 
+/**
+ * Decodes image @p image from @p path once and stores @p format thumbnails
+ * of every size from IMAGE_SIZE_MAX down to IMAGE_SIZE_MIN in the cache. If the image
+ * can't be read, or @p path is NULL, empty entries are stored instead. If
+ * scaling or encoding fails, nothing is stored and the next request retries.
+ * @returns 0 on success, nonzero on failure
+ */
+int image_create_thumbnails(int64_t image, const char *path,
+                            image_format_t format);
 
-task_t *image_task(int64_t id, int size);
+/**
+ * @returns task creating all thumbnails of @p id in @p format with
+ * image_create_thumbnails
+ */
+task_t *image_task(int64_t id, image_format_t format);
 
 #endif
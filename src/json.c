@@ -17,14 +17,51 @@
  */
 #include "json.h"
 
-#include <inttypes.h>
+#include <stdint.h>
+#include <string.h>
 
-static void comma(json_t *json)
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+ * Output is written straight into the buffer: reserve() makes room for the
+ * worst case of a value once and finish() moves the end past what was
+ * written.
+ */
+
+static char *reserve(json_t *json, size_t n)
 {
-  if (json->comma) {
-    string_append(json->buf, ",");
-    json->comma = 0;
+  string_t *buf = json->buf;
+
+  if (buf->size + n > buf->max_size) {
+    string_ensure_space(buf, buf->size + n);
   }
+  return buf->string + buf->size;
+}
+
+static void finish(json_t *json, char *end)
+{
+  json->buf->size = end - json->buf->string;
+  *end = '\0';
+}
+
+/** Writes a comma if the previous value needs one. */
+static char *comma(json_t *json, char *p)
+{
+  *p = ',';
+  p += json->comma;
+  json->comma = 0;
+  return p;
+}
+
+static void append(json_t *json, const char *string, size_t n, int is_value)
+{
+  char *p = reserve(json, n + 1);
+  p = comma(json, p);
+  memcpy(p, string, n);
+  finish(json, p + n);
+  json->comma = is_value;
 }
 
 void json_init(json_t *json)
@@ -33,6 +70,12 @@ void json_init(json_t *json)
   json->comma = 0;
 }
 
+void json_init_in(json_t *json, arena_t *arena)
+{
+  json->buf = string_new_in(arena);
+  json->comma = 0;
+}
+
 void json_finish(json_t *json)
 {
   string_free(json->buf);
@@ -45,83 +88,196 @@ const char *json_result(json_t *json)
 
 void json_object_begin(json_t *json)
 {
-  comma(json);
-  string_append(json->buf, "{");
+  append(json, "{", 1, 0);
 }
 
 void json_object_end(json_t *json)
 {
-  string_append(json->buf, "}");
-  json->comma = 1;
+  json->comma = 0;
+  append(json, "}", 1, 1);
 }
 
 void json_array_begin(json_t *json)
 {
-  comma(json);
-  string_append(json->buf, "[");
+  append(json, "[", 1, 0);
 }
 
 void json_array_end(json_t *json)
 {
-  string_append(json->buf, "]");
-  json->comma = 1;
+  json->comma = 0;
+  append(json, "]", 1, 1);
 }
 
 void json_define(json_t *json, const char *name)
 {
-  comma(json);
-  string_appendf(json->buf, "\"%s\":", name);
+  size_t length = strlen(name);
+  char *p = reserve(json, length + 4);
+
+  p = comma(json, p);
+  *p++ = '"';
+  memcpy(p, name, length);
+  p += length;
+  *p++ = '"';
+  *p++ = ':';
+  finish(json, p);
 }
 
 void json_bool(json_t *json, int b)
 {
-  comma(json);
-  string_append(json->buf, b ? "true" : "false");
-  json->comma = 1;
+  if (b) {
+    append(json, "true", 4, 1);
+  } else {
+    append(json, "false", 5, 1);
+  }
+}
+
+
+static const char digit_pairs[] =
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899";
+
+static const uint64_t powers_of_10[] = {
+  0, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000,
+  1000000000, 10000000000ULL, 100000000000ULL, 1000000000000ULL,
+  10000000000000ULL, 100000000000000ULL, 1000000000000000ULL,
+  10000000000000000ULL, 100000000000000000ULL, 1000000000000000000ULL,
+  10000000000000000000ULL
+};
+
+static int count_digits(uint64_t value)
+{
+  /* log10 from the bit length, 1233 / 4096 ~ log10(2), off by at most one */
+  int t = (64 - __builtin_clzll(value | 1)) * 1233 >> 12;
+  return t + 1 - (value < powers_of_10[t]);
+}
+
+/** Writes @p value at @p p without a terminator. @returns end of it. */
+static char *format_int64(char *p, int64_t value)
+{
+  uint64_t u = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  char *end;
+
+  *p = '-';
+  p += value < 0;
+  end = p + count_digits(u);
+
+  /* Two digits at a time from the end */
+  for (p = end; u >= 100; u /= 100) {
+    p -= 2;
+    memcpy(p, digit_pairs + u % 100 * 2, 2);
+  }
+  if (u >= 10) {
+    memcpy(p - 2, digit_pairs + u * 2, 2);
+  } else {
+    *(p - 1) = '0' + u;
+  }
+  return end;
 }
 
 void json_int(json_t *json, int i)
 {
-  comma(json);
-  string_appendf(json->buf, "%d", i);
-  json->comma = 1;
+  json_int64(json, i);
 }
 
 void json_int64(json_t *json, int64_t i)
 {
-  comma(json);
-  string_appendf(json->buf, "%" PRId64 "", i);
+  /* Comma, sign and 19 digits */
+  char *p = reserve(json, 21);
+  p = comma(json, p);
+  finish(json, format_int64(p, i));
   json->comma = 1;
 }
 
-static const char *escape_from = "\"\\\b\f\n\r\t";
-static const char *escape_to = "\"\\bfnrt";
-static const int n_escape = 7;
+
+/**
+ * Character to write after a backslash for characters that need escaping,
+ * 0 for characters that don't. Other control characters become \u00XX.
+ */
+static const char escapes[256] = {
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'b', 't', 'n', 'u', 'f', 'r', 'u',
+  'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+  'u', 'u', ['"'] = '"', ['\\'] = '\\'
+};
+
+/** @returns amount of characters in @p string before one needing escaping */
+static size_t clean_length(const char *string, size_t length)
+{
+  size_t i = 0;
+
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i control = _mm_set1_epi8(0x1f);
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(string + i));
+    /* Unsigned chunk <= 0x1f is max(chunk, 0x1f) == 0x1f */
+    __m128i found =
+      _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, quote),
+                     _mm_cmpeq_epi8(chunk, backslash)),
+        _mm_cmpeq_epi8(_mm_max_epu8(chunk, control), control));
+    int mask = _mm_movemask_epi8(found);
+    if (mask) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+
+  for (; i < length; ++i) {
+    if (escapes[(unsigned char)string[i]]) {
+      break;
+    }
+  }
+  return i;
+}
 
 void json_string(json_t *json, const char *string)
 {
-  int i;
-
-  comma(json);
-
-  string_push_back(json->buf, '"');
-
-  if (string) {
-    for (; *string != '\0'; ++string) {
-      for (i = 0; i < n_escape; ++i) {
-        if (*string == escape_from[i]) {
-          break;
-        }
-      }
-      if (i < n_escape) {
-        string_push_back(json->buf, '\\');
-        string_push_back(json->buf, escape_to[i]);
-      } else {
-        string_push_back(json->buf, *string);
-      }
+  static const char hex[] = "0123456789abcdef";
+  size_t length, clean;
+  const char *end;
+  char *p;
+  unsigned char c;
+
+  if (!string) {
+    string = "";
+  }
+  length = strlen(string);
+
+  /* Comma and quotes, escapes reserve more as they are met */
+  p = reserve(json, length + 3);
+  p = comma(json, p);
+  *p++ = '"';
+
+  end = string + length;
+  while (length > 0) {
+    clean = clean_length(string, length);
+    memcpy(p, string, clean);
+    p += clean;
+    string += clean;
+    if (string == end) {
+      break;
+    }
+
+    c = *string++;
+    length = end - string;
+    finish(json, p);
+    p = reserve(json, 6 + length + 1);
+    *p++ = '\\';
+    *p++ = escapes[c];
+    if (escapes[c] == 'u') {
+      memcpy(p, "00", 2);
+      p[2] = hex[c >> 4];
+      p[3] = hex[c & 0xf];
+      p += 4;
     }
   }
 
-  string_push_back(json->buf, '"');
+  *p++ = '"';
+  finish(json, p);
   json->comma = 1;
 }
@@ -31,6 +31,8 @@ typedef struct json {
 } json_t;
 
 void json_init(json_t *json);
+/** Like json_init, but the result is allocated from @p arena. */
+void json_init_in(json_t *json, arena_t *arena);
 void json_finish(json_t *json);
 const char *json_result(json_t *json);
 
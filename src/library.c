@@ -15,14 +15,19 @@
  * You should have received a copy of the GNU General Public License
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
+/* For st_mtim */
+#define _POSIX_C_SOURCE 200809L
+
 #include "library.h"
 
+#include "cache.h"
 #include "config.h"
 #include "cue.h"
 #include "db.h"
 #include "log.h"
 #include "strings.h"
 
+#include <pthread.h>
 #include <sqlite3.h>
 
 
@@ -43,7 +48,7 @@ static bool prepare_query(const char *sql, sqlite3_stmt **query)
 
 static bool execute(sqlite3_stmt *query)
 {
-  int result = sqlite3_step(query);
+  int result = db_step(query);
   if (result == SQLITE_DONE || result == SQLITE_ROW) {
     result = true;
   } else {
@@ -57,7 +62,7 @@ static bool execute(sqlite3_stmt *query)
 
 static int64_t execute_scalar(sqlite3_stmt *query)
 {
-  int64_t result = sqlite3_step(query);
+  int64_t result = db_step(query);
   if (result == SQLITE_ROW) {
     result = sqlite3_column_int(query, 0);
   } else if (result == SQLITE_DONE) {
@@ -90,45 +95,171 @@ static int64_t field_rowid(const char *table, const char *field, const char *val
   return result;
 }
 
-static int64_t field_rowid_create(const char *table, const char *field, const char *value)
+/**
+ * Maps artist and album names to their rowids, so that adding tracks doesn't
+ * need to query the database for names already seen. The maps are cleared
+ * when a scan ends, so they never outlive the rows they point to.
+ */
+typedef struct name_entry {
+  char *name;
+  int64_t id;
+  struct name_entry *next;
+} name_entry_t;
+
+typedef struct {
+  name_entry_t **buckets;
+  unsigned int size;
+  unsigned int count;
+} name_map_t;
+
+static name_map_t artist_map = { NULL, 0, 0 };
+static name_map_t album_map = { NULL, 0, 0 };
+static pthread_mutex_t name_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int name_hash(const char *name)
 {
-  sqlite3_stmt *query;
-  int64_t result;
-  char *sql;
-  
-  result = field_rowid(table, field, value);
-  if (result > 0) {
-    return result;
+  unsigned int hash = 2166136261u;
+  for (; *name; ++name) {
+    hash = (hash ^ (unsigned char)*name) * 16777619u;
   }
-  
-  sql = malloc(strlen(table) + strlen(field) + 32);
-  
-  sprintf(sql, "INSERT INTO %s (%s) VALUES (?)", table, field);
-  if (!prepare_query(sql, &query)) {
-    result = -1;
-  } else {
-    sqlite3_bind_text(query, 1, value, -1, NULL);
-    result = execute_scalar(query);
+  return hash;
+}
+
+static int64_t name_map_get(name_map_t *map, const char *name)
+{
+  name_entry_t *entry;
+  int64_t result = 0;
+
+  pthread_mutex_lock(&name_map_mutex);
+  if (map->size > 0) {
+    for (entry = map->buckets[name_hash(name) % map->size]; entry;
+         entry = entry->next) {
+      if (!strcmp(entry->name, name)) {
+        result = entry->id;
+        break;
+      }
+    }
   }
-  
-  free(sql);
-  return sqlite3_last_insert_rowid(db_handle());
+  pthread_mutex_unlock(&name_map_mutex);
+  return result;
 }
 
-static void increment_album_tracks(int64_t album)
+static void name_map_set(name_map_t *map, const char *name, int64_t id)
 {
-  static const char *sql =
-    "UPDATE albums SET tracks = tracks + 1 WHERE rowid = ?";
+  name_entry_t *entry, *next, **buckets;
+  unsigned int i, size, hash;
+
+  pthread_mutex_lock(&name_map_mutex);
+
+  if (map->count >= map->size) {
+    size = map->size ? map->size * 2 : 1024;
+    buckets = calloc(size, sizeof(name_entry_t *));
+    for (i = 0; i < map->size; ++i) {
+      for (entry = map->buckets[i]; entry; entry = next) {
+        next = entry->next;
+        hash = name_hash(entry->name) % size;
+        entry->next = buckets[hash];
+        buckets[hash] = entry;
+      }
+    }
+    free(map->buckets);
+    map->buckets = buckets;
+    map->size = size;
+  }
+
+  hash = name_hash(name) % map->size;
+  entry = malloc(sizeof(name_entry_t));
+  entry->name = strcopy(name);
+  entry->id = id;
+  entry->next = map->buckets[hash];
+  map->buckets[hash] = entry;
+  ++map->count;
+
+  pthread_mutex_unlock(&name_map_mutex);
+}
+
+static void name_map_clear(name_map_t *map)
+{
+  name_entry_t *entry, *next;
+  unsigned int i;
+
+  pthread_mutex_lock(&name_map_mutex);
+  for (i = 0; i < map->size; ++i) {
+    for (entry = map->buckets[i]; entry; entry = next) {
+      next = entry->next;
+      free(entry->name);
+      free(entry);
+    }
+  }
+  free(map->buckets);
+  map->buckets = NULL;
+  map->size = 0;
+  map->count = 0;
+  pthread_mutex_unlock(&name_map_mutex);
+}
+
+/**
+ * Queries for resolving rowid of a name in a table, prepared once per scan.
+ */
+typedef struct {
+  name_map_t *map;
+  sqlite3_stmt *upsert;
+  sqlite3_stmt *select;
+} name_queries_t;
+
+static bool name_queries_prepare(name_queries_t *queries, name_map_t *map,
+                                 const char *sql_upsert,
+                                 const char *sql_select)
+{
+  queries->map = map;
+  return prepare_query(sql_upsert, &queries->upsert)
+      && prepare_query(sql_select, &queries->select);
+}
+
+static void name_queries_finalize(name_queries_t *queries)
+{
+  sqlite3_finalize(queries->upsert);
+  sqlite3_finalize(queries->select);
+  queries->upsert = NULL;
+  queries->select = NULL;
+}
 
+/**
+ * @returns rowid of @p name, which is inserted if it does not exist yet.
+ */
+static int64_t name_rowid(name_queries_t *queries, const char *name)
+{
+  int64_t result;
   sqlite3_stmt *query;
 
-  if (!prepare_query(sql, &query)) {
-    return;
+  result = name_map_get(queries->map, name);
+  if (result > 0) {
+    return result;
   }
 
-  sqlite3_bind_int64(query, 1, album);
+  /* RETURNING gives no row on conflict, in which case the name was inserted
+   * outside this map and has to be looked up. */
+  query = queries->upsert;
+  sqlite3_bind_text(query, 1, name, -1, NULL);
+  result = db_step(query);
+  if (result == SQLITE_DONE) {
+    sqlite3_reset(query);
+    query = queries->select;
+    sqlite3_bind_text(query, 1, name, -1, NULL);
+    result = db_step(query);
+  }
 
-  execute(query);
+  if (result == SQLITE_ROW) {
+    result = sqlite3_column_int64(query, 0);
+    name_map_set(queries->map, name, result);
+  } else {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'",
+               sqlite3_sql(query));
+    result = -1;
+  }
+
+  sqlite3_reset(query);
+  return result;
 }
 
 char *library_root_path()
@@ -143,7 +274,7 @@ char *library_root_path()
     return NULL;
   }
 
-  result = sqlite3_step(query);
+  result = db_step(query);
   if (result != SQLITE_DONE && result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
@@ -155,52 +286,192 @@ char *library_root_path()
   return path;
 }
 
-int64_t library_track_add(track_t *track, int64_t directory)
+/** Album track counts are written after this many albums have pending ones */
+#define PENDING_ALBUMS 64
+
+typedef struct {
+  int64_t album;
+  int tracks;
+} album_tracks_t;
+
+/**
+ * Statements for adding tracks, prepared on first use and kept until
+ * library_tracks_flush. Album track counts are collected across files and
+ * written in one go.
+ */
+static struct {
+  bool prepared;
+  sqlite3_stmt *insert;
+  sqlite3_stmt *album_tracks;
+  name_queries_t artists;
+  name_queries_t albums;
+  album_tracks_t pending[PENDING_ALBUMS];
+  int pending_count;
+} batch;
+
+static bool batch_prepare()
 {
   static const char *sql =
     "INSERT INTO tracks (fileid, file, cuefileid, cuefile, track, title, artistid, artist, albumid, album, start, duration, trackindex) VALUES(?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)";
+  static const char *sql_artist_upsert =
+    "INSERT INTO artists (name) VALUES (?) ON CONFLICT (name) DO NOTHING RETURNING rowid";
+  static const char *sql_artist_select =
+    "SELECT rowid FROM artists WHERE name = ?";
+  static const char *sql_album_upsert =
+    "INSERT INTO albums (name) VALUES (?) ON CONFLICT (name) DO NOTHING RETURNING rowid";
+  static const char *sql_album_select =
+    "SELECT rowid FROM albums WHERE name = ?";
+  static const char *sql_album_tracks =
+    "UPDATE albums SET tracks = tracks + ? WHERE rowid = ?";
 
-  sqlite3_stmt *query;
+  if (batch.prepared) {
+    return true;
+  }
 
-  if (!prepare_query(sql, &query)) {
-    return -1;
+  if (!name_queries_prepare(&batch.artists, &artist_map,
+                            sql_artist_upsert, sql_artist_select)
+   || !name_queries_prepare(&batch.albums, &album_map,
+                            sql_album_upsert, sql_album_select)
+   || !prepare_query(sql, &batch.insert)
+   || !prepare_query(sql_album_tracks, &batch.album_tracks)) {
+    sqlite3_finalize(batch.insert);
+    sqlite3_finalize(batch.album_tracks);
+    batch.insert = batch.album_tracks = NULL;
+    name_queries_finalize(&batch.artists);
+    name_queries_finalize(&batch.albums);
+    return false;
   }
 
-  track->fileid = library_file(track->file, directory);
-  if (track->cuefile) {
-    track->cuefileid = library_file(track->cuefile, directory);
+  batch.prepared = true;
+  return true;
+}
+
+void library_tracks_sync()
+{
+  int i;
+
+  for (i = 0; i < batch.pending_count; ++i) {
+    sqlite3_bind_int(batch.album_tracks, 1, batch.pending[i].tracks);
+    sqlite3_bind_int64(batch.album_tracks, 2, batch.pending[i].album);
+    if (db_step(batch.album_tracks) != SQLITE_DONE) {
+      musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'",
+                 sqlite3_sql(batch.album_tracks));
+    }
+    sqlite3_reset(batch.album_tracks);
   }
+  batch.pending_count = 0;
+}
+
+static void batch_count_album_track(int64_t album)
+{
+  int i;
 
-  if (track->artist) {
-    track->artistid = field_rowid_create("artists", "name", track->artist);
+  for (i = 0; i < batch.pending_count; ++i) {
+    if (batch.pending[i].album == album) {
+      ++batch.pending[i].tracks;
+      return;
+    }
   }
-  if (track->album) {
-    track->albumid = field_rowid_create("albums", "name", track->album);
+
+  if (batch.pending_count == PENDING_ALBUMS) {
+    library_tracks_sync();
   }
+  batch.pending[batch.pending_count].album = album;
+  batch.pending[batch.pending_count].tracks = 1;
+  ++batch.pending_count;
+}
+
+int64_t library_tracks_add(track_t **tracks, int64_t directory)
+{
+  int i, count;
+  track_t *track, *prev = NULL;
 
-  sqlite3_bind_int64(query, 1, track->fileid);
-  sqlite3_bind_text(query, 2, track->file, -1, NULL);
-  sqlite3_bind_int64(query, 3, track->cuefileid);
-  sqlite3_bind_text(query, 4, track->cuefile, -1, NULL);
-  sqlite3_bind_int(query, 5, track->track);
-  sqlite3_bind_text(query, 6, track->title, -1, NULL);
-  sqlite3_bind_int64(query, 7, track->artistid);
-  sqlite3_bind_text(query, 8, track->artist, -1, NULL);
-  sqlite3_bind_int64(query, 9, track->albumid);
-  sqlite3_bind_text(query, 10, track->album, -1, NULL);
-  sqlite3_bind_double(query, 11, track->start);
-  sqlite3_bind_double(query, 12, track->duration);
-  sqlite3_bind_double(query, 13, track->trackindex);
+  for (count = 0; tracks[count]; ++count) { }
+  if (count == 0) {
+    return 0;
+  }
 
-  if (!execute(query)) {
+  if (!batch_prepare()) {
     return -1;
   }
 
-  if (track->album) {
-    increment_album_tracks(track->albumid);
+  for (i = 0; i < count; ++i) {
+    track = tracks[i];
+
+    /* Tracks of a batch mostly come from the same file. */
+    if (prev && !strcmp(prev->file, track->file)) {
+      track->fileid = prev->fileid;
+    } else {
+      track->fileid = library_file(track->file, directory);
+    }
+    if (track->cuefile) {
+      if (prev && prev->cuefile && !strcmp(prev->cuefile, track->cuefile)) {
+        track->cuefileid = prev->cuefileid;
+      } else {
+        track->cuefileid = library_file(track->cuefile, directory);
+      }
+    }
+
+    if (track->artist) {
+      track->artistid = name_rowid(&batch.artists, track->artist);
+    }
+    if (track->album) {
+      track->albumid = name_rowid(&batch.albums, track->album);
+    }
+
+    sqlite3_bind_int64(batch.insert, 1, track->fileid);
+    sqlite3_bind_text(batch.insert, 2, track->file, -1, NULL);
+    sqlite3_bind_int64(batch.insert, 3, track->cuefileid);
+    sqlite3_bind_text(batch.insert, 4, track->cuefile, -1, NULL);
+    sqlite3_bind_int(batch.insert, 5, track->track);
+    sqlite3_bind_text(batch.insert, 6, track->title, -1, NULL);
+    sqlite3_bind_int64(batch.insert, 7, track->artistid);
+    sqlite3_bind_text(batch.insert, 8, track->artist, -1, NULL);
+    sqlite3_bind_int64(batch.insert, 9, track->albumid);
+    sqlite3_bind_text(batch.insert, 10, track->album, -1, NULL);
+    sqlite3_bind_double(batch.insert, 11, track->start);
+    sqlite3_bind_double(batch.insert, 12, track->duration);
+    sqlite3_bind_double(batch.insert, 13, track->trackindex);
+
+    if (db_step(batch.insert) != SQLITE_DONE) {
+      musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'",
+                 sqlite3_sql(batch.insert));
+      sqlite3_reset(batch.insert);
+      sqlite3_clear_bindings(batch.insert);
+      return -1;
+    }
+    sqlite3_reset(batch.insert);
+    sqlite3_clear_bindings(batch.insert);
+
+    track->id = sqlite3_last_insert_rowid(db_handle());
+
+    if (track->album && track->albumid > 0) {
+      batch_count_album_track(track->albumid);
+    }
+
+    prev = track;
+  }
+
+  return count;
+}
+
+void library_tracks_flush()
+{
+  if (!batch.prepared) {
+    return;
   }
 
-  return sqlite3_last_insert_rowid(db_handle());
+  library_tracks_sync();
+
+  sqlite3_finalize(batch.insert);
+  sqlite3_finalize(batch.album_tracks);
+  batch.insert = batch.album_tracks = NULL;
+  name_queries_finalize(&batch.artists);
+  name_queries_finalize(&batch.albums);
+  batch.prepared = false;
+
+  name_map_clear(&artist_map);
+  name_map_clear(&album_map);
 }
 
 
@@ -229,38 +500,169 @@ int64_t library_file(const char* path, int64_t directory)
  
   return result ? result : sqlite3_last_insert_rowid(db_handle());
 }
-time_t library_file_mtime(int64_t file)
+char *library_file_path(int64_t file)
+{
+  static const char *sql =
+    "SELECT path FROM files WHERE rowid = ?";
+  sqlite3_stmt *query;
+  int result;
+  char *path = NULL;
+
+  if (!prepare_query(sql, &query)) {
+    return NULL;
+  }
+
+  sqlite3_bind_int64(query, 1, file);
+
+  result = db_step(query);
+  if (result != SQLITE_DONE && result != SQLITE_ROW) {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
+  }
+  if (result == SQLITE_ROW) {
+    path = strcopy((const char *)sqlite3_column_text(query, 0));
+  }
+
+  sqlite3_finalize(query);
+  return path;
+}
+
+int64_t library_stat_mtime(const struct stat *status)
+{
+  return (int64_t)status->st_mtim.tv_sec * 1000000000
+       + status->st_mtim.tv_nsec;
+}
+
+bool library_file_matches(const library_file_t *file,
+                          const struct stat *status)
+{
+  return file->size == (int64_t)status->st_size
+      && file->mtime == library_stat_mtime(status)
+      && file->inode == (int64_t)status->st_ino
+      && file->device == (int64_t)status->st_dev;
+}
+
+static void read_file(sqlite3_stmt *query, library_file_t *file)
+{
+  file->id = sqlite3_column_int64(query, 0);
+  file->path = (const char*)sqlite3_column_text(query, 1);
+  file->size = sqlite3_column_int64(query, 2);
+  file->mtime = sqlite3_column_int64(query, 3);
+  file->inode = sqlite3_column_int64(query, 4);
+  file->device = sqlite3_column_int64(query, 5);
+  file->directory = sqlite3_column_int64(query, 6);
+}
+
+bool library_file_unchanged(int64_t file, const struct stat *status)
 {
-  static const char *sql = "SELECT mtime FROM files WHERE rowid = ?";
+  static const char *sql =
+    "SELECT rowid, path, size, mtime, inode, device, directoryid FROM files WHERE rowid = ?";
   sqlite3_stmt *query;
+  library_file_t entry;
+  bool result = false;
   
   if (!prepare_query(sql, &query)) {
-    return -1;
+    return false;
   }
   
   sqlite3_bind_int64(query, 1, file);
+  
+  if (db_step(query) == SQLITE_ROW) {
+    read_file(query, &entry);
+    result = library_file_matches(&entry, status);
+  }
+  
+  sqlite3_finalize(query);
+  return result;
+}
+void library_file_stat_set(int64_t file, const struct stat *status)
+{
+  static const char *sql =
+    "UPDATE files SET size = ?, mtime = ?, inode = ?, device = ? WHERE rowid = ?";
+  sqlite3_stmt *query;
+  
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+  
+  sqlite3_bind_int64(query, 1, status->st_size);
+  sqlite3_bind_int64(query, 2, library_stat_mtime(status));
+  sqlite3_bind_int64(query, 3, status->st_ino);
+  sqlite3_bind_int64(query, 4, status->st_dev);
+  sqlite3_bind_int64(query, 5, file);
 
-  return execute_scalar(query);
+  execute(query);
 }
-void library_file_mtime_set(int64_t file, time_t mtime)
+
+int64_t library_file_by_stat(const struct stat *status, char **path)
 {
-  static const char *sql = "UPDATE files SET mtime = ? WHERE rowid = ?";
+  static const char *sql =
+    "SELECT rowid, path FROM files WHERE device = ? AND inode = ? AND size = ? AND mtime = ?";
   sqlite3_stmt *query;
+  int64_t result;
   
   if (!prepare_query(sql, &query)) {
+    return -1;
+  }
+  
+  sqlite3_bind_int64(query, 1, status->st_dev);
+  sqlite3_bind_int64(query, 2, status->st_ino);
+  sqlite3_bind_int64(query, 3, status->st_size);
+  sqlite3_bind_int64(query, 4, library_stat_mtime(status));
+  
+  result = db_step(query);
+  if (result == SQLITE_DONE) {
+    result = 0;
+  } else if (result == SQLITE_ROW) {
+    if (path) {
+      *path = strcopy((const char *)sqlite3_column_text(query, 1));
+    }
+    result = sqlite3_column_int64(query, 0);
+  } else {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
+    result = -1;
+  }
+  
+  sqlite3_finalize(query);
+  return result;
+}
+
+void library_file_move(int64_t file, const char *path, int64_t directory)
+{
+  static const char *sql_file =
+    "UPDATE files SET path = ?, directoryid = ? WHERE rowid = ?";
+  static const char *sql_tracks =
+    "UPDATE tracks SET file = ? WHERE fileid = ?";
+  static const char *sql_cuetracks =
+    "UPDATE tracks SET cuefile = ? WHERE cuefileid = ?";
+  sqlite3_stmt *query;
+  
+  if (!prepare_query(sql_file, &query)) {
     return;
   }
+  sqlite3_bind_text(query, 1, path, -1, NULL);
+  sqlite3_bind_int64(query, 2, directory);
+  sqlite3_bind_int64(query, 3, file);
+  execute(query);
   
-  sqlite3_bind_int64(query, 1, mtime);
+  if (!prepare_query(sql_tracks, &query)) {
+    return;
+  }
+  sqlite3_bind_text(query, 1, path, -1, NULL);
+  sqlite3_bind_int64(query, 2, file);
+  execute(query);
+  
+  if (!prepare_query(sql_cuetracks, &query)) {
+    return;
+  }
+  sqlite3_bind_text(query, 1, path, -1, NULL);
   sqlite3_bind_int64(query, 2, file);
-
   execute(query);
 }
 
 void library_iterate_files_by_directory
   (int64_t directory, bool (*callback)(library_file_t *file))
 {
-  static const char *sql = "SELECT rowid, path, mtime, directoryid FROM files WHERE directoryid = ?";
+  static const char *sql = "SELECT rowid, path, size, mtime, inode, device, directoryid FROM files WHERE directoryid = ?";
   sqlite3_stmt *query;
   int result;
   library_file_t file;
@@ -272,11 +674,8 @@ void library_iterate_files_by_directory
   
   sqlite3_bind_int64(query, 1, directory);
   
-  while ((result = sqlite3_step(query)) == SQLITE_ROW) {
-    file.id = sqlite3_column_int64(query, 0);
-    file.path = (const char*)sqlite3_column_text(query, 1);
-    file.mtime = sqlite3_column_int64(query, 2);
-    file.directory = sqlite3_column_int64(query, 3);
+  while ((result = db_step(query)) == SQLITE_ROW) {
+    read_file(query, &file);
     
     cb_result = callback(&file);
     if (cb_result == false) {
@@ -290,6 +689,33 @@ void library_iterate_files_by_directory
   sqlite3_finalize(query);
 }
 
+void library_iterate_cue_sheets
+  (int64_t file, bool (*callback)(library_file_t *file))
+{
+  static const char *sql = "SELECT rowid, path, size, mtime, inode, device, directoryid FROM files WHERE rowid IN (SELECT cuefileid FROM tracks WHERE fileid = ? AND cuefileid > 0)";
+  sqlite3_stmt *query;
+  int result;
+  library_file_t entry;
+  
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+  
+  sqlite3_bind_int64(query, 1, file);
+  
+  while ((result = db_step(query)) == SQLITE_ROW) {
+    read_file(query, &entry);
+    if (!callback(&entry)) {
+      break;
+    }
+  }
+  if (result != SQLITE_DONE && result != SQLITE_ROW) {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
+  }
+  
+  sqlite3_finalize(query);
+}
+
 void library_file_clear(int64_t file)
 {
   static const char *sql_album_tracks =
@@ -375,7 +801,7 @@ char *library_directory_path(int64_t directory)
 
   sqlite3_bind_int64(query, 1, directory);
 
-  result = sqlite3_step(query);
+  result = db_step(query);
   if (result != SQLITE_DONE && result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
@@ -412,7 +838,7 @@ void library_directory_delete(int64_t directory)
   sqlite3_bind_int64(query, 1, directory);
   execute(query);
 }
-time_t library_directory_mtime(int64_t directory)
+int64_t library_directory_mtime(int64_t directory)
 {
   static const char *sql = "SELECT mtime FROM directories WHERE rowid = ?";
   sqlite3_stmt *query;
@@ -425,7 +851,7 @@ time_t library_directory_mtime(int64_t directory)
 
   return execute_scalar(query);
 }
-void library_directory_mtime_set(int64_t directory, time_t mtime)
+void library_directory_mtime_set(int64_t directory, int64_t mtime)
 {
   static const char *sql = "UPDATE directories SET mtime = ? WHERE rowid = ?";
   sqlite3_stmt *query;
@@ -470,7 +896,7 @@ void library_iterate_directories
   
   sqlite3_bind_int64(query, 1, parent);
   
-  while ((result = sqlite3_step(query)) == SQLITE_ROW) {
+  while ((result = db_step(query)) == SQLITE_ROW) {
     directory.id = sqlite3_column_int64(query, 0);
     directory.path = (const char*)sqlite3_column_text(query, 1);
     directory.mtime = sqlite3_column_int64(query, 2);
@@ -509,10 +935,33 @@ int64_t library_image_add(int64_t file)
   return sqlite3_last_insert_rowid(db_handle());
 }
 
+int64_t library_image_add_embedded(int64_t file, const char *cache_name,
+                                   const char *description)
+{
+  static const char *sql =
+    "INSERT INTO images (fileid, embedded, description) VALUES(?, ?, ?)";
+
+  sqlite3_stmt *query;
+
+  if (!prepare_query(sql, &query)) {
+    return -1;
+  }
+
+  sqlite3_bind_int64(query, 1, file);
+  sqlite3_bind_text(query, 2, cache_name, -1, NULL);
+  sqlite3_bind_text(query, 3, description ? description : "", -1, NULL);
+
+  if (!execute(query)) {
+    return -1;
+  }
+
+  return sqlite3_last_insert_rowid(db_handle());
+}
+
 char *library_image_path(int64_t image)
 {
   static const char *sql =
-    "SELECT files.path AS path FROM images JOIN files ON images.fileid = files.rowid WHERE images.rowid = ?";
+    "SELECT files.path AS path, images.embedded AS embedded FROM images JOIN files ON images.fileid = files.rowid WHERE images.rowid = ?";
   sqlite3_stmt *query;
   int result;
   char *path = NULL;;
@@ -523,12 +972,16 @@ char *library_image_path(int64_t image)
 
   sqlite3_bind_int64(query, 1, image);
 
-  result = sqlite3_step(query);
+  result = db_step(query);
   if (result != SQLITE_DONE && result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
   if (result == SQLITE_ROW) {
-    path = strcopy((const char *)sqlite3_column_text(query, 0));
+    if (sqlite3_column_type(query, 1) != SQLITE_NULL) {
+      path = cache_path((const char *)sqlite3_column_text(query, 1));
+    } else {
+      path = strcopy((const char *)sqlite3_column_text(query, 0));
+    }
   }
 
   sqlite3_finalize(query);
@@ -569,7 +1022,7 @@ void library_iterate_images_by_directory
   (int64_t directory, bool (*callback)(library_image_t *file))
 {
   static const char *sql =
-    "SELECT images.rowid AS id, files.path AS path, images.albumid AS albumid FROM files JOIN images ON images.fileid = files.rowid WHERE files.directoryid = ?;";
+    "SELECT images.rowid AS id, files.path AS path, images.albumid AS albumid, images.description AS description FROM files JOIN images ON images.fileid = files.rowid WHERE files.directoryid = ?;";
   sqlite3_stmt *query;
   int result;
   library_image_t image;
@@ -583,10 +1036,11 @@ void library_iterate_images_by_directory
   
   image.directory = directory;
   
-  while ((result = sqlite3_step(query)) == SQLITE_ROW) {
+  while ((result = db_step(query)) == SQLITE_ROW) {
     image.id = sqlite3_column_int64(query, 0);
     image.path = (const char*)sqlite3_column_text(query, 1);
     image.album = sqlite3_column_int64(query, 2);
+    image.description = (const char*)sqlite3_column_text(query, 3);
     
     cb_result = callback(&image);
     if (cb_result == false) {
@@ -601,11 +1055,35 @@ void library_iterate_images_by_directory
 }
 
 
+int library_iterate_embedded_images(bool (*callback)(const char *cache_name))
+{
+  static const char *sql =
+    "SELECT DISTINCT embedded FROM images WHERE embedded IS NOT NULL";
+  sqlite3_stmt *query;
+  int result;
+
+  if (!prepare_query(sql, &query)) {
+    return -1;
+  }
+
+  while ((result = db_step(query)) == SQLITE_ROW) {
+    if (!callback((const char *)sqlite3_column_text(query, 0))) {
+      break;
+    }
+  }
+  sqlite3_finalize(query);
+  if (result != SQLITE_DONE && result != SQLITE_ROW) {
+    musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
+    return -1;
+  }
+  return 0;
+}
+
 void library_iterate_images_by_album
   (int64_t album, bool (*callback)(library_image_t *file, void *opaque), void *opaque)
 {
   static const char *sql =
-    "SELECT images.rowid AS id, files.path AS path, files.directoryid AS directoryid FROM images JOIN files ON images.fileid = files.rowid WHERE images.albumid = ?;";
+    "SELECT MIN(images.rowid) AS id, files.path AS path, files.directoryid AS directoryid, images.description AS description FROM images JOIN files ON images.fileid = files.rowid WHERE images.albumid = ? GROUP BY COALESCE(images.embedded, images.rowid) ORDER BY id;";
   sqlite3_stmt *query;
   int result;
   library_image_t image;
@@ -619,10 +1097,11 @@ void library_iterate_images_by_album
 
   image.album = album;
 
-  while ((result = sqlite3_step(query)) == SQLITE_ROW) {
+  while ((result = db_step(query)) == SQLITE_ROW) {
     image.id = sqlite3_column_int64(query, 0);
     image.path = (const char*)sqlite3_column_text(query, 1);
     image.directory = sqlite3_column_int64(query, 2);
+    image.description = (const char*)sqlite3_column_text(query, 3);
 
     cb_result = callback(&image, opaque);
     if (cb_result == false) {
@@ -686,7 +1165,7 @@ lyrics_t *library_lyrics(int64_t track, time_t *time)
   
   sqlite3_bind_int64(query, 1, track);
   
-  result = sqlite3_step(query);
+  result = db_step(query);
   if (result != SQLITE_DONE && result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "library", "sqlite3_step failed for '%s'", sql);
   }
@@ -750,7 +1229,7 @@ track_t *library_track_by_id(int64_t id)
 
   sqlite3_bind_int(stmt, 1, id);
 
-  result = sqlite3_step(stmt);
+  result = db_step(stmt);
   if (result == SQLITE_DONE) {
     return NULL;
   } else if (result != SQLITE_ROW) {
@@ -22,6 +22,7 @@
 #include "track.h"
 
 #include <stdbool.h>
+#include <sys/stat.h>
 #include <time.h>
 
 int library_open();
@@ -34,7 +35,23 @@ int library_open();
  */
 char *library_root_path();
 
-int64_t library_track_add(track_t *track, int64_t directory);
+/**
+ * Adds NULL-terminated array of @p tracks in @p directory. Ids of the tracks
+ * are set. Statements are prepared on the first call and kept, and album
+ * track counts may lag until library_tracks_flush.
+ * @returns amount of tracks added or < 0 on error.
+ */
+int64_t library_tracks_add(track_t **tracks, int64_t directory);
+/**
+ * Writes pending album track counts.
+ */
+void library_tracks_sync();
+/**
+ * Writes pending album track counts, finalizes the statements of
+ * library_tracks_add and forgets cached artist and album ids. Called when a
+ * scan ends.
+ */
+void library_tracks_flush();
 
 /**
  * Returns id of file located by @p path. If it does not exist in the database,
@@ -45,6 +62,10 @@ int64_t library_track_add(track_t *track, int64_t directory);
  * @returns Url id or 0 if not existing and @p directory <= 0. On error < 0.
  */
 int64_t library_file(const char *path, int64_t directory);
+/**
+ * @returns path which must be freed or NULL if not found.
+ */
+char *library_file_path(int64_t file);
 /**
  * Removes all tracks associated with @p file from the database.
  */
@@ -54,26 +75,59 @@ void library_file_clear(int64_t file);
  */
 void library_file_delete(int64_t file);
 /**
- * @Returns mtime of @p file
+ * @returns modification time of @p status in nanoseconds.
  */
-time_t library_file_mtime(int64_t file);
-/**
- * Sets mtime of @p file to @p mtime.
- */
-void library_file_mtime_set(int64_t file, time_t mtime);
+int64_t library_stat_mtime(const struct stat *status);
 
 typedef struct {
   int64_t id;
   const char *path;
-  time_t mtime;
+  int64_t size;
+  int64_t mtime; /**< Nanoseconds */
+  int64_t inode;
+  int64_t device;
   int64_t directory;
 } library_file_t;
+
+/**
+ * @returns true if size, mtime, inode and device of @p file match @p status.
+ */
+bool library_file_matches(const library_file_t *file,
+                          const struct stat *status);
+/**
+ * @returns true if @p file exists in the database and matches @p status.
+ * @see library_file_matches
+ */
+bool library_file_unchanged(int64_t file, const struct stat *status);
+/**
+ * Stores size, mtime, inode and device of @p status for @p file.
+ */
+void library_file_stat_set(int64_t file, const struct stat *status);
+/**
+ * Finds a file entry with same device, inode, size and mtime as @p status,
+ * which is what a moved or renamed file looks like.
+ * @param path If not NULL, set to path of the found entry. Must be freed.
+ * @returns Id of the file, 0 if not found or < 0 on error.
+ */
+int64_t library_file_by_stat(const struct stat *status, char **path);
+/**
+ * Moves @p file to @p path in @p directory. Tracks and images associated with
+ * the file are kept.
+ */
+void library_file_move(int64_t file, const char *path, int64_t directory);
+
 /**
  * Iterate through files with directory @p directory. Stops when @p callback
  * returns false.
  */
 void library_iterate_files_by_directory
   (int64_t directory, bool (*callback)(library_file_t *file));
+/**
+ * Iterate through cue sheets with tracks in audio file @p file. Stops when
+ * @p callback returns false.
+ */
+void library_iterate_cue_sheets
+  (int64_t file, bool (*callback)(library_file_t *file));
 
 
 /**
@@ -96,13 +150,13 @@ char *library_directory_path(int64_t directory);
  */
 void library_directory_delete(int64_t directory);
 /**
- * @Returns mtime of @p directory.
+ * @Returns mtime of @p directory in nanoseconds.
  */
-time_t library_directory_mtime(int64_t directory);
+int64_t library_directory_mtime(int64_t directory);
 /**
- * Sets mtime of @p directory to @p mtime.
+ * Sets mtime of @p directory to @p mtime nanoseconds.
  */
-void library_directory_mtime_set(int64_t directory, time_t mtime);
+void library_directory_mtime_set(int64_t directory, int64_t mtime);
 
 /**
  * @returns amount of tracks in @p directory
@@ -112,7 +166,7 @@ int library_directory_tracks_count(int64_t directory);
 typedef struct {
   int64_t id;
   const char *path;
-  time_t mtime;
+  int64_t mtime; /**< Nanoseconds */
   int64_t parent;
 } library_directory_t;
 
@@ -127,16 +181,26 @@ void library_iterate_directories
 
 
 int64_t library_image_add(int64_t file);
+/**
+ * Adds image stored in cache as @p cache_name, which was embedded in audio
+ * @p file. @p description is the picture type or NULL.
+ */
+int64_t library_image_add_embedded(int64_t file, const char *cache_name,
+                                   const char *description);
 
 typedef struct {
   int64_t id;
+  /** Image file, or audio file if the image is embedded */
   const char *path;
   int64_t directory;
   int64_t album;
+  /** Picture type of embedded image or "", NULL if the image is a file */
+  const char *description;
 } library_image_t;
 
 /**
- * @returns path which must be freed or NULL if not found.
+ * @returns path which must be freed or NULL if not found. Embedded images are
+ * located in the cache.
  */
 char *library_image_path(int64_t image);
 
@@ -146,11 +210,22 @@ void library_album_image_set(int64_t album, int64_t image);
 void library_iterate_images_by_directory
   (int64_t directory, bool (*callback)(library_image_t *image));
 
+/**
+ * Iterates images of @p album. Copies of the same embedded image in several
+ * tracks are listed once.
+ */
 void library_iterate_images_by_album
   (int64_t album,
    bool (*callback)(library_image_t *image, void *opaque),
    void *opaque);
 
+/**
+ * Iterates cache names of embedded images, each listed once. Stops when
+ * @p callback returns false.
+ * @returns 0 on success, < 0 on error
+ */
+int library_iterate_embedded_images(bool (*callback)(const char *cache_name));
+
 
 /**
  * @Returns most common album of tracks in files located in @p directory.
@@ -15,46 +15,438 @@
  * You should have received a copy of the GNU General Public License
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
+
+/* For localtime_r and clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
 #include "log.h"
 
 #include "config.h"
 #include "libav.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
 
+/*
+ * Once log_start has been called, messages are formatted into a ring owned by
+ * the calling thread and written by a background thread. Each ring has a
+ * single producer and a single consumer, so pushing a message takes no lock.
+ * When a ring is full the message is dropped and counted, and the writer
+ * reports the count. Messages of different threads may be written slightly
+ * out of order.
+ *
+ * Rings are never freed: a ring of an exited thread is reused by the next new
+ * thread.
+ *
+ * Access log entries travel through the same rings. The strings of an entry
+ * are copied to the message buffer, address first.
+ */
+
+#define RING_SLOTS 128
+#define MESSAGE_SIZE 1000
+
+/** Longest time the writer sleeps if it's not woken up */
+#define WRITER_SLEEP_MSEC 100
+
+/** Level of access log records */
+#define LEVEL_REQUEST -1
+/** Longest path written to the access log, longer ones are truncated */
+#define MAX_REQUEST_PATH 256
+
+typedef struct record {
+  time_t time;
+  int level;
+  /** Must be a static string */
+  const char *subsys;
+  log_request_t request;
+  char message[MESSAGE_SIZE];
+} record_t;
+
+typedef struct ring {
+  record_t records[RING_SLOTS];
+  /* Written by the producer */
+  unsigned int head __attribute__((aligned(64)));
+  /* Written by the writer */
+  unsigned int tail __attribute__((aligned(64)));
+  int dropped;
+  bool owned;
+  struct ring *next;
+} ring_t;
+
 int log_level = LOG_INFO;
-const char *log_time_format = "%H:%M:%S";
 
-static void print
-  (int level, const char * subsys, const char *fmt, va_list va_args)
+static bool writer_running = false;
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+
+static ring_t *rings = NULL;
+static __thread ring_t *thread_ring = NULL;
+static pthread_key_t ring_key;
+
+/** Copy of log-time-format, changed with writer_mutex locked */
+static char time_format[128] = "%H:%M:%S";
+/** Time stamp of the last written second, formatted once per second */
+static time_t stamp_time = -1;
+static char stamp[128];
+
+static FILE *access_file = NULL;
+static bool access_clf = false;
+/** Time stamp of the last access log entry in Common Log Format */
+static time_t clf_time = -1;
+static char clf_stamp[64];
+
+
+static const char *format_time(time_t now)
+{
+  struct tm tm;
+
+  if (now == stamp_time) {
+    return stamp;
+  }
+  stamp_time = now;
+  if (!strftime(stamp, sizeof(stamp), time_format,
+                localtime_r(&now, &tm))) {
+    stamp[0] = '\0';
+  }
+  return stamp;
+}
+
+/**
+ * Writes @p string quoted for JSON or, with access_clf, for Common Log Format.
+ */
+static void write_escaped(const char *string)
+{
+  const unsigned char *p;
+
+  for (p = (const unsigned char *)string; *p != '\0'; ++p) {
+    if (*p == '"' || *p == '\\') {
+      fputc('\\', access_file);
+      fputc(*p, access_file);
+    } else if (*p < 0x20 || *p == 0x7f) {
+      fprintf(access_file, access_clf ? "\\x%02x" : "\\u%04x", *p);
+    } else {
+      fputc(*p, access_file);
+    }
+  }
+}
+
+static void write_request(record_t *record)
+{
+  log_request_t *request = &record->request;
+  const char *address = record->message,
+             *path = address + strlen(address) + 1;
+  struct tm tm;
+
+  if (!access_file) {
+    return;
+  }
+
+  if (access_clf) {
+    if (record->time != clf_time) {
+      clf_time = record->time;
+      strftime(clf_stamp, sizeof(clf_stamp), "%d/%b/%Y:%H:%M:%S %z",
+               localtime_r(&clf_time, &tm));
+    }
+    /* Timings are appended in microseconds */
+    write_escaped(address);
+    fprintf(access_file, " - - [%s] \"%s ", clf_stamp, request->method);
+    write_escaped(path);
+    fprintf(access_file, " HTTP/1.1\" %d %" PRId64 " %" PRId64 " %" PRId64
+            " %" PRId64, request->status, request->bytes, request->usec,
+            request->sqlite_usec, request->task_usec);
+    if (request->first_byte_usec >= 0) {
+      fprintf(access_file, " %" PRId64 "\n", request->first_byte_usec);
+    } else {
+      fputs(" -\n", access_file);
+    }
+    return;
+  }
+
+  fprintf(access_file, "{\"time\":%" PRId64 ",\"address\":\"",
+          (int64_t)record->time);
+  write_escaped(address);
+  fprintf(access_file, "\",\"method\":\"%s\",\"path\":\"", request->method);
+  write_escaped(path);
+  fprintf(access_file, "\",\"status\":%d,\"bytes\":%" PRId64 ","
+          "\"usec\":%" PRId64 ",\"sqlite_usec\":%" PRId64 ","
+          "\"task_usec\":%" PRId64, request->status, request->bytes,
+          request->usec, request->sqlite_usec, request->task_usec);
+  if (request->first_byte_usec >= 0) {
+    fprintf(access_file, ",\"first_byte_usec\":%" PRId64,
+            request->first_byte_usec);
+  }
+  fputs("}\n", access_file);
+}
+
+static void write_record(record_t *record)
+{
+  const char *timestr;
+
+  if (record->level == LEVEL_REQUEST) {
+    write_request(record);
+    return;
+  }
+
+  timestr = format_time(record->time);
+
+  if (record->level == LOG_ERROR) {
+    fputs("\033[1;31;40m", stderr);
+  }
+  if (record->level == LOG_FATAL) {
+    fputs("\033[0;1;41m", stderr);
+  }
+
+  fprintf(stderr, "%s [%s] %s", timestr, record->subsys, record->message);
+
+  if (record->level <= LOG_ERROR) {
+    fputs("\033[0m", stderr);
+  }
+  fputc('\n', stderr);
+}
+
+/**
+ * Writes queued records of all threads.
+ * @returns true if anything was written.
+ * @note Must be called with writer_mutex locked.
+ */
+static bool drain()
 {
-  time_t now;
-  char timestr[128];
-  
-  now = time(NULL);
-  
-  if (!strftime(timestr, sizeof(timestr), log_time_format, localtime(&now))) {
-    timestr[0] = '\0';
+  ring_t *ring;
+  unsigned int head, tail;
+  int dropped;
+  bool result = false;
+  record_t note;
+
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+       ring = ring->next) {
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    for (tail = ring->tail; tail != head; ++tail) {
+      write_record(&ring->records[tail % RING_SLOTS]);
+      result = true;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+    if (dropped) {
+      note.time = time(NULL);
+      note.level = LOG_WARNING;
+      note.subsys = "log";
+      snprintf(note.message, MESSAGE_SIZE,
+               "%d messages dropped, log is falling behind", dropped);
+      write_record(&note);
+      result = true;
+    }
   }
-  
-  if (level == LOG_ERROR) {
-    fprintf(stderr, "\033[1;31;40m");
+
+  if (result) {
+    fflush(stderr);
+    if (access_file) {
+      fflush(access_file);
+    }
   }
-  if (level == LOG_FATAL) {
-    fprintf(stderr, "\033[0;1;41m");
+  return result;
+}
+
+static void *writer_func(void *data)
+{
+  struct timespec wake;
+  (void)data;
+
+  pthread_mutex_lock(&writer_mutex);
+  while (true) {
+    if (drain()) {
+      continue;
+    }
+    clock_gettime(CLOCK_REALTIME, &wake);
+    wake.tv_nsec += WRITER_SLEEP_MSEC * 1000000L;
+    if (wake.tv_nsec >= 1000000000L) {
+      wake.tv_sec += 1;
+      wake.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&writer_cond, &writer_mutex, &wake);
   }
-  
-  fprintf(stderr, "%s [%s] ", timestr, subsys);
-  vfprintf(stderr, fmt, va_args);
-  
-  if (level <= LOG_ERROR) {
-    fprintf(stderr, "\033[0m");
+  return NULL;
+}
+
+static void release_ring(void *ring)
+{
+  __atomic_store_n(&((ring_t *)ring)->owned, false, __ATOMIC_RELEASE);
+}
+
+static ring_t *own_ring()
+{
+  ring_t *ring;
+  bool owned;
+
+  if (thread_ring) {
+    return thread_ring;
+  }
+
+  for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring;
+       ring = ring->next) {
+    owned = false;
+    if (__atomic_compare_exchange_n(&ring->owned, &owned, true, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+      break;
+    }
+  }
+
+  if (!ring) {
+    ring = calloc(1, sizeof(ring_t));
+    ring->owned = true;
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) { }
+  }
+
+  pthread_setspecific(ring_key, ring);
+  thread_ring = ring;
+  return ring;
+}
+
+static void flush_at_exit()
+{
+  pthread_mutex_lock(&writer_mutex);
+  drain();
+  pthread_mutex_unlock(&writer_mutex);
+}
+
+int log_start()
+{
+  const char *path = config_to_path("access-log");
+
+  if (path && path[0] != '\0') {
+    access_file = fopen(path, "a");
+    if (!access_file) {
+      musicd_perror(LOG_ERROR, "log", "can't open access log %s", path);
+      return -1;
+    }
+    access_clf = !strcmp(config_get("access-log-format"), "clf");
+  }
+
+  if (pthread_key_create(&ring_key, release_ring)) {
+    musicd_perror(LOG_ERROR, "log", "could not create thread key");
+    return -1;
+  }
+  if (pthread_create(&writer, NULL, writer_func, NULL)) {
+    musicd_perror(LOG_ERROR, "log", "could not create thread");
+    return -1;
+  }
+  pthread_detach(writer);
+  atexit(flush_at_exit);
+  __atomic_store_n(&writer_running, true, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/**
+ * @returns record to be filled and passed to commit_record, either a slot of
+ * the ring of the calling thread or @p sync_record if the record should be
+ * written right away. NULL if the ring is full and the record is dropped.
+ */
+static record_t *begin_record(int level, record_t *sync_record)
+{
+  ring_t *ring;
+  unsigned int head;
+
+  if (!__atomic_load_n(&writer_running, __ATOMIC_ACQUIRE)
+   || level == LOG_FATAL) {
+    return sync_record;
+  }
+
+  ring = own_ring();
+  head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING_SLOTS) {
+    __atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  return &ring->records[head % RING_SLOTS];
+}
+
+static void commit_record(record_t *record, record_t *sync_record)
+{
+  ring_t *ring = thread_ring;
+  unsigned int head;
+
+  if (record == sync_record) {
+    /* Written after anything queued before */
+    pthread_mutex_lock(&writer_mutex);
+    drain();
+    write_record(record);
+    fflush(stderr);
+    if (access_file) {
+      fflush(access_file);
+    }
+    pthread_mutex_unlock(&writer_mutex);
+    return;
+  }
+
+  head = ring->head;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+  if (head == __atomic_load_n(&ring->tail, __ATOMIC_RELAXED)) {
+    /* Ring was empty, the writer may be sleeping */
+    pthread_cond_signal(&writer_cond);
+  }
+}
+
+static void print(int level, const char *subsys, const char *suffix,
+                  const char *fmt, va_list va_args)
+{
+  record_t *record, sync_record;
+  int n;
+
+  record = begin_record(level, &sync_record);
+  if (!record) {
+    return;
+  }
+
+  record->time = time(NULL);
+  record->level = level;
+  record->subsys = subsys;
+  n = vsnprintf(record->message, MESSAGE_SIZE, fmt, va_args);
+  if (suffix && n >= 0 && n < MESSAGE_SIZE) {
+    snprintf(record->message + n, MESSAGE_SIZE - n, "%s", suffix);
+  }
+
+  commit_record(record, &sync_record);
+}
+
+void log_request(const log_request_t *request)
+{
+  record_t *record, sync_record;
+  size_t address_size, path_size;
+
+  if (!access_file) {
+    return;
+  }
+
+  record = begin_record(LEVEL_REQUEST, &sync_record);
+  if (!record) {
+    return;
+  }
+
+  record->time = time(NULL);
+  record->level = LEVEL_REQUEST;
+  record->subsys = "access";
+  record->request = *request;
+
+  address_size = strlen(request->address) + 1;
+  path_size = strlen(request->path);
+  if (path_size > MAX_REQUEST_PATH) {
+    path_size = MAX_REQUEST_PATH;
   }
+  memcpy(record->message, request->address, address_size);
+  memcpy(record->message + address_size, request->path, path_size);
+  record->message[address_size + path_size] = '\0';
 
+  commit_record(record, &sync_record);
 }
 
 void musicd_log(int level, const char *subsys, const char *fmt, ...)
@@ -64,20 +456,20 @@ void musicd_log(int level, const char *subsys, const char *fmt, ...)
     return;
   }
   va_start(va_args, fmt);
-  print(level, subsys, fmt, va_args);
-  fprintf(stderr, "\n");
+  print(level, subsys, NULL, fmt, va_args);
   va_end(va_args);
 }
 
 void musicd_perror(int level, const char *subsys, const char *fmt, ... )
 {
   va_list va_args;
+  char suffix[256];
   if (level > log_level) {
     return;
   }
+  snprintf(suffix, sizeof(suffix), ": %s", strerror(errno));
   va_start(va_args, fmt);
-  print(level, subsys, fmt, va_args);
-  fprintf(stderr, ": %s\n", strerror(errno));
+  print(level, subsys, suffix, fmt, va_args);
   va_end(va_args);
 }
 
@@ -106,6 +498,10 @@ void log_level_changed(char *level)
 
 void log_time_format_changed(char* format)
 {
-  log_time_format = format;
+  /* The writer only reads the copy, never the config value */
+  pthread_mutex_lock(&writer_mutex);
+  snprintf(time_format, sizeof(time_format), "%s", format);
+  stamp_time = -1;
+  pthread_mutex_unlock(&writer_mutex);
 }
 
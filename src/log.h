@@ -25,9 +25,38 @@
 #define LOG_VERBOSE 4
 #define LOG_DEBUG 5
 
+#include <stdint.h>
+
+/** Access log entry of a finished HTTP request, method must be static */
+typedef struct log_request {
+  const char *address;
+  const char *method;
+  const char *path;
+  int status;
+  int64_t bytes;
+  /** Time from request until the response was queued, streams until closed */
+  int64_t usec;
+  int64_t sqlite_usec; /**< Time spent in SQLite on the server thread */
+  int64_t task_usec; /**< Time spent waiting for tasks */
+  int64_t first_byte_usec; /**< Time to first byte of a stream, or -1 */
+} log_request_t;
+
+/**
+ * Opens the access log and starts writing log messages from a background
+ * thread. Until this is called, messages are written synchronously.
+ * @returns 0 on success, nonzero on failure.
+ */
+int log_start();
+
 void musicd_log(int level, const char *subsys, const char *fmt, ...);
 void musicd_perror(int level, const char *subsys, const char *fmt, ...);
 
+/**
+ * Writes @p request to the access log, if set with access-log.
+ * Like messages, entries are written by the log thread.
+ */
+void log_request(const log_request_t *request);
+
 void log_level_changed(char *level);
 void log_time_format_changed(char *format);
 
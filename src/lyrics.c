@@ -22,6 +22,7 @@
 #include "strings.h"
 #include "url.h"
 
+#include <inttypes.h>
 #include <string.h>
 
 lyrics_t *lyrics_new()
@@ -172,7 +173,7 @@ lyrics_t *lyrics_fetch(const track_t *track)
   page_name = stringf("%s:%s", track->artist, track->title);
   lyrics = handle_lyrics_page(page_name);
   free(page_name);
-  if (lyrics) {
+  if (lyrics || task_cancelled()) {
     return lyrics;
   }
 
@@ -191,6 +192,10 @@ lyrics_t *lyrics_fetch(const track_t *track)
     return NULL;
   }
   
+  if (task_cancelled()) {
+    goto finish;
+  }
+
   page_name = find_lyrics_page_name(page, track->title);
   if (page_name) {
     lyrics = handle_lyrics_page(page_name);
@@ -232,7 +237,10 @@ static void *task_func(void *args)
   }
 
   lyrics = lyrics_fetch(track);
-  library_lyrics_set(id, lyrics);
+  if (lyrics || !task_cancelled()) {
+    /* Don't remember missing lyrics if the search was cut short */
+    library_lyrics_set(id, lyrics);
+  }
 
   lyrics_free(lyrics);
   free(args);
@@ -248,6 +256,8 @@ task_t *lyrics_task(int64_t track)
 
   task->func = task_func;
   task->data = args;
+  task->discard = free;
+  task->key = stringf("lyrics:%" PRId64, track);
 
   return task;
 }
@@ -0,0 +1,313 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* For clock_gettime */
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include "scan.h"
+#include "server.h"
+#include "strings.h"
+#include "task.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Threads are assigned to shards round robin on their first update. With
+ * fewer threads than shards no two threads ever write to the same cache line.
+ */
+#define SHARDS 16
+#define MAX_HISTOGRAMS 48
+
+/** Bucket upper bounds in microseconds, the last bucket is +Inf */
+static const int64_t bucket_bounds[] = {
+  100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000,
+  500000, 1000000, 2500000, 5000000, 10000000
+};
+#define BUCKETS (sizeof(bucket_bounds) / sizeof(bucket_bounds[0]) + 1)
+
+typedef struct histogram_data {
+  int64_t buckets[BUCKETS];
+  int64_t sum;
+} histogram_data_t;
+
+typedef struct shard {
+  int64_t counters[METRICS_COUNTERS];
+  histogram_data_t histograms[MAX_HISTOGRAMS];
+} __attribute__((aligned(64))) shard_t;
+
+typedef struct histogram {
+  const char *family;
+  const char *help;
+  const char *label;
+  char *value;
+} histogram_t;
+
+static shard_t shards[SHARDS];
+
+static int next_shard = 0;
+static __thread int thread_shard = -1;
+
+static pthread_mutex_t histogram_mutex = PTHREAD_MUTEX_INITIALIZER;
+static histogram_t histograms[MAX_HISTOGRAMS];
+static int histogram_count = 0;
+
+static shard_t *shard()
+{
+  if (thread_shard < 0) {
+    thread_shard =
+      __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) % SHARDS;
+  }
+  return &shards[thread_shard];
+}
+
+int64_t metrics_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int64_t metrics_thread_cpu_usec()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void metrics_add(metrics_counter_t counter, int64_t value)
+{
+  __atomic_add_fetch(&shard()->counters[counter], value, __ATOMIC_RELAXED);
+}
+
+int metrics_histogram(const char *family, const char *help,
+                      const char *label, const char *value)
+{
+  int i, result = 0;
+
+  pthread_mutex_lock(&histogram_mutex);
+  for (i = 0; i < histogram_count; ++i) {
+    if (!strcmp(histograms[i].family, family)
+     && !strcmp(histograms[i].label, label)
+     && !strcmp(histograms[i].value, value)) {
+      result = i + 1;
+      goto finish;
+    }
+  }
+
+  if (histogram_count < MAX_HISTOGRAMS) {
+    histograms[histogram_count].family = family;
+    histograms[histogram_count].help = help;
+    histograms[histogram_count].label = label;
+    histograms[histogram_count].value = strcopy(value);
+    result = ++histogram_count;
+  }
+
+finish:
+  pthread_mutex_unlock(&histogram_mutex);
+  return result;
+}
+
+void metrics_observe(int histogram, int64_t usec)
+{
+  histogram_data_t *data;
+  unsigned int bucket;
+
+  if (histogram <= 0) {
+    return;
+  }
+
+  for (bucket = 0; bucket < BUCKETS - 1; ++bucket) {
+    if (usec <= bucket_bounds[bucket]) {
+      break;
+    }
+  }
+
+  data = &shard()->histograms[histogram - 1];
+  __atomic_add_fetch(&data->buckets[bucket], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&data->sum, usec, __ATOMIC_RELAXED);
+}
+
+
+static int64_t counter_sum(metrics_counter_t counter)
+{
+  int64_t result = 0;
+  int i;
+  for (i = 0; i < SHARDS; ++i) {
+    result += __atomic_load_n(&shards[i].counters[counter], __ATOMIC_RELAXED);
+  }
+  return result;
+}
+
+static void export_metric(string_t *out, const char *name, const char *type,
+                          const char *help)
+{
+  string_appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void export_histograms(string_t *out)
+{
+  histogram_data_t data;
+  const char *family = NULL;
+  int64_t cumulative;
+  unsigned int i, j, k;
+
+  pthread_mutex_lock(&histogram_mutex);
+
+  for (i = 0; i < (unsigned int)histogram_count; ++i) {
+    /* Samples of one family must be grouped together */
+    for (j = 0; j < i; ++j) {
+      if (!strcmp(histograms[j].family, histograms[i].family)) {
+        break;
+      }
+    }
+    if (j < i) {
+      continue;
+    }
+    family = histograms[i].family;
+    export_metric(out, family, "histogram", histograms[i].help);
+
+    for (j = i; j < (unsigned int)histogram_count; ++j) {
+      if (strcmp(histograms[j].family, family)) {
+        continue;
+      }
+
+      memset(&data, 0, sizeof(histogram_data_t));
+      for (k = 0; k < SHARDS; ++k) {
+        histogram_data_t *shard_data = &shards[k].histograms[j];
+        unsigned int b;
+        for (b = 0; b < BUCKETS; ++b) {
+          data.buckets[b] +=
+            __atomic_load_n(&shard_data->buckets[b], __ATOMIC_RELAXED);
+        }
+        data.sum += __atomic_load_n(&shard_data->sum, __ATOMIC_RELAXED);
+      }
+
+      cumulative = 0;
+      for (k = 0; k < BUCKETS; ++k) {
+        cumulative += data.buckets[k];
+        if (k < BUCKETS - 1) {
+          string_appendf(out, "%s_bucket{%s=\"%s\",le=\"%g\"} %" PRId64 "\n",
+                         family, histograms[j].label, histograms[j].value,
+                         bucket_bounds[k] / 1e6, cumulative);
+        } else {
+          string_appendf(out, "%s_bucket{%s=\"%s\",le=\"+Inf\"} %" PRId64 "\n",
+                         family, histograms[j].label, histograms[j].value,
+                         cumulative);
+        }
+      }
+      string_appendf(out, "%s_sum{%s=\"%s\"} %.6f\n", family,
+                     histograms[j].label, histograms[j].value, data.sum / 1e6);
+      string_appendf(out, "%s_count{%s=\"%s\"} %" PRId64 "\n", family,
+                     histograms[j].label, histograms[j].value, cumulative);
+    }
+  }
+
+  pthread_mutex_unlock(&histogram_mutex);
+}
+
+char *metrics_export()
+{
+  static const char *state_names[CLIENT_STATE_COUNT] = {
+    "normal", "feed", "wait_task", "drain"
+  };
+
+  string_t *out = string_new();
+  server_stats_t server;
+  task_stats_t tasks;
+  scan_status_t scan;
+  int64_t hits, misses, media, cpu;
+  time_t elapsed;
+  int i;
+
+  server_stats(&server);
+  export_metric(out, "musicd_clients", "gauge",
+                "Connected clients by state.");
+  for (i = 0; i < CLIENT_STATE_COUNT; ++i) {
+    string_appendf(out, "musicd_clients{state=\"%s\"} %d\n", state_names[i],
+                   server.clients[i]);
+  }
+  export_metric(out, "musicd_client_outbuf_bytes", "gauge",
+                "Bytes waiting in client output buffers.");
+  string_appendf(out, "musicd_client_outbuf_bytes %" PRId64 "\n",
+                 server.outbuf_bytes);
+
+  export_histograms(out);
+
+  task_stats(&tasks);
+  export_metric(out, "musicd_task_queue_depth", "gauge",
+                "Tasks waiting for a thread.");
+  string_appendf(out, "musicd_task_queue_depth %d\n", tasks.queued);
+  export_metric(out, "musicd_task_threads", "gauge",
+                "Threads in the task pool.");
+  string_appendf(out, "musicd_task_threads %d\n", tasks.threads);
+  export_metric(out, "musicd_task_active", "gauge",
+                "Task threads running a task.");
+  string_appendf(out, "musicd_task_active %d\n", tasks.active);
+  export_metric(out, "musicd_task_coalesced_total", "counter",
+                "Tasks that waited for an identical task instead of running.");
+  string_appendf(out, "musicd_task_coalesced_total %" PRId64 "\n",
+                 counter_sum(METRICS_TASKS_COALESCED));
+
+  media = counter_sum(METRICS_TRANSCODE_MEDIA_USEC);
+  cpu = counter_sum(METRICS_TRANSCODE_CPU_USEC);
+  export_metric(out, "musicd_transcode_media_seconds_total", "counter",
+                "Media time streamed.");
+  string_appendf(out, "musicd_transcode_media_seconds_total %.6f\n",
+                 media / 1e6);
+  export_metric(out, "musicd_transcode_cpu_seconds_total", "counter",
+                "CPU time spent streaming.");
+  string_appendf(out, "musicd_transcode_cpu_seconds_total %.6f\n",
+                 cpu / 1e6);
+  export_metric(out, "musicd_transcode_realtime_factor", "gauge",
+                "Media time streamed per CPU time spent.");
+  string_appendf(out, "musicd_transcode_realtime_factor %.3f\n",
+                 cpu > 0 ? (double)media / cpu : 0.0);
+
+  hits = counter_sum(METRICS_IMAGE_CACHE_HITS);
+  misses = counter_sum(METRICS_IMAGE_CACHE_MISSES);
+  export_metric(out, "musicd_image_cache_hits_total", "counter",
+                "Image requests served from cache.");
+  string_appendf(out, "musicd_image_cache_hits_total %" PRId64 "\n", hits);
+  export_metric(out, "musicd_image_cache_misses_total", "counter",
+                "Image requests that needed processing.");
+  string_appendf(out, "musicd_image_cache_misses_total %" PRId64 "\n", misses);
+  export_metric(out, "musicd_image_cache_hit_ratio", "gauge",
+                "Image cache hits per image request.");
+  string_appendf(out, "musicd_image_cache_hit_ratio %.3f\n",
+                 hits + misses > 0 ? (double)hits / (hits + misses) : 0.0);
+
+  scan_status(&scan);
+  export_metric(out, "musicd_scan_files_total", "counter",
+                "Files scanned.");
+  string_appendf(out, "musicd_scan_files_total %" PRId64 "\n",
+                 counter_sum(METRICS_SCAN_FILES));
+  export_metric(out, "musicd_scan_files_per_second", "gauge",
+                "Files scanned per second during the current or last scan.");
+  elapsed = (scan.end_time ? scan.end_time : time(NULL)) - scan.start_time;
+  string_appendf(out, "musicd_scan_files_per_second %.1f\n",
+                 scan.start_time && elapsed > 0
+                   ? (double)scan.files / elapsed : (double)scan.files);
+
+  return string_release(out);
+}
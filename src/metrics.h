@@ -0,0 +1,76 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef MUSICD_METRICS_H
+#define MUSICD_METRICS_H
+
+#include <stdint.h>
+
+/**
+ * Runtime metrics exported in Prometheus text format.
+ *
+ * Counters and histograms are kept in per-thread shards and updated with
+ * relaxed atomic additions, so recording never takes a lock. Shards are
+ * summed only when exported.
+ */
+
+typedef enum metrics_counter {
+  METRICS_IMAGE_CACHE_HITS = 0,
+  METRICS_IMAGE_CACHE_MISSES,
+  METRICS_SCAN_FILES,
+  METRICS_TRANSCODE_MEDIA_USEC,
+  METRICS_TRANSCODE_CPU_USEC,
+  METRICS_TASKS_COALESCED,
+  METRICS_COUNTERS /**< Amount of counters, not a counter */
+} metrics_counter_t;
+
+/**
+ * @returns monotonic time in microseconds.
+ */
+int64_t metrics_usec();
+/**
+ * @returns CPU time used by the calling thread in microseconds.
+ */
+int64_t metrics_thread_cpu_usec();
+
+/**
+ * Adds @p value to @p counter.
+ */
+void metrics_add(metrics_counter_t counter, int64_t value);
+
+/**
+ * Registers a latency histogram of @p family with label @p label set to
+ * @p value. Registering the same histogram again returns the same id.
+ * @p family, @p help and @p label must be static strings.
+ * @returns histogram id or 0 if there is no more room.
+ */
+int metrics_histogram(const char *family, const char *help,
+                      const char *label, const char *value);
+
+/**
+ * Records @p usec microseconds to @p histogram. Does nothing if
+ * @p histogram is 0.
+ */
+void metrics_observe(int histogram, int64_t usec);
+
+/**
+ * @returns all metrics in Prometheus text exposition format. Must be freed.
+ * @note Reads server state, call only from the server thread.
+ */
+char *metrics_export();
+
+#endif
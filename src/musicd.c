@@ -20,11 +20,14 @@
 #include "cache.h"
 #include "config.h"
 #include "db.h"
+#include "image.h"
 #include "libav.h"
 #include "library.h"
 #include "log.h"
+#include "protocol_http.h"
 #include "scan.h"
 #include "server.h"
+#include "task.h"
 #include "strings.h"
 
 #include <signal.h>
@@ -110,13 +113,28 @@ void start_scan_signal(int signum)
   scan_start();
 }
 
-time_t musicd_start_time = 0;
+static volatile sig_atomic_t reload_requested = 0;
 
-time_t musicd_uptime()
+void reload_config_signal(int signum)
 {
-  return time(NULL) - musicd_start_time;
+  (void)signum;
+  reload_requested = 1;
 }
 
+/**
+ * Reads the config file again. The command line still takes priority, its keys
+ * are not touched. Settings are applied through their hooks, others when they
+ * are next read.
+ */
+static void reload_config()
+{
+  musicd_log(LOG_INFO, "main", "caught HUP, reloading config");
+
+  if (!config_to_bool("no-config")
+   && config_load_file(config_to_path("config"))) {
+    musicd_log(LOG_ERROR, "main", "could not read config file");
+  }
+}
 
 
 int main(int argc, char* argv[])
@@ -130,6 +148,8 @@ int main(int argc, char* argv[])
   config_set("log-level", "debug");
 
   config_set_hook("directory", directory_changed);
+
+  http_config_init();
   
   config_set("config", "~/.musicd.conf");
   config_set("directory", "~/.musicd");
@@ -162,12 +182,13 @@ int main(int argc, char* argv[])
     return -1;
   }
   
-  /* Reload command line arguments - this is because the config file might have
-   * overwritten them, and the command line has the highest priority. */
-  config_load_args(argc, argv);
-  
   confirm_directory();
   
+  if (log_start()) {
+    musicd_log(LOG_FATAL, "main", "could not start log thread");
+    return -1;
+  }
+  
   musicd_log(LOG_INFO, "main", "musicd version %s", MUSICD_VERSION_STRING);
   
   srand(time(NULL));
@@ -178,6 +199,8 @@ int main(int argc, char* argv[])
   
   av_log_set_level(AV_LOG_QUIET);
 
+  image_init();
+
   if (db_open()) {
     musicd_log(LOG_FATAL, "library", "can't open database");
     return -1;
@@ -193,16 +216,27 @@ int main(int argc, char* argv[])
     return -1;
   }
   
+  if (task_pool_start()) {
+    musicd_log(LOG_FATAL, "main", "could not start task threads");
+    return -1;
+  }
+
   if (server_start()) {
     musicd_log(LOG_FATAL, "main", "could not start server");
     return -1;
   }
   
   signal(SIGUSR1, start_scan_signal);
+  signal(SIGHUP, reload_config_signal);
   scan_start();
   
   while (1) {
+    /* Interrupted by signals */
     sleep(1);
+    if (reload_requested) {
+      reload_requested = 0;
+      reload_config();
+    }
   }
   
   return 0;
@@ -17,14 +17,18 @@
  */
 #include "protocol_http.h"
 
+#include "arena.h"
 #include "cache.h"
 #include "client.h"
 #include "config.h"
+#include "db.h"
+#include "http_routes.h"
 #include "image.h"
 #include "json.h"
 #include "library.h"
 #include "log.h"
 #include "lyrics.h"
+#include "metrics.h"
 #include "musicd.h"
 #include "query.h"
 #include "session.h"
@@ -35,19 +39,71 @@
 #include <ctype.h>
 
 #define MAX_HEADER_SIZE (10 * 1024) /* Ten kilobytes */
+/** Arguments after this many are ignored */
+#define MAX_ARGS 32
+/** Initial size of the request arena */
+#define ARENA_SIZE (16 * 1024)
+/** Transcode CPU time is measured on every this many feeds and scaled up */
+#define CPU_SAMPLE_INTERVAL 16
+/** Tasks not started in this many microseconds are dropped */
+#define TASK_DEADLINE (30 * 1000000)
+
+/** Part of the request as offsets into the input buffer */
+typedef struct span {
+  int offset;
+  int length;
+} span_t;
+
+typedef struct http_arg {
+  const char *key;
+  const char *value; /**< NULL if the argument has no value */
+} http_arg_t;
 
 typedef struct http {
   client_t *client;
+  arena_t *arena; /**< Allocations of the current request */
+
+  /* Request parser state, kept between calls until the headers are read */
+  int line_start; /**< Offset of the first line not parsed yet */
+  int searched; /**< Bytes searched for the end of the current line */
+  int lines; /**< Lines parsed */
+  int end; /**< Length of the request once all headers are read */
+  /** The request was handled but is kept in the input buffer while a task
+   * callback may still read it */
+  bool handled;
 
   /* Current request */
   session_t *session;
-  const char *request;
-  char *query;
-  char *path;
-  char *args;
-  char *cookies;
+  const char *method;
+  span_t target; /**< Path and arguments */
+  span_t cookie;
+  span_t origin;
+  span_t accept;
+
+  /* Decoded path, arguments and session cookie, stored in strings */
+  const char *path;
+  http_arg_t args[MAX_ARGS];
+  int nargs;
+  const char *session_id;
+  char *strings; /**< Reused from request to request */
+  size_t strings_size;
+
+  int64_t request_start; /**< metrics_usec() when the request arrived */
+  int request_metric; /**< Latency histogram of the method called */
+  client_callback_t wait_callback; /**< Wrapped task callback */
+
+  /* Access log entry of the current request */
+  bool log_pending;
+  int status;
+  int64_t sent_start; /**< client->sent when the request arrived */
+  int64_t sqlite_usec;
+  int64_t wait_start; /**< metrics_usec() when a task wait began */
+  int64_t task_usec;
+  int64_t first_byte_usec;
 
   stream_t *stream;
+  double feed_position; /**< Stream position after the previous feed */
+  unsigned int feeds; /**< Feeds of the stream, for sampling CPU time */
 } http_t;
 
 struct { codec_type_t codec; const char *mime; } codecs[] = {
@@ -59,6 +115,105 @@ struct { codec_type_t codec; const char *mime; } codecs[] = {
   {CODEC_TYPE_NONE, NULL}
 };
 
+/**
+ * Settings used while serving requests. Rebuilt and swapped whenever one of
+ * them changes, so requests read plain fields instead of looking them up.
+ */
+typedef struct http_config {
+  bool no_auth;
+  bool enable_cors;
+  bool enable_metrics;
+  codec_type_t codec;
+  int bitrate; /**< Default stream bitrate in bps */
+  char *server_name;
+  char *user;
+  char *password;
+  char *http_root; /**< NULL if not set */
+
+  struct http_config *next; /**< Next retired snapshot */
+} http_config_t;
+
+static const char *http_config_keys[] = {
+  "no-auth", "enable-cors", "enable-metrics", "codec", "bitrate",
+  "server-name", "user", "password", "http-root", NULL
+};
+
+static http_config_t *http_config = NULL;
+/** Replaced snapshots, freed by the server thread between requests */
+static http_config_t *retired_configs = NULL;
+
+static void free_config(http_config_t *config)
+{
+  free(config->server_name);
+  free(config->user);
+  free(config->password);
+  free(config->http_root);
+  free(config);
+}
+
+static void http_config_changed(char *value)
+{
+  http_config_t *config = malloc(sizeof(http_config_t)), *old;
+  const char *path;
+  (void)value;
+
+  config->no_auth = config_to_bool("no-auth");
+  config->enable_cors = config_to_bool("enable-cors");
+  config->enable_metrics = config_to_bool("enable-metrics");
+  config->codec = config_get_value("codec")
+                ? codec_type_from_string(config_get("codec"))
+                : codec_type_from_string("mp3");
+  config->bitrate = config_to_int("bitrate") * 1000;
+  if (config->bitrate == 0) {
+    config->bitrate = 192000;
+  }
+  config->server_name = strcopy(config_get("server-name"));
+  config->user = strcopy(config_get("user"));
+  config->password = strcopy(config_get("password"));
+  path = config_to_path("http-root");
+  config->http_root = path ? strcopy(path) : NULL;
+
+  old = __atomic_exchange_n(&http_config, config, __ATOMIC_ACQ_REL);
+  if (old) {
+    old->next = __atomic_load_n(&retired_configs, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&retired_configs, &old->next, old,
+                                        true, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) { }
+  }
+}
+
+void http_config_init()
+{
+  const char **key;
+  for (key = http_config_keys; *key; ++key) {
+    config_set_hook(*key, http_config_changed);
+  }
+  http_config_changed(NULL);
+}
+
+/**
+ * @returns current settings, valid until the next request is processed.
+ */
+static const http_config_t *settings()
+{
+  return __atomic_load_n(&http_config, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Frees replaced settings. Called by the server thread, the only reader,
+ * before a request when no older snapshot can be in use.
+ */
+static void free_retired_configs()
+{
+  http_config_t *config, *next;
+
+  config = __atomic_exchange_n(&retired_configs, NULL, __ATOMIC_ACQUIRE);
+  for (; config; config = next) {
+    next = config->next;
+    free_config(config);
+  }
+}
+
 static const char *get_mime_by_codec(codec_type_t codec)
 {
   int i = 0;
@@ -71,91 +226,74 @@ static const char *get_mime_by_codec(codec_type_t codec)
   return codecs[0].mime;
 }
 
-static const char *args_ptr(http_t *http, const char *key)
+/**
+ * @returns the part of the request in @p span, not terminated.
+ */
+static const char *span_ptr(http_t *http, span_t span)
 {
-  const char *p = http->args;
+  return string_string(http->client->inbuf) + span.offset;
+}
 
-  if (!http->args) {
-    return NULL;
-  }
+/**
+ * @returns true if @p span contains @p needle, ignoring case
+ */
+static bool span_contains(http_t *http, span_t span, const char *needle)
+{
+  const char *p = span_ptr(http, span);
+  int i, j, n = strlen(needle);
 
-  while (1) {
-    if (strbeginswith(p, key)) {
-      return p + strlen(key);
+  for (i = 0; i + n <= span.length; ++i) {
+    for (j = 0; j < n && tolower(p[i + j]) == tolower(needle[j]); ++j) { }
+    if (j == n) {
+      return true;
     }
-    
-    p = strchr(p, '&');
-    if (!p) {
-      break;
+  }
+  return false;
+}
+
+static const http_arg_t *args_find(http_t *http, const char *key)
+{
+  int i;
+  for (i = 0; i < http->nargs; ++i) {
+    if (!strcmp(http->args[i].key, key)) {
+      return &http->args[i];
     }
-    ++p;
   }
   return NULL;
 }
 
 static int64_t args_int(http_t *http, const char *key)
 {
-  const char *p = args_ptr(http, key);
+  const http_arg_t *arg = args_find(http, key);
   int64_t result = 0;
 
-  if (!p) {
-    return 0;
-  }
-
-  /* The parameter is set but it has no value */
-  if (*p != '=') {
+  /* The parameter is not set or it has no value */
+  if (!arg || !arg->value) {
     return 0;
   }
   
-  sscanf(p, "=%" PRId64 "", &result);
+  sscanf(arg->value, "%" PRId64 "", &result);
   
   return result;
 }
 
 static bool args_bool(http_t *http, const char *key)
 {
-  const char *p = args_ptr(http, key);
-  return p ? true : false;
+  return args_find(http, key) ? true : false;
 }
 
-static char *args_str(http_t *http, const char *key)
+/**
+ * @returns decoded value of argument @p key, "" if it has no value or NULL
+ * if it's not set. Valid until the request is finished.
+ */
+static const char *args_str(http_t *http, const char *key)
 {
-  const char *p = args_ptr(http, key);
-  string_t *result;
-  char tmp;
+  const http_arg_t *arg = args_find(http, key);
 
-  if (!p) {
+  if (!arg) {
     return NULL;
   }
-  
-  /* The parameter is set but it has no value */
-  if (*p != '=') {
-    return strcopy("");
-  }
-  
-  result = string_new();
-  for (++p; *p != '&' && *p != '\0'; ++p) {
-    if (*p != '%') {
-      if (*p == '+') { /* + means space */
-        string_push_back(result, ' ');
-      } else {
-        string_push_back(result, *p);
-      }
-      continue;
-    }
-    
-    ++p;
-
-    if (!isxdigit(*p) || !isxdigit(*(p+1)) || sscanf(p, "%2hhx", &tmp) != 1) {
-      string_free(result);
-      return NULL;
-    }
-    string_push_back(result, tmp);
-    
-    ++p;
-  }
-  
-  return string_release(result);
+  return arg->value ? arg->value : "";
 }
 
 /**
@@ -168,6 +306,7 @@ static void http_begin_headers
    const char *content_type,
    int64_t content_length)
 {
+  http->status = status ? atoi(status) : 200;
   client_send(http->client, "HTTP/1.1 %s\r\n", status ? status : "200 OK");
   client_send(http->client, "Server: musicd/" MUSICD_VERSION_STRING "\r\n");
   if (content_length >= 0) {
@@ -179,20 +318,10 @@ static void http_begin_headers
   }
 
   // Cross-origin resource sharing
-  if (config_to_bool("enable-cors")) {
-    const char *origin_start = strcasestr(http->request, "\r\nOrigin: ");
-    if (origin_start) {
-      const char *origin_end = strchrnull(origin_start + 1, '\r');
-      char *origin = strextract(origin_start + 2, origin_end);
-
-      client_send(http->client, "Access-Control-Allow-");
-      client_send(http->client, origin);
-      client_send(http->client, "\r\n");
-
-      free(origin);
-
-      client_send(http->client, "Access-Control-Allow-Credentials: true\r\n");
-    }
+  if (settings()->enable_cors && http->origin.length > 0) {
+    client_send(http->client, "Access-Control-Allow-Origin: %.*s\r\n",
+                http->origin.length, span_ptr(http, http->origin));
+    client_send(http->client, "Access-Control-Allow-Credentials: true\r\n");
   }
 }
 
@@ -280,31 +409,54 @@ static void http_send_file
   }
 }
 
-static char *decode_url(const char **p)
+static int hex_value(char c)
 {
-  char tmp;
-  string_t *result = string_new();
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  return tolower(c) - 'a' + 10;
+}
 
-  for (; **p != '&' && **p != '\0'; ++*p) {
-    if (**p != '%') {
-      if (**p == '+') { /* + means space */
-        string_push_back(result, ' ');
-      } else {
-        string_push_back(result, **p);
-      }
-      continue;
-    }    
-    ++*p;
+/**
+ * Decodes URL encoded @p src of @p length bytes to @p dst and terminates it.
+ * @p dst needs at most @p length + 1 bytes.
+ * @returns pointer past the terminator in @p dst or NULL if @p src is
+ * malformed.
+ */
+static char *decode_to(char *dst, const char *src, int length)
+{
+  const char *end = src + length;
 
-    if (!isxdigit(**p) || !isxdigit(*(*p+1)) || sscanf(*p, "%2hhx", &tmp) != 1) {
-      string_free(result);
-      return NULL;
+  for (; src < end; ++src) {
+    if (*src == '+') { /* + means space */
+      *dst++ = ' ';
+    } else if (*src != '%') {
+      *dst++ = *src;
+    } else {
+      if (end - src < 3 || !isxdigit(src[1]) || !isxdigit(src[2])) {
+        return NULL;
+      }
+      *dst++ = hex_value(src[1]) << 4 | hex_value(src[2]);
+      src += 2;
     }
-    string_push_back(result, tmp);
-    
-    ++*p;
   }
-  return string_release(result);
+  *dst++ = '\0';
+  return dst;
+}
+
+/**
+ * @returns decoded @p p up to the first '&' allocated from the request arena,
+ * or NULL if malformed.
+ */
+static char *decode_url(http_t *http, const char *p)
+{
+  int length = strchrnull(p, '&') - p;
+  char *result = arena_alloc(http->arena, length + 1);
+
+  if (!decode_to(result, p, length)) {
+    return NULL;
+  }
+  return result;
 }
 
 /*static char *encode_url(const char *p)
@@ -323,68 +475,17 @@ static char *decode_url(const char **p)
   return string_release(result);
 }*/
 
-static char *cookie_get(http_t *http, const char *name)
-{
-  char *search = stringf("%s=", name),
-       *result = NULL;
-  const char *p1, *p2;
-
-  p1 = strstr(http->cookies, search);
-  if (!p1) {
-    goto finish;
-  }
-  p1 += strlen(search);
-  p2 = strchrnull(p1, ';');
-
-  result = strextract(p1, p2);
-
-finish:
-  free(search);
-  return result;
-}
-
 /** Iterates through all arguments and sets all valid filters to query. */
 static int parse_query_filters(http_t *http, query_t *query)
 {
-  const char *args = http->args, *p;
-  char *name, *value;
   query_field_t field;
+  int i;
 
-  if (!args) {
-    return 0;
-  }
-  p = args;
-  while (1) {
-    for (args = p; *p != '\0' && *p != '=' && *p != '&'; ++p) { }
-
-    if (*p == '\0') {
-      break;
-    }
-    if (*p == '&') {
-      args = ++p;
-      continue;
+  for (i = 0; i < http->nargs; ++i) {
+    field = query_field_from_string(http->args[i].key);
+    if (field && http->args[i].value) {
+      query_filter(query, field, http->args[i].value);
     }
-
-    name = strextract(args, p);
-    field = query_field_from_string(name);
-    free(name);
-    
-    ++p;
-
-    if (!field) {
-      for (; *p != '\0' && *p != '&'; ++p) { }
-    } else {
-      value = decode_url(&p);
-      if (value) {
-        query_filter(query, field, value);
-        free(value);
-      }
-    }
-
-    if (*p == '\0') {
-      break;
-    }
-    ++p;
   }
   return 0;
 }
@@ -403,12 +504,11 @@ static void parse_query_bounds(http_t *http, query_t *query)
 
 static void parse_query_sort(http_t *http, query_t *query)
 {
-  char *sort = args_str(http, "sort");
+  const char *sort = args_str(http, "sort");
   if (!sort) {
     return;
   }
   query_sort_from_string(query, sort);
-  free(sort);
 }
 
 static int64_t parse_total(http_t *http, query_t *query)
@@ -423,15 +523,15 @@ static int method_musicd(http_t *http)
 {
   json_t json;
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
-  json_define(&json, "name"); json_string(&json, config_get("server-name"));
+  json_define(&json, "name"); json_string(&json, settings()->server_name);
   json_define(&json, "version");  json_string(&json, MUSICD_VERSION_STRING);
   json_define(&json, "httpapi"); json_string(&json, "1");
 
   json_define(&json, "authed");
   json_bool(&json, (http->session && http->session->user) ||
-                    config_to_bool("no-auth"));
+                    settings()->no_auth);
 
   json_define(&json, "codecs");
   json_array_begin(&json);
@@ -463,7 +563,7 @@ static int method_auth(http_t *http)
   static const char *response_ok = "{\"auth\":\"ok\"}";
   static const char *response_error = "{\"auth\":\"error\"}";
 
-  char *user, *password;
+  const char *user, *password;
   session_t *session;
 
   user = args_str(http, "user");
@@ -471,20 +571,22 @@ static int method_auth(http_t *http)
 
   if (!user || !password) {
     http_reply(http, "400 Bad Requst");
-    goto finish;
+    return 0;
   }
 
-  if (strcmp(user, config_get("user"))
-   || strcmp(password, config_get("password"))) {
+  if (strcmp(user, settings()->user)
+   || strcmp(password, settings()->password)) {
 
     musicd_log(LOG_VERBOSE, "protocol_http", "%s failed auth",
                http->client->address);
     http_send_text(http, "200 OK", "text/json", response_error);
 
   } else {
-    session = session_new();
-    session->user = strcopy(user);
-    session_deref(session);
+    session = session_new(user);
+    if (!session) {
+      http_reply(http, "500 Internal Server Error");
+      return 0;
+    }
 
     musicd_log(LOG_VERBOSE, "protocol_http", "%s authed",
                http->client->address);
@@ -493,11 +595,9 @@ static int method_auth(http_t *http)
     client_send(http->client,
                 "Set-Cookie: musicd-session=%s;\r\n"
                 "\r\n%s", session->id, response_ok);
+    session_deref(session);
   }
 
-finish:
-  free(user);
-  free(password);
   return 0;
 }
 
@@ -508,7 +608,7 @@ static int method_status(http_t *http)
 
   scan_status(&status);
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   json_define(&json, "starttime"); json_int64(&json, musicd_start_time);
   json_define(&json, "time");      json_int64(&json, time(NULL));
@@ -566,7 +666,7 @@ static int method_tracks(http_t *http)
     goto finish;
   }
   
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   
   if (total) {
@@ -622,7 +722,7 @@ static int method_track_index(http_t *http)
     goto finish;
   }
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
 
   json_define(&json, "index");
@@ -664,7 +764,7 @@ static int method_artists(http_t *http)
     goto finish;
   }
   
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   
   if (total) {
@@ -718,7 +818,7 @@ static int method_albums(http_t *http)
     goto finish;
   }
   
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   
   if (total) {
@@ -754,34 +854,61 @@ static int64_t validate_image_size(int64_t size)
   if (size == 0) {
     return 0;
   }
-  if (size < 16) {
-    return 16;
+  if (size < IMAGE_SIZE_MIN) {
+    return IMAGE_SIZE_MIN;
   }
-  if (size > 512) {
-    return 512;
+  if (size > IMAGE_SIZE_MAX) {
+    return IMAGE_SIZE_MAX;
   }
   return size;
 }
 
-static int send_image(http_t *http, char *cache_name)
+/** Thumbnail being waited for, freeable with free() */
+struct image_request {
+  image_format_t format;
+  char cache_name[];
+};
+
+static void send_image_data(http_t *http, image_format_t format,
+                            cache_data_t *data)
 {
-  char *data;
-  int data_size;
-  data = cache_get(cache_name, &data_size);
-  if (!data) {
+  if (!data || !data->data) {
     http_reply(http, "404 Not Found");
-  } else {
-    http_send(http, "200 OK", "image/jpeg", data_size, data);
+    return;
   }
+  http_begin_headers(http, "200 OK", image_format_mime(format), data->size);
+  /* The format depends on Accept */
+  client_send(http->client, "Vary: Accept\r\n\r\n");
+  client_write(http->client, data->data, data->size);
+}
 
-  free(data);
-  free(cache_name);
+static int send_image(http_t *http, struct image_request *request)
+{
+  cache_data_t *data = cache_acquire(request->cache_name);
+  send_image_data(http, request->format, data);
+  cache_release(data);
+  free(request);
   return 0;
 }
 
+/**
+ * @returns the smallest thumbnail format listed in the Accept header
+ */
+static image_format_t accepted_image_format(http_t *http)
+{
+  if (image_format_supported(IMAGE_FORMAT_WEBP)
+   && span_contains(http, http->accept, "image/webp")) {
+    return IMAGE_FORMAT_WEBP;
+  }
+  return IMAGE_FORMAT_JPEG;
+}
+
 static int method_image(http_t *http)
 {
   int64_t image, size;
+  image_format_t format;
+  struct image_request *request;
+  cache_data_t *data;
   char *cache_name, *path;
   task_t *task;
 
@@ -805,14 +932,28 @@ static int method_image(http_t *http)
     return 0;
   }
 
-  cache_name = image_cache_name(image, size);
-  if (cache_exists(cache_name)) {
-    return send_image(http, cache_name);
+  format = accepted_image_format(http);
+  cache_name = image_cache_name(image, size, format);
+
+  data = cache_acquire(cache_name);
+  if (data) {
+    metrics_add(METRICS_IMAGE_CACHE_HITS, 1);
+    send_image_data(http, format, data);
+    cache_release(data);
+    free(cache_name);
+    return 0;
   }
+  metrics_add(METRICS_IMAGE_CACHE_MISSES, 1);
+
+  request = malloc(sizeof(struct image_request) + strlen(cache_name) + 1);
+  request->format = format;
+  strcpy(request->cache_name, cache_name);
+  free(cache_name);
 
-  task = image_task(image, size);
+  task = image_task(image, format);
+  task->deadline = metrics_usec() + TASK_DEADLINE;
   task_start(task);
-  client_wait_task(http->client, task, (client_callback_t)send_image, cache_name);
+  client_wait_task(http->client, task, (client_callback_t)send_image, request);
   return 0;
 }
 
@@ -829,6 +970,7 @@ static int method_album_image(http_t *http)
     return 0;
   }
 
+  http->status = 302;
   client_send(http->client,
               "HTTP/1.1 302 Found\r\n"
               "Server: musicd/" MUSICD_VERSION_STRING "\r\n"
@@ -855,7 +997,7 @@ static int method_album_images(http_t *http)
     return 0;
   }
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   json_define(&json, "images");
   json_array_begin(&json);
@@ -874,7 +1016,7 @@ static void send_lyrics(http_t *http, lyrics_t *lyrics)
 {
   json_t json;
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   json_define(&json, "lyrics"); json_string(&json, lyrics->lyrics);
   json_define(&json, "provider"); json_string(&json, lyrics->provider);
@@ -923,6 +1065,7 @@ static int method_track_lyrics(http_t *http)
 
   if (!ltime) {
     task = lyrics_task(track);
+    task->deadline = metrics_usec() + TASK_DEADLINE;
     task_start(task);
 
     id_ptr = malloc(sizeof(int64_t));
@@ -954,11 +1097,17 @@ static bool root_iterate_directories(library_directory_t *directory, void *opaqu
 
 static int method_root(http_t *http)
 {
-  const char *raw_temp = http->path + strlen("/root");
-  char *request_path = decode_url(&raw_temp),
+  char *request_path = decode_url(http, http->path + strlen("/root")),
        *root_path = library_root_path(),
-       *full_path = stringf("%s%s", root_path, request_path);
-  int64_t directory = library_directory(full_path, -1);
+       *full_path;
+  int64_t directory;
+
+  if (!request_path) {
+    http_reply(http, "400 Bad Request");
+    goto finish;
+  }
+  full_path = arena_stringf(http->arena, "%s%s", root_path, request_path);
+  directory = library_directory(full_path, -1);
 
   musicd_log(LOG_DEBUG, "protocol_http", "%s %s %s", request_path, root_path, full_path);
 
@@ -969,7 +1118,7 @@ static int method_root(http_t *http)
 
   json_t json;
 
-  json_init(&json);
+  json_init_in(&json, http->arena);
   json_object_begin(&json);
   json_define(&json, "directories");
   json_array_begin(&json);
@@ -980,15 +1129,16 @@ static int method_root(http_t *http)
   http_send_text(http, "200 OK", "text/json", json_result(&json));
 
 finish:
-  free(request_path);
   free(root_path);
-  free(full_path);
   return 0;
 }
 
 static int feed_write(void *opaque, uint8_t *buf, int buf_size)
 {
   http_t *http = (http_t *)opaque;
+  if (http->first_byte_usec < 0) {
+    http->first_byte_usec = metrics_usec() - http->request_start;
+  }
   client_write(http->client, (char *)buf, buf_size);
   return buf_size;
 }
@@ -998,19 +1148,13 @@ static int method_open(http_t *http)
   int64_t id, seek, bitrate;
   track_t *track = NULL;
   stream_t *stream;
-  codec_type_t codec;
-  if (config_get_value("codec"))
-    codec = codec_type_from_string(config_get("codec"));
-  else
-    codec = codec_type_from_string("mp3");
+  codec_type_t codec = settings()->codec;
 
   id = args_int(http, "id");
   seek = args_int(http, "seek");
   bitrate = args_int(http, "bitrate");
   if (!bitrate) {
-    bitrate = config_to_int("bitrate") * 1000;
-    if (bitrate == 0)
-      bitrate = 192000;
+    bitrate = settings()->bitrate;
   } else if (bitrate < 64000) {
     bitrate = 64000;
   } else if (bitrate > 320000) {
@@ -1048,6 +1192,8 @@ static int method_open(http_t *http)
   }
 
   http->stream = stream;
+  http->feed_position = -1;
+  http->feeds = 0;
   http_send_headers(http, "200 OK", get_mime_by_codec(codec), -1);
   stream_start(stream);
   client_start_feed(http->client);
@@ -1055,41 +1201,34 @@ static int method_open(http_t *http)
   return 0;
 }
 
+static int method_metrics(http_t *http)
+{
+  char *metrics;
+
+  if (!settings()->enable_metrics) {
+    http_reply(http, "404 Not Found");
+    return 0;
+  }
+
+  metrics = metrics_export();
+  http_send_text(http, "200 OK", "text/plain; version=0.0.4", metrics);
+  free(metrics);
+  return 0;
+}
 
-#define NO_AUTH 0x02 // Allow access without authorisation
-#define SHARE_CAPABLE 0x04 // Supports restricted share access
-#define ONLY_PREFIX 0x08 // Will be called as long as path begins with the name
 
 struct method_entry {
   const char *name;
   int (*handler)(http_t *http);
   int flags;
 };
+#define METHOD(name, handler, flags) { name, handler, flags },
 static struct method_entry methods[] = {
-  { "/musicd", method_musicd, NO_AUTH },
-  { "/auth", method_auth, NO_AUTH },
-
-  { "/status", method_status, 0 },
-
-  { "/rescan", method_rescan, 0 },
-
-  { "/tracks", method_tracks, 0 },
-  { "/track/index", method_track_index, 0 },
-  { "/artists", method_artists, 0 },
-  { "/albums", method_albums, 0 },
-
-  { "/image", method_image, 0 },
-  { "/album/image", method_album_image, 0 },
-  { "/album/images", method_album_images, 0 },
-
-  { "/track/lyrics", method_track_lyrics, 0 },
-
-  { "/root", method_root, ONLY_PREFIX },
-
-  { "/open", method_open, 0 },
-
-  { NULL, NULL, 0 }
+  HTTP_METHODS(METHOD)
 };
+#undef METHOD
+/** Latency histograms of methods, registered on first call */
+static int method_histograms[sizeof(methods) / sizeof(methods[0])];
 
 struct mime_entry {
   const char *extension;
@@ -1124,28 +1263,25 @@ const char *mime_type_from_path(const char *path)
 
 static void attach_session(http_t *http)
 {
+  const char *session_id;
+
   http->session = NULL;
 
-  if (config_to_bool("no-auth")) {
+  if (settings()->no_auth) {
     return;
   }
 
-  char *session_id;
-
   session_id = args_str(http, "share");
   if (session_id) {
     http->session = session_get(session_id);
-    free(session_id);
     if (http->session) {
       /* Valid share */
       return;
     }
   }
 
-  session_id = cookie_get(http, "musicd-session");
-  if (session_id) {
-    http->session = session_get(session_id);
-    free(session_id);
+  if (http->session_id) {
+    http->session = session_get(http->session_id);
     if (http->session) {
       /* Valid session (real or share) */
       return;
@@ -1153,57 +1289,128 @@ static void attach_session(http_t *http)
   }
 }
 
-static int call_method(http_t *http)
+static void begin_log_entry(http_t *http)
 {
-  struct method_entry *method;
+  http->log_pending = true;
+  http->status = 0;
+  http->sent_start = http->client->sent;
+  http->sqlite_usec = 0;
+  http->task_usec = 0;
+  http->first_byte_usec = -1;
+}
 
-  for (method = methods; method->name != NULL; ++method) {
+/**
+ * Writes the pending access log entry, if any. Called once the response has
+ * been queued, not sent: streams are logged when the client is closed.
+ */
+static void finish_log_entry(http_t *http)
+{
+  log_request_t request;
 
-    if ((method->flags & ONLY_PREFIX &&
-         strlen(http->path) > strlen(method->name) &&
-         !strncmp(method->name, http->path, strlen(method->name))) ||
-        !strcmp(method->name, http->path)) {
-      /* Forbidden if
-       * - auth is not disabled
-       * - method requires authorisation
-       * - no valid session or
-       *   the session is a share and the method doesn't handle shares
-       */
-      if (!config_to_bool("no-auth") &&
-          !(method->flags & NO_AUTH) &&
-          (!http->session ||
-           (!(method->flags & SHARE_CAPABLE) && !http->session->user))) {
-        http_reply(http, "403 Forbidden");
-        return 0;
-      }
-      return method->handler(http);
-    }
+  if (!http->log_pending) {
+    return;
   }
-  return 1;
+
+  request.address = http->client->address;
+  request.method = http->method;
+  request.path = http->path;
+  /* No response was sent, the client went away */
+  request.status = http->status ? http->status : 499;
+  request.bytes = http->client->sent - http->sent_start;
+  request.usec = metrics_usec() - http->request_start;
+  request.sqlite_usec = http->sqlite_usec;
+  request.task_usec = http->task_usec;
+  request.first_byte_usec = http->first_byte_usec;
+  log_request(&request);
+
+  http->log_pending = false;
+}
+
+/**
+ * Task callback wrapper recording the latency of methods waiting for a task.
+ */
+static int finish_wait(http_t *http, void *data)
+{
+  int64_t sqlite_start = db_thread_usec();
+  int result;
+
+  http->task_usec += metrics_usec() - http->wait_start;
+  result = http->wait_callback(http, data);
+  http->sqlite_usec += db_thread_usec() - sqlite_start;
+  arena_reset(http->arena);
+
+  metrics_observe(http->request_metric, metrics_usec() - http->request_start);
+  if (http->client->state != CLIENT_STATE_WAIT_TASK && !http->stream) {
+    finish_log_entry(http);
+  }
+  return result;
+}
+
+static int call_handler(http_t *http, struct method_entry *method)
+{
+  int *metric = &method_histograms[method - methods];
+  int result;
+
+  if (!*metric) {
+    *metric =
+      metrics_histogram("musicd_http_request_duration_seconds",
+                        "HTTP API request latency.", "method", method->name);
+  }
+  http->request_metric = *metric;
+
+  result = method->handler(http);
+
+  if (http->client->state == CLIENT_STATE_WAIT_TASK) {
+    /* Reply is sent once the task finishes */
+    http->wait_start = metrics_usec();
+    http->wait_callback = http->client->wait_callback;
+    http->client->wait_callback = (client_callback_t)finish_wait;
+  } else {
+    metrics_observe(http->request_metric,
+                    metrics_usec() - http->request_start);
+  }
+  return result;
+}
+
+static int call_method(http_t *http, struct method_entry *method)
+{
+  /* Forbidden if
+   * - auth is not disabled
+   * - method requires authorisation
+   * - no valid session or
+   *   the session is a share and the method doesn't handle shares
+   */
+  if (!settings()->no_auth &&
+      !(method->flags & NO_AUTH) &&
+      (!http->session ||
+       (!(method->flags & SHARE_CAPABLE) && !http->session->user))) {
+    http_reply(http, "403 Forbidden");
+    return 0;
+  }
+  return call_handler(http, method);
 }
 
 static int send_document(http_t *http)
 {
+  const char *http_root = settings()->http_root;
   int result;
   char *path;
   const char *mime;
 
-  if (!config_get_value("http-root")) {
+  if (!http_root) {
     return 1;
   }
 
   if (!strcmp(http->path, "/")) {
-    path = stringf("%s/index.html", config_to_path("http-root"));
+    path = arena_stringf(http->arena, "%s/index.html", http_root);
     result = http_try_send_file(http, path, "text/html");
-    free(path);
     return result ? 0 : 1;
   }
 
-  path = stringf("%s/%s", config_to_path("http-root"), http->path);
+  path = arena_stringf(http->arena, "%s/%s", http_root, http->path);
   if (strstr(path, "/../")) {
     /* Let's just assume someone is doing something bad */
     http_reply(http, "403 Forbidden");
-    free(path);
     return 0;
   }
 
@@ -1213,34 +1420,12 @@ static int send_document(http_t *http)
              path, mime);
 
   result = http_try_send_file(http, path, mime);
-  free(path);
   return result ? 0 : 1;
 }
 
-#ifdef HTTP_BUILTIN
-/* Found in generated http_builtin.c */
-extern int http_builtin_file(char *url, char **data, int *size);
-
-static int send_builtin(http_t *http)
-{
-  char *path = http->path, *data;
-  int size;
-
-  if (!strcmp(http->path, "/")) {
-    path = "/index.html";
-  }
-
-  if (!http_builtin_file(path, &data, &size)) {
-    return 1;
-  }
-
-  http_send(http, NULL, mime_type_from_path(path), size, data);
-  return 0;
-}
-#endif
-
 static int process_request(http_t *http)
 {
+  const http_route_t *route = http_route_find(http->path);
   int result;
 
   /* Search order:
@@ -1249,19 +1434,19 @@ static int process_request(http_t *http)
    * 3. Builtin resource (if built in)
    */
 
-  if ((result = call_method(http)) <= 0) {
-    return result;
+  if (route && route->type == HTTP_ROUTE_METHOD) {
+    return call_method(http, &methods[route->method]);
   }
 
   if ((result = send_document(http)) <= 0) {
     return result;
   }
 
-#ifdef HTTP_BUILTIN
-  if ((result = send_builtin(http)) <= 0) {
-    return result;
+  if (route && route->type == HTTP_ROUTE_BUILTIN) {
+    http_send(http, NULL, mime_type_from_path(route->url), route->length,
+              route->data);
+    return 0;
   }
-#endif
 
   http_reply(http, "404 Not Found");
   return 0;
@@ -1288,114 +1473,336 @@ static void *http_open(client_t *client)
   http_t *http = malloc(sizeof(http_t));
   memset(http, 0, sizeof(http_t));
   http->client = client;
+  http->arena = arena_new(ARENA_SIZE);
   return http;
 }
 
 static void http_close(void *self)
 {
   http_t *http = (http_t *)self;
+  finish_log_entry(http);
   stream_close(http->stream);
+  free(http->strings);
+  arena_free(http->arena);
   free(http);
 }
 
-static int http_process(void *self, const char *buf, size_t buf_size)
+static bool header_is(const char *line, int length, const char *name)
 {
-  http_t *http = (http_t *)self;
-  const char *end, *p1, *p2;
-  int result = 0;
+  int i, n = strlen(name);
 
-  /* Do we have all headers? */
-  end = strstr(buf, "\r\n\r\n");
-  if (!end) {
-    if (buf_size > MAX_HEADER_SIZE) {
-      /* Way too big header */
-      musicd_log(LOG_VERBOSE, "protocol_http",
-                 "MAX_HEADER_SIZE exceeded (%d > %d)",
-                 buf_size, MAX_HEADER_SIZE);
-      http_reply(http, "400 Bad Request");
-      return -1;
+  if (length <= n || line[n] != ':') {
+    return false;
+  }
+  for (i = 0; i < n; ++i) {
+    if (tolower(line[i]) != tolower(name[i])) {
+      return false;
     }
-    /* Not enough data */
-    return 0;
   }
-  end += 4;
+  return true;
+}
 
-  /* Is this an HTTP method we can handle? */
-  if (strbeginswith(buf, "GET ")
-   || strbeginswith(buf, "HEAD ")) {
+/**
+ * Records the value of header @p line of @p length bytes at @p offset, if it
+ * is one we need.
+ */
+static void parse_header(http_t *http, const char *line, int offset,
+                         int length)
+{
+  span_t *span;
+  int start;
+
+  if (header_is(line, length, "Cookie")) {
+    span = &http->cookie;
+  } else if (header_is(line, length, "Origin")) {
+    span = &http->origin;
+  } else if (header_is(line, length, "Accept")) {
+    span = &http->accept;
+  } else {
+    return;
+  }
+
+  for (start = strchr(line, ':') - line + 1;
+       start < length && (line[start] == ' ' || line[start] == '\t');
+       ++start) { }
+  span->offset = offset + start;
+  span->length = length - start;
+}
+
+/**
+ * Parses "METHOD TARGET VERSION" of @p length bytes at @p offset.
+ * @returns 0 on success, -1 if malformed.
+ */
+static int parse_request_line(http_t *http, const char *line, int offset,
+                              int length)
+{
+  const char *target, *end = line + length;
+
+  if (length > 4 && !strncmp(line, "GET ", 4)) {
+    http->method = "GET";
+  } else if (length > 5 && !strncmp(line, "HEAD ", 5)) {
+    http->method = "HEAD";
   } else {
     musicd_log(LOG_VERBOSE, "protocol_http",
                "unsupported http method (not GET or HEAD)");
-    http_reply(http, "400 Bad Request");
     return -1;
   }
-  http->request = buf;
-  
-  /* Extract HTTP query */
-  for (p1 = buf; *p1 != ' '; ++p1) { }
-  ++p1;
-  if (*p1 != '/') {
+
+  memset(&http->cookie, 0, sizeof(span_t));
+  memset(&http->origin, 0, sizeof(span_t));
+  memset(&http->accept, 0, sizeof(span_t));
+
+  target = line + strlen(http->method) + 1;
+  if (*target != '/') {
     /* Not valid */
-    http_reply(http, "400 Bad Request");
     return -1;
   }
 
-  for (p2 = p1; *p2 != ' '; ++p2) {
-    if (*p2 == '\0' || *p2 == '\r' || *p2 == '\n') {
-      musicd_log(LOG_VERBOSE, "protocol_http",
-                 "malformed request line (no tailing version)");
-      musicd_log(LOG_DEBUG, "protocol_http", "request was:\n%s", buf);
-      http_reply(http, "400 Bad Request");
-      return -1;
+  http->target.offset = offset + (target - line);
+  for (; target < end && *target != ' '; ++target) { }
+  if (target == end) {
+    musicd_log(LOG_VERBOSE, "protocol_http",
+               "malformed request line (no tailing version)");
+    musicd_log(LOG_DEBUG, "protocol_http", "request line was: %.*s", length,
+               line);
+    return -1;
+  }
+  http->target.length = offset + (target - line) - http->target.offset;
+  return 0;
+}
+
+/**
+ * Parses lines of @p buf not parsed by previous calls.
+ * @returns 1 if all headers are read, 0 if more data is needed or -1 if the
+ * request is malformed.
+ */
+static int parse_request(http_t *http, const char *buf, size_t buf_size)
+{
+  const char *line, *eol;
+  int length;
+
+  while (1) {
+    line = buf + http->line_start;
+    eol = memchr(buf + http->searched, '\n', buf_size - http->searched);
+    if (!eol) {
+      http->searched = buf_size;
+      if (buf_size > MAX_HEADER_SIZE) {
+        /* Way too big header */
+        musicd_log(LOG_VERBOSE, "protocol_http",
+                   "MAX_HEADER_SIZE exceeded (%d > %d)",
+                   buf_size, MAX_HEADER_SIZE);
+        return -1;
+      }
+      /* Not enough data */
+      return 0;
+    }
+
+    length = eol - line;
+    if (length > 0 && line[length - 1] == '\r') {
+      --length;
     }
+
+    if (http->lines == 0) {
+      if (parse_request_line(http, line, http->line_start, length)) {
+        return -1;
+      }
+    } else if (length == 0) {
+      http->end = eol + 1 - buf;
+      return 1;
+    } else {
+      parse_header(http, line, http->line_start, length);
+    }
+
+    ++http->lines;
+    http->line_start = http->searched = eol + 1 - buf;
   }
+}
 
-  http->query = strextract(p1, p2);
-  
-  musicd_log(LOG_VERBOSE, "protocol_http", "query: %s", http->query);
-
-  /* Extract path and arguments from query */
-  p2 = strchr(http->query, '?');
-  if (!p2) {
-    /* No arguments */
-    http->path = strcopy(http->query);
-    http->args = NULL;
-  } else {
-    http->path = strextract(http->query, p2);
-    http->args = strextract(p2 + 1, NULL);
+/**
+ * Decodes the session cookie from the Cookie header to @p dst.
+ * @returns pointer past the decoded cookie in @p dst.
+ */
+static char *decode_session_cookie(http_t *http, char *dst)
+{
+  static const char *name = "musicd-session=";
+  const char *p = span_ptr(http, http->cookie),
+             *end = p + http->cookie.length, *value;
+  int n = strlen(name);
+
+  while (p < end) {
+    for (; p < end && (*p == ' ' || *p == ';'); ++p) { }
+    for (value = p; value < end && *value != ';'; ++value) { }
+    if (value - p >= n && !strncmp(p, name, n)) {
+      http->session_id = dst;
+      memcpy(dst, p + n, value - p - n);
+      dst += value - p - n;
+      *dst++ = '\0';
+      break;
+    }
+    p = value;
   }
+  return dst;
+}
 
-  /* Extract cookies */
-  p1 = strstr(http->request, "Cookie: ");
-  if (!p1) {
-    http->cookies = strcopy("");
-  } else {
-    p2 = strstrnull(p1, "\r\n");
-    http->cookies = strextract(p1, p2);
+/**
+ * Decodes the path, arguments and session cookie of the parsed request into
+ * http->strings, which is only reallocated if a request doesn't fit.
+ */
+static void decode_request(http_t *http)
+{
+  const char *target = span_ptr(http, http->target),
+             *end = target + http->target.length, *p, *separator, *equals;
+  char *dst, *next;
+  size_t size;
+  http_arg_t *arg;
+
+  /* Decoded strings are never longer than the input, one terminator each */
+  size = 2 * http->target.length + http->cookie.length + 2;
+  if (size > http->strings_size) {
+    free(http->strings);
+    http->strings = malloc(size);
+    http->strings_size = size;
+  }
+  dst = http->strings;
+
+  /* The path stays encoded, /root decodes it itself */
+  for (p = target; p < end && *p != '?'; ++p) { }
+  http->path = dst;
+  memcpy(dst, target, p - target);
+  dst += p - target;
+  *dst++ = '\0';
+
+  http->nargs = 0;
+  for (; p < end; p = separator) {
+    ++p; /* Skip '?' or '&' */
+    for (separator = p; separator < end && *separator != '&'; ++separator) { }
+    if (separator == p) {
+      continue;
+    }
+    if (http->nargs >= MAX_ARGS) {
+      musicd_log(LOG_VERBOSE, "protocol_http", "ignoring arguments after %d",
+                 MAX_ARGS);
+      break;
+    }
+    for (equals = p; equals < separator && *equals != '='; ++equals) { }
+
+    /* Malformed arguments are skipped */
+    arg = &http->args[http->nargs];
+    arg->key = dst;
+    next = decode_to(dst, p, equals - p);
+    if (!next) {
+      continue;
+    }
+    arg->value = NULL;
+    if (equals < separator) {
+      arg->value = next;
+      next = decode_to(next, equals + 1, separator - equals - 1);
+      if (!next) {
+        continue;
+      }
+    }
+    dst = next;
+    ++http->nargs;
+  }
+
+  http->session_id = NULL;
+  decode_session_cookie(http, dst);
+}
+
+/**
+ * Resets the parser for the next request.
+ * @returns length of the finished request.
+ */
+static int finish_request(http_t *http)
+{
+  int result = http->end;
+  http->line_start = 0;
+  http->searched = 0;
+  http->lines = 0;
+  http->end = 0;
+  http->handled = false;
+  return result;
+}
+
+static int http_process(void *self, const char *buf, size_t buf_size)
+{
+  http_t *http = (http_t *)self;
+  int64_t sqlite_start;
+  int result = 0;
+
+  if (http->handled) {
+    /* Answered once the task finished, nothing reads the request anymore */
+    return finish_request(http);
+  }
+
+  result = parse_request(http, buf, buf_size);
+  if (result <= 0) {
+    if (result < 0) {
+      http_reply(http, "400 Bad Request");
+    }
+    return result;
   }
 
-  /*musicd_log(LOG_DEBUG, "protocol_http", "cookies: '%s'", http->cookies);*/
+  http->request_start = metrics_usec();
+  free_retired_configs();
+
+  /* A stream still being sent is not followed by requests normally */
+  finish_log_entry(http);
+
+  decode_request(http);
+
+  musicd_log(LOG_VERBOSE, "protocol_http", "query: %.*s", http->target.length,
+             span_ptr(http, http->target));
+
+  begin_log_entry(http);
+  sqlite_start = db_thread_usec();
 
   attach_session(http);
   
   result = process_request(http);
+  /* Anything a task callback needs is malloc'd */
+  arena_reset(http->arena);
+
+  http->sqlite_usec += db_thread_usec() - sqlite_start;
+  if (http->client->state != CLIENT_STATE_WAIT_TASK && !http->stream) {
+    finish_log_entry(http);
+  }
 
   session_deref(http->session);
-  free(http->query);
-  free(http->path);
-  free(http->args);
-  free(http->cookies);
 
   if (result < 0) {
     return result;
   }
-  return end - buf;
+  if (http->client->state == CLIENT_STATE_WAIT_TASK) {
+    /* The request is consumed after the task callback, which may read it */
+    http->handled = true;
+    return 0;
+  }
+  return finish_request(http);
 }
 
 int http_feed(void *self)
 {
   http_t *http = (http_t *)self;
+  /* Reading the thread CPU clock is a system call, so only sample it */
+  bool sample = http->feeds++ % CPU_SAMPLE_INTERVAL == 0;
+  int64_t cpu = sample ? metrics_thread_cpu_usec() : 0;
+  double position;
   int result = stream_next(http->stream);
+
+  if (sample) {
+    metrics_add(METRICS_TRANSCODE_CPU_USEC,
+                (metrics_thread_cpu_usec() - cpu) * CPU_SAMPLE_INTERVAL);
+  }
+  position = stream_position(http->stream);
+  if (position >= 0) {
+    if (http->feed_position >= 0 && position > http->feed_position) {
+      metrics_add(METRICS_TRANSCODE_MEDIA_USEC,
+                  (position - http->feed_position) * 1000000);
+    }
+    http->feed_position = position;
+  }
+
   if (result <= 0) {
     client_drain(http->client);
   }
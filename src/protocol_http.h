@@ -22,4 +22,9 @@
 
 extern protocol_t protocol_http;
 
+/**
+ * Hooks the settings used by the HTTP protocol.
+ */
+void http_config_init();
+
 #endif
@@ -20,6 +20,7 @@
 #include "db.h"
 #include "library.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
 
 #include <stdbool.h>
@@ -196,8 +197,38 @@ struct query {
   int64_t offset;
 
   string_t *order;
+
+  /* Time spent stepping with *_next, recorded on close */
+  int step_metric;
+  int64_t step_usec;
 };
 
+/**
+ * @returns latency histogram of query.c function @p call, registered on
+ * first use to @p id
+ */
+static int call_metric(int *id, const char *call)
+{
+  if (!*id) {
+    *id = metrics_histogram("musicd_sqlite_query_duration_seconds",
+                            "Time spent in SQLite per query call.",
+                            "call", call);
+  }
+  return *id;
+}
+
+/**
+ * Steps query->stmt accounting time to @p call.
+ */
+static int query_step(query_t *query, int *id, const char *call)
+{
+  int64_t start = metrics_usec();
+  int result = db_step(query->stmt);
+  query->step_usec += metrics_usec() - start;
+  query->step_metric = call_metric(id, call);
+  return result;
+}
+
 static query_t *query_new()
 {
   query_t *query = malloc(sizeof(query_t));
@@ -232,6 +263,8 @@ void query_close(query_t *query)
 {
   int i;
 
+  metrics_observe(query->step_metric, query->step_usec);
+
   sqlite3_finalize(query->stmt);
   for (i = 0; i <= QUERY_FIELD_ALL; ++i) {
     free(query->filters[i]);
@@ -393,6 +426,8 @@ static void bind_filters(query_t *query, sqlite3_stmt *stmt)
 
 int64_t query_count(query_t *query)
 {
+  static int metric = 0;
+  int64_t start = metrics_usec();
   string_t *sql = string_new();
   char *where = build_filters(query);
   sqlite3_stmt *stmt;
@@ -418,7 +453,7 @@ int64_t query_count(query_t *query)
 
   bind_filters(query, stmt);
 
-  result = sqlite3_step(stmt);
+  result = db_step(stmt);
   if (result != SQLITE_ROW) {
     musicd_log(LOG_ERROR, "query", "query_count: sqlite3_step failed");
     result = -1;
@@ -428,11 +463,14 @@ int64_t query_count(query_t *query)
 
 finish:
   sqlite3_finalize(stmt);
+  metrics_observe(call_metric(&metric, "count"), metrics_usec() - start);
   return result;
 }
 
 int64_t query_index(query_t *query, int64_t id)
 {
+  static int metric = 0;
+  int64_t start = metrics_usec();
   string_t *sql = string_new();
   char *where = build_filters(query);
   sqlite3_stmt *stmt;
@@ -464,7 +502,7 @@ int64_t query_index(query_t *query, int64_t id)
   bind_filters(query, stmt);
 
   while (1) {
-    result = sqlite3_step(stmt);
+    result = db_step(stmt);
     if (result == SQLITE_DONE) {
       result = 0;
       goto finish;
@@ -483,11 +521,14 @@ int64_t query_index(query_t *query, int64_t id)
 
 finish:
   sqlite3_finalize(stmt);
+  metrics_observe(call_metric(&metric, "index"), metrics_usec() - start);
   return result;
 }
 
 int query_start(query_t *query)
 {
+  static int metric = 0;
+  int64_t start = metrics_usec();
   string_t *sql = string_new();
   char *where = build_filters(query);
   sqlite3_stmt *stmt;
@@ -522,11 +563,13 @@ int query_start(query_t *query)
 
   query->stmt = stmt;
 
+  metrics_observe(call_metric(&metric, "start"), metrics_usec() - start);
   return 0;
 }
 
 int query_tracks_next(query_t *query, track_t *track)
 {
+  static int metric = 0;
   int result;
   sqlite3_stmt *stmt;
 
@@ -536,7 +579,7 @@ int query_tracks_next(query_t *query, track_t *track)
 
   stmt = query->stmt;
 
-  result = sqlite3_step(stmt);
+  result = query_step(query, &metric, "tracks_next");
   if (result == SQLITE_DONE) {
     return 1;
   } else if (result != SQLITE_ROW) {
@@ -562,6 +605,7 @@ int query_tracks_next(query_t *query, track_t *track)
 
 int query_artists_next(query_t *query, query_artist_t *artist)
 {
+  static int metric = 0;
   int result;
   sqlite3_stmt *stmt;
 
@@ -571,7 +615,7 @@ int query_artists_next(query_t *query, query_artist_t *artist)
 
   stmt = query->stmt;
 
-  result = sqlite3_step(stmt);
+  result = query_step(query, &metric, "artists_next");
   if (result == SQLITE_DONE) {
     return 1;
   } else if (result != SQLITE_ROW) {
@@ -588,6 +632,7 @@ int query_artists_next(query_t *query, query_artist_t *artist)
 
 int query_albums_next(query_t *query, query_album_t *album)
 {
+  static int metric = 0;
   int result;
   sqlite3_stmt *stmt;
 
@@ -597,7 +642,7 @@ int query_albums_next(query_t *query, query_album_t *album)
 
   stmt = query->stmt;
 
-  result = sqlite3_step(stmt);
+  result = query_step(query, &metric, "albums_next");
   if (result == SQLITE_DONE) {
     return 1;
   } else if (result != SQLITE_ROW) {
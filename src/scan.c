@@ -15,17 +15,25 @@
  * You should have received a copy of the GNU General Public License
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
+/* For nanosleep */
+#define _POSIX_C_SOURCE 200809L
+
 #include "scan.h"
 
+#include "cache.h"
 #include "config.h"
 #include "cue.h"
 #include "db.h"
+#include "image.h"
 #include "library.h"
 #include "log.h"
+#include "metrics.h"
 #include "strings.h"
+#include "task.h"
 
 #include <dirent.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
@@ -34,6 +42,7 @@
 #include <strings.h>
 #include <sys/stat.h>
 #include <pthread.h>
+#include <time.h>
 
 #include <FreeImage.h>
 
@@ -45,7 +54,7 @@ static pthread_mutex_t scan_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static time_t last_scan = 0;
 
-static scan_status_t status = { 0, 0, 0, 0 };
+static scan_status_t status = { 0, 0, 0, 0, 0 };
 
 
 /**
@@ -57,6 +66,50 @@ static char **image_prefixes = NULL;
 
 static int interrupted = 0, restart = 0;
 
+/**
+ * The scan transaction is committed this often, so that writes sharing the
+ * connection, like new sessions, are durable even during long scans.
+ */
+#define COMMIT_INTERVAL 5
+
+static time_t next_commit = 0;
+
+
+typedef struct {
+  int64_t *ids;
+  int count;
+  int size;
+} id_list_t;
+
+/**
+ * Files and directories which have disappeared. They are removed only after
+ * the whole tree has been scanned, so that moved or renamed files found
+ * elsewhere keep their existing entries.
+ */
+static id_list_t missing_files = { NULL, 0, 0 };
+static id_list_t missing_directories = { NULL, 0, 0 };
+
+/**
+ * Images which became album images during the scan.
+ */
+static id_list_t album_images = { NULL, 0, 0 };
+
+/**
+ * Files moved during the scan and their new directories. Cue sheets referring
+ * to them are read again afterwards.
+ */
+static id_list_t moved_files = { NULL, 0, 0 };
+static id_list_t moved_directories = { NULL, 0, 0 };
+
+static void id_list_add(id_list_t *missing, int64_t id)
+{
+  if (missing->count == missing->size) {
+    missing->size = missing->size ? missing->size * 2 : 64;
+    missing->ids = realloc(missing->ids, missing->size * sizeof(int64_t));
+  }
+  missing->ids[missing->count++] = id;
+}
+
 static void scan_signal_handler()
 {
   interrupted = 1;
@@ -110,16 +163,73 @@ void scan_status(scan_status_t *status_out)
 
 static void scan_directory(const char *dirpath, int parent);
 
+/**
+ * Stores @p picture embedded in @p file in the cache, named after its
+ * contents so that the same picture in every track of an album is stored only
+ * once.
+ */
+static void add_embedded_image(int64_t file, track_picture_t *picture)
+{
+  FIMEMORY *memory;
+  FREE_IMAGE_FORMAT format;
+  uint64_t hash = 14695981039346656037ULL;
+  char *cache_name;
+  int i;
+
+  memory = FreeImage_OpenMemory((BYTE *)picture->data, picture->size);
+  format = FreeImage_GetFileTypeFromMemory(memory, 0);
+  FreeImage_CloseMemory(memory);
+  if (format == FIF_UNKNOWN) {
+    return;
+  }
+
+  /* FNV-1a */
+  for (i = 0; i < picture->size; ++i) {
+    hash = (hash ^ (uint8_t)picture->data[i]) * 1099511628211ULL;
+  }
+
+  cache_name = stringf("embedded_%016" PRIx64, hash);
+  if (!cache_exists(cache_name)) {
+    cache_set(cache_name, CACHE_KIND_ORIGINAL, picture->data,
+              picture->size);
+  }
+  library_image_add_embedded(file, cache_name, picture->description);
+  free(cache_name);
+}
+
+static void commit_if_due()
+{
+  time_t now = time(NULL);
+
+  if (now < next_commit) {
+    return;
+  }
+  next_commit = now + COMMIT_INTERVAL;
+
+  /* Album track counts stay consistent with the committed tracks */
+  library_tracks_sync();
+  db_simple_exec("COMMIT TRANSACTION", NULL);
+  db_simple_exec("BEGIN TRANSACTION", NULL);
+}
+
 static int64_t scan_file(const char *path, int64_t directory)
 {
   const char *extension;
   int64_t file = 0;
   track_t **tracks;
+  track_picture_t picture;
   int i;
 
   for (extension = path + strlen(path);
     *(extension) != '.' && extension != path; --extension) { }
   ++extension;
+
+  pthread_mutex_lock(&scan_mutex);
+  ++status.files;
+  pthread_mutex_unlock(&scan_mutex);
+  metrics_add(METRICS_SCAN_FILES, 1);
+
+  commit_if_due();
     
   if (!strcasecmp(extension, "cue")) {
     /* CUE sheet */
@@ -133,17 +243,22 @@ static int64_t scan_file(const char *path, int64_t directory)
       library_image_add(file);
     }
   } else {
-    tracks = tracks_from_path(path);
+    tracks = tracks_from_path(path, &picture);
     /* Try tracks */
     if (!tracks) {
       return file;
     }
-    for (i = 0; tracks[i]; ++i) {
-      musicd_log(LOG_DEBUG, "scan", "track: %s", path);
-      library_track_add(tracks[i], directory);
-      scan_track_added();
-      file = library_file(path, 0);
+    musicd_log(LOG_DEBUG, "scan", "track: %s", path);
+    if (library_tracks_add(tracks, directory) > 0) {
+      for (i = 0; tracks[i]; ++i) {
+        scan_track_added();
+      }
+      file = tracks[0]->fileid;
+      if (picture.data) {
+        add_embedded_image(file, &picture);
+      }
     }
+    track_picture_clear(&picture);
     tracks_free(tracks);
   } 
   return file;
@@ -155,14 +270,13 @@ static int64_t scan_file(const char *path, int64_t directory)
  */
 static void iterate_directory(const char *dirpath, int dir_id)
 {
-  struct stat status;
+  struct stat status, old_status;
   DIR *dir;
   struct dirent *entry;
   
   int64_t file;
-  time_t file_mtime;
   
-  char *path;
+  char *path, *old_path;
   
   if (!(dir = opendir(dirpath))) {
     /* Probably no read access - ok, we just omit. */
@@ -201,15 +315,31 @@ static void iterate_directory(const char *dirpath, int dir_id)
     
     file = library_file(path, 0);
     if (file > 0) {
-      file_mtime = library_file_mtime(file);
-      if (file_mtime == status.st_mtime) {
+      if (library_file_unchanged(file, &status)) {
         goto next;
       }
+    } else if (file == 0) {
+      /* Same inode under another path that no longer refers to it means the
+       * file has been moved or renamed. */
+      file = library_file_by_stat(&status, &old_path);
+      if (file > 0) {
+        if (stat(old_path, &old_status)
+         || old_status.st_ino != status.st_ino
+         || old_status.st_dev != status.st_dev) {
+          musicd_log(LOG_DEBUG, "scan", "moved: %s -> %s", old_path, path);
+          library_file_move(file, path, dir_id);
+          id_list_add(&moved_files, file);
+          id_list_add(&moved_directories, dir_id);
+          free(old_path);
+          goto next;
+        }
+        free(old_path);
+      }
     }
     
     file = scan_file(path, dir_id);
     if (file) {
-      library_file_mtime_set(file, status.st_mtime);
+      library_file_stat_set(file, &status);
     }
 
   next:
@@ -232,18 +362,18 @@ static bool scan_files_cb(library_file_t *file)
   struct stat status;
   
   if (stat(file->path, &status)) {
-    musicd_perror(LOG_DEBUG, "scan", "removing file %s", file->path);
-    library_file_delete(file->id);
+    musicd_perror(LOG_DEBUG, "scan", "missing file %s", file->path);
+    id_list_add(&missing_files, file->id);
     return true;
   }
   
-  if (file->mtime == status.st_mtime) {
+  if (library_file_matches(file, &status)) {
     return true;
   }
   
   library_file_clear(file->id);
   if (scan_file(file->path, file->directory)) {
-    library_file_mtime_set(file->id, status.st_mtime);
+    library_file_stat_set(file->id, &status);
   } else {
     library_file_delete(file->id);
   }
@@ -263,21 +393,26 @@ static bool update_albumimg_cb(library_image_t *image, void *opaque)
   int level, diff;
   bool better = false;
   struct albumimg_comparison *comparison = opaque;
+  const char *p1, *p2 = NULL;
 
-  /* Extract what's between last '/' and last '.' in the path */
-
-  const char *p1 = image->path + strlen(image->path), *p2 = NULL;
-
-  for (; p1 > image->path && *(p1 - 1) != '/'; --p1) {
-    if (*p1 == '.' && !p2) {
-      p2 = p1;
+  if (image->description) {
+    /* Embedded pictures are ranked by their type, such as "Cover (front)" */
+    name = strcopy(image->description);
+  } else {
+    /* Extract what's between last '/' and last '.' in the path */
+    p1 = image->path + strlen(image->path);
+    for (; p1 > image->path && *(p1 - 1) != '/'; --p1) {
+      if (*p1 == '.' && !p2) {
+        p2 = p1;
+      }
     }
-  }
-  if (!p2) {
-    p2 = image->path + strlen(image->path);
+    if (!p2) {
+      p2 = image->path + strlen(image->path);
+    }
+
+    name = strextract(p1, p2);
   }
 
-  name = strextract(p1, p2);
   if (image_prefixes) {
     for (level = 0; image_prefixes[level]; ++level) {
       if (!strncasecmp(image_prefixes[level], name, strlen(image_prefixes[level]))) {
@@ -336,9 +471,11 @@ static void update_albumimg(int64_t album)
 
   library_iterate_images_by_album(album, update_albumimg_cb, &comparison);
 
-  if (comparison.id > 0) {
+  if (comparison.id > 0 && comparison.id != library_album_image(album)) {
     library_album_image_set(album, comparison.id);
+    id_list_add(&album_images, comparison.id);
   }
+  free(comparison.name);
 }
 
 static bool assign_images_cb(library_directory_t *directory, void *album)
@@ -369,8 +506,8 @@ static bool scan_directory_cb(library_directory_t *directory, void *empty)
   (void)empty;
   struct stat status;
   if (stat(directory->path, &status)) {
-    musicd_perror(LOG_DEBUG, "scan", "removing directory %s", directory->path);
-    library_directory_delete(directory->id);
+    musicd_perror(LOG_DEBUG, "scan", "missing directory %s", directory->path);
+    id_list_add(&missing_directories, directory->id);
     return true;
   }
 
@@ -380,7 +517,7 @@ static bool scan_directory_cb(library_directory_t *directory, void *empty)
   
   library_iterate_directories(directory->id, scan_directory_cb, NULL);
   
-  if (directory->mtime == status.st_mtime) {
+  if (directory->mtime == library_stat_mtime(&status)) {
     return true;
   }
   
@@ -393,7 +530,7 @@ static bool scan_directory_cb(library_directory_t *directory, void *empty)
     return false;
   }
 
-  library_directory_mtime_set(directory->id, status.st_mtime);
+  library_directory_mtime_set(directory->id, library_stat_mtime(&status));
   
   return true;
 }
@@ -401,7 +538,7 @@ static bool scan_directory_cb(library_directory_t *directory, void *empty)
 static void scan_directory(const char *dirpath, int parent)
 {
   int dir_id;
-  time_t dir_mtime;
+  int64_t dir_mtime;
   struct stat status;
   
   dir_id = library_directory(dirpath, -1);
@@ -417,7 +554,7 @@ static void scan_directory(const char *dirpath, int parent)
   if (dir_id > 0) {
     library_iterate_directories(dir_id, scan_directory_cb, NULL);
     dir_mtime = library_directory_mtime(dir_id);
-    if (dir_mtime == status.st_mtime) {
+    if (dir_mtime == library_stat_mtime(&status)) {
       return;
     }
   } else {
@@ -433,7 +570,157 @@ static void scan_directory(const char *dirpath, int parent)
     return;
   }
   
-  library_directory_mtime_set(dir_id, status.st_mtime);
+  library_directory_mtime_set(dir_id, library_stat_mtime(&status));
+}
+
+static id_list_t cue_sheets = { NULL, 0, 0 };
+static id_list_t cue_directories = { NULL, 0, 0 };
+
+static bool cue_sheet_cb(library_file_t *file)
+{
+  id_list_add(&cue_sheets, file->id);
+  id_list_add(&cue_directories, file->directory);
+  return true;
+}
+
+/**
+ * Reads cue sheets referring to moved audio files again, so that their tracks
+ * follow the sheets. If no sheet resolves to a file anymore, it is scanned as
+ * a plain audio file instead.
+ */
+static void rescan_moved_cue_files()
+{
+  struct stat status;
+  char *path;
+  bool claimed;
+  int i, j;
+
+  for (i = 0; i < moved_files.count; ++i) {
+    cue_sheets.count = cue_directories.count = 0;
+    library_iterate_cue_sheets(moved_files.ids[i], cue_sheet_cb);
+    if (cue_sheets.count == 0) {
+      continue;
+    }
+
+    claimed = false;
+    for (j = 0; j < cue_sheets.count; ++j) {
+      path = library_file_path(cue_sheets.ids[j]);
+      if (path && !stat(path, &status)) {
+        musicd_log(LOG_DEBUG, "scan", "cue of moved file: %s", path);
+        claimed = cue_read(path, cue_directories.ids[j]) || claimed;
+      }
+      free(path);
+    }
+    if (claimed) {
+      continue;
+    }
+
+    path = library_file_path(moved_files.ids[i]);
+    if (path) {
+      library_file_clear(moved_files.ids[i]);
+      scan_file(path, moved_directories.ids[i]);
+    }
+    free(path);
+  }
+
+  free(moved_files.ids);
+  free(moved_directories.ids);
+  free(cue_sheets.ids);
+  free(cue_directories.ids);
+  memset(&moved_files, 0, sizeof(id_list_t));
+  memset(&moved_directories, 0, sizeof(id_list_t));
+  memset(&cue_sheets, 0, sizeof(id_list_t));
+  memset(&cue_directories, 0, sizeof(id_list_t));
+}
+
+/**
+ * Removes entries of files and directories that went missing during the scan
+ * and were not found moved elsewhere.
+ */
+static void remove_missing()
+{
+  struct stat status;
+  char *path;
+  int i;
+  
+  for (i = 0; i < missing_directories.count; ++i) {
+    path = library_directory_path(missing_directories.ids[i]);
+    if (path && stat(path, &status)) {
+      musicd_log(LOG_DEBUG, "scan", "removing directory %s", path);
+      library_directory_delete(missing_directories.ids[i]);
+    }
+    free(path);
+  }
+  
+  for (i = 0; i < missing_files.count; ++i) {
+    /* Path is NULL if removed along with its directory and refers to an
+     * existing file if the entry has been moved. */
+    path = library_file_path(missing_files.ids[i]);
+    if (path && stat(path, &status)) {
+      musicd_log(LOG_DEBUG, "scan", "removing file %s", path);
+      library_file_delete(missing_files.ids[i]);
+    }
+    free(path);
+  }
+  
+  free(missing_directories.ids);
+  free(missing_files.ids);
+  memset(&missing_directories, 0, sizeof(id_list_t));
+  memset(&missing_files, 0, sizeof(id_list_t));
+}
+
+static char **embedded_names = NULL;
+static int embedded_count = 0, embedded_size = 0;
+
+static bool embedded_name_cb(const char *cache_name)
+{
+  if (embedded_count == embedded_size) {
+    embedded_size = embedded_size ? embedded_size * 2 : 256;
+    embedded_names = realloc(embedded_names, embedded_size * sizeof(char *));
+  }
+  embedded_names[embedded_count++] = strcopy(cache_name);
+  return true;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static bool embedded_used(const char *name)
+{
+  return !strbeginswith(name, "embedded_")
+      || (embedded_count && bsearch(&name, embedded_names, embedded_count,
+                                    sizeof(char *), compare_names));
+}
+
+/**
+ * Removes embedded pictures from the cache which no image refers to anymore,
+ * as their files were removed, retagged or reencoded. They are originals, so
+ * they would never be evicted.
+ */
+static void remove_unused_embedded()
+{
+  int removed, i;
+
+  /* Without the full list every picture would look unused */
+  if (!library_iterate_embedded_images(embedded_name_cb)) {
+    if (embedded_count) {
+      qsort(embedded_names, embedded_count, sizeof(char *), compare_names);
+    }
+    removed = cache_remove_unused(CACHE_KIND_ORIGINAL, embedded_used);
+    if (removed) {
+      musicd_log(LOG_VERBOSE, "scan", "removed %d unused embedded images",
+                 removed);
+    }
+  }
+
+  for (i = 0; i < embedded_count; ++i) {
+    free(embedded_names[i]);
+  }
+  free(embedded_names);
+  embedded_names = NULL;
+  embedded_count = embedded_size = 0;
 }
 
 static void scan()
@@ -464,6 +751,12 @@ static void scan()
   
   scan_directory(path, 0);
   
+  /* Done even if interrupted, as mtimes of the parent directories might
+   * already be up to date. */
+  rescan_moved_cue_files();
+  remove_missing();
+  remove_unused_embedded();
+  
   free(path);
   
   signal(SIGINT, NULL);
@@ -478,6 +771,85 @@ static void scan()
   db_meta_set_int("last-scan", now);
 }
 
+/** Most pregeneration tasks queued at once */
+#define PREGENERATE_QUEUE 2
+
+/**
+ * Waits until no interactive tasks are queued and there is room for more
+ * pregeneration tasks.
+ * @returns false if the scan thread should stop instead
+ */
+static bool pregenerate_wait()
+{
+  struct timespec wait = { 0, 100000000 };
+  task_stats_t stats;
+
+  while (!interrupted && !restart) {
+    task_stats(&stats);
+    if (stats.queued == stats.queued_low
+     && stats.queued_low < PREGENERATE_QUEUE) {
+      return true;
+    }
+    nanosleep(&wait, NULL);
+  }
+  return false;
+}
+
+/**
+ * Renders thumbnails of images which became album images during the scan if
+ * image-pregenerate is set. Thumbnails are made by low priority tasks, which
+ * yield to interactive requests.
+ */
+static void pregenerate_thumbnails()
+{
+  char *cache_name;
+  int generated = 0, i;
+  image_format_t format;
+  bool exists, queued;
+  task_t *task;
+
+  for (i = 0; config_to_bool("image-pregenerate")
+              && i < album_images.count; ++i) {
+    /* Browsers get WebP and other clients JPEG, so both are made */
+    queued = false;
+    for (format = 0; format < IMAGE_FORMATS; ++format) {
+      if (!image_format_supported(format)) {
+        continue;
+      }
+      /* All sizes are made at once, so checking the largest is enough */
+      cache_name = image_cache_name(album_images.ids[i], IMAGE_SIZE_MAX,
+                                    format);
+      exists = cache_exists(cache_name);
+      free(cache_name);
+      if (exists) {
+        continue;
+      }
+
+      if (!pregenerate_wait()) {
+        goto finish;
+      }
+
+      task = image_task(album_images.ids[i], format);
+      task->priority = TASK_PRIORITY_LOW;
+      task_launch(task);
+      queued = true;
+    }
+    generated += queued;
+  }
+
+finish:
+  if (generated) {
+    musicd_log(LOG_INFO, "scan", "queued thumbnails of %d album images",
+               generated);
+  }
+  if (restart) {
+    /* Continued after the next scan, finished thumbnails are skipped */
+    return;
+  }
+  free(album_images.ids);
+  memset(&album_images, 0, sizeof(id_list_t));
+}
+
 static void *scan_thread_func(void *data)
 {
   (void)data;
@@ -489,14 +861,20 @@ static void *scan_thread_func(void *data)
   pthread_mutex_unlock(&scan_mutex);
 
   db_simple_exec("BEGIN TRANSACTION", NULL);
+  next_commit = time(NULL) + COMMIT_INTERVAL;
   scan();
+  library_tracks_flush();
   db_simple_exec("COMMIT TRANSACTION", NULL);
 
   pthread_mutex_lock(&scan_mutex);
-  thread_running = false;
-
   status.active = false;
   status.end_time = time(NULL);
+  pthread_mutex_unlock(&scan_mutex);
+
+  pregenerate_thumbnails();
+
+  pthread_mutex_lock(&scan_mutex);
+  thread_running = false;
 
   if (restart) {
     restart = 0;
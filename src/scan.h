@@ -41,6 +41,7 @@ typedef struct scan_status {
   time_t end_time;
 
   int new_tracks;
+  int files; /**< Files scanned */
 } scan_status_t;
 
 void scan_status(scan_status_t *status);
@@ -20,6 +20,7 @@
 #include "client.h"
 #include "config.h"
 #include "log.h"
+#include "task.h"
 
 #include <arpa/inet.h>
 #include <fcntl.h>
@@ -31,6 +32,7 @@
 #include <sys/un.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <unistd.h>
 
@@ -41,7 +43,7 @@ static pthread_t thread;
 
 static struct client_list_t clients;
 static struct pollfd *poll_fds = NULL;
-static int poll_nfds = 1, nb_clients = 0;
+static int poll_nfds = 2, nb_clients = 0;
 
 static void build_pollfds()
 {
@@ -52,7 +54,7 @@ static void build_pollfds()
     free(poll_fds);
   }
   
-  poll_nfds = nb_clients + 1;
+  poll_nfds = nb_clients + 2;
   poll_fds = calloc(poll_nfds, sizeof(struct pollfd));
   
   TAILQ_FOREACH(client, &clients, clients) {
@@ -64,6 +66,55 @@ static void build_pollfds()
   
   poll_fds[i].fd = master_sock;
   poll_fds[i].events = POLLIN;
+
+  poll_fds[i + 1].fd = task_pollfd();
+  poll_fds[i + 1].events = POLLIN;
+}
+
+static void update_pollfds()
+{
+  int i = 0;
+  client_t *client;
+
+  TAILQ_FOREACH(client, &clients, clients) {
+    poll_fds[i].fd = client_poll_fd(client);
+    poll_fds[i].events = client_poll_events(client);
+    ++i;
+  }
+}
+
+/**
+ * Resumes clients whose tasks have finished.
+ */
+static void finish_tasks()
+{
+  task_t *task, *next;
+  client_t *client;
+  int deleted = 0;
+
+  for (task = task_finished(); task; task = next) {
+    next = task->next;
+    client = task->owner;
+    if (!client) {
+      /* Not started by a client, nothing to resume */
+      task_free(task);
+      continue;
+    }
+    if (client_task_finished(client)) {
+      musicd_log(LOG_INFO, "server", "client from %s disconnected",
+                 client->address);
+      TAILQ_REMOVE(&clients, client, clients);
+      client_close(client);
+      --nb_clients;
+      deleted = 1;
+    }
+  }
+
+  if (deleted) {
+    build_pollfds();
+  } else {
+    update_pollfds();
+  }
 }
 
 static client_t *find_client(int i) {
@@ -96,6 +147,11 @@ static void *thread_func(void *data)
       continue;
     }
     
+    if (poll_fds[nb_clients + 1].revents & POLLIN) {
+      finish_tasks();
+      continue; /* poll_fds changed */
+    }
+
     if (poll_fds[nb_clients].revents & POLLIN) {
       if ((client = server_accept())) {
         musicd_log(LOG_INFO, "server", "new client from %s", client->address);
@@ -300,3 +356,14 @@ void server_del_client(client_t *client)
   build_pollfds();
 }
 
+
+void server_stats(server_stats_t *stats)
+{
+  client_t *client;
+
+  memset(stats, 0, sizeof(server_stats_t));
+  TAILQ_FOREACH(client, &clients, clients) {
+    ++stats->clients[client->state];
+    stats->outbuf_bytes += string_size(client->outbuf);
+  }
+}
@@ -20,6 +20,8 @@
 
 #include "client.h"
 
+#include <stdint.h>
+
 int server_start();
 int server_stop();
 
@@ -27,4 +29,15 @@ client_t *server_accept();
 void server_add_client(client_t *client);
 void server_del_client(client_t *client);
 
+typedef struct server_stats {
+  int clients[CLIENT_STATE_COUNT]; /**< Clients by state */
+  int64_t outbuf_bytes; /**< Bytes in all client output buffers */
+} server_stats_t;
+
+/**
+ * Fills @p stats with current client counts.
+ * @note Call only from the server thread.
+ */
+void server_stats(server_stats_t *stats);
+
 #endif
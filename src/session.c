@@ -16,132 +16,745 @@
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/* For open and read */
+#define _POSIX_C_SOURCE 200809L
+
 #include "session.h"
 
+#include "config.h"
+#include "db.h"
 #include "log.h"
 #include "strings.h"
 
+#include <fcntl.h>
 #include <inttypes.h>
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
+
+#include <sqlite3.h>
+
+/*
+ * Sessions are found through a hash table whose buckets are split between
+ * lock stripes. Each session is also linked in a timing wheel slot matching
+ * the time of its last request, so idle sessions are found without walking
+ * all of them. A session only moves in the wheel once per tick, which is
+ * session-timeout divided by WHEEL_SLOTS. The timeout is read once, as ticks
+ * stored in the wheel would mean something else after it changed.
+ *
+ * Sessions are stored in the sessions table and loaded into memory on first
+ * use. Sessions whose last_request changed are queued as pending and written
+ * together at most every FLUSH_INTERVAL seconds. No transaction is used, as
+ * the connection is shared with the scanner which may have one open. The
+ * scanner commits every few seconds, so writes are durable during scans too.
+ *
+ * Ids which were not found in the database are remembered in a small table,
+ * so that stale cookies don't query the database on every request. An id
+ * only starts to exist through session_new, which forgets it there.
+ *
+ * Lock order is stripe, then wheel or pending. Only one thread at a time
+ * expires, unloads or stores sessions, holding reap_mutex.
+ */
+
+#define BUCKETS 16384
+#define STRIPES 16
+#define WHEEL_SLOTS 64
+
+/** Default session-timeout in seconds */
+#define DEFAULT_TIMEOUT (30 * 24 * 60 * 60)
+
+/** Random bytes in an id, which is twice as many hex digits */
+#define ID_BYTES 16
+
+/** Slots of the table of missing ids, longer ids are not remembered */
+#define MISSING_SLOTS 1024
+#define MISSING_ID_MAX 40
+
+#define FLUSH_INTERVAL 60
+/** Sessions updated by one statement, below SQLite's variable limit */
+#define FLUSH_BATCH 500
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+/** session-timeout in seconds, seconds per tick and ticks per timeout */
+static int timeout;
+static time_t tick_seconds;
+static int64_t timeout_ticks;
+static pthread_mutex_t stripes[STRIPES];
+static session_t *buckets[BUCKETS];
+
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** Sessions of each slot, least recently used first */
+static struct {
+  session_t *first, *last;
+} wheel[WHEEL_SLOTS];
+/** Last tick swept by expire */
+static int64_t wheel_tick = -1;
+
+static pthread_mutex_t reap_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static session_t *sessions = NULL;
 static int n_sessions = 0;
-static pthread_mutex_t session_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-static session_t *get_session(const char *id)
+/** Ids of sessions waiting for last_request to be stored */
+static pthread_mutex_t pending_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char **pending = NULL;
+static int pending_count = 0, pending_size = 0;
+static time_t next_flush = 0;
+
+static pthread_mutex_t missing_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char missing[MISSING_SLOTS][MISSING_ID_MAX];
+
+static void init()
 {
-  session_t *session;
+  int i;
+  for (i = 0; i < STRIPES; ++i) {
+    pthread_mutex_init(&stripes[i], NULL);
+  }
 
-  if (!sessions) {
-    return NULL;
+  timeout = config_to_int("session-timeout");
+  if (timeout <= 0) {
+    timeout = DEFAULT_TIMEOUT;
   }
+  tick_seconds = (timeout + WHEEL_SLOTS - 1) / WHEEL_SLOTS;
+  /* At most WHEEL_SLOTS */
+  timeout_ticks = (timeout + tick_seconds - 1) / tick_seconds;
+}
+
+static uint32_t hash_id(const char *id)
+{
+  /* FNV-1a */
+  uint32_t hash = 2166136261u;
+  for (; *id; ++id) {
+    hash = (hash ^ (uint8_t)*id) * 16777619u;
+  }
+  return hash;
+}
+
+static pthread_mutex_t *stripe_of(uint32_t hash)
+{
+  return &stripes[hash % STRIPES];
+}
+
 
-  for (session = sessions; session != NULL; session = session->next) {
+/**
+ * @note Must be called with wheel_mutex locked.
+ */
+static void wheel_add(session_t *session, int64_t tick)
+{
+  int slot = tick % WHEEL_SLOTS;
+
+  session->tick = tick;
+  session->wheel_prev = wheel[slot].last;
+  session->wheel_next = NULL;
+  if (wheel[slot].last) {
+    wheel[slot].last->wheel_next = session;
+  } else {
+    wheel[slot].first = session;
+  }
+  wheel[slot].last = session;
+}
+
+/**
+ * @note Must be called with wheel_mutex locked.
+ */
+static void wheel_remove(session_t *session)
+{
+  int slot = session->tick % WHEEL_SLOTS;
+
+  if (session->wheel_prev) {
+    session->wheel_prev->wheel_next = session->wheel_next;
+  } else {
+    wheel[slot].first = session->wheel_next;
+  }
+  if (session->wheel_next) {
+    session->wheel_next->wheel_prev = session->wheel_prev;
+  } else {
+    wheel[slot].last = session->wheel_prev;
+  }
+  session->tick = -1;
+}
+
+/**
+ * Updates last request of @p session to @p now.
+ * @note Must be called with the stripe of @p session locked.
+ */
+static void touch(session_t *session, time_t now)
+{
+  int64_t tick = now / tick_seconds;
+
+  session->last_request = now;
+  if (session->tick == tick) {
+    return;
+  }
+
+  pthread_mutex_lock(&wheel_mutex);
+  if (session->tick >= 0) {
+    wheel_remove(session);
+  }
+  wheel_add(session, tick);
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+/**
+ * @note Must be called with the stripe of @p hash locked.
+ */
+static session_t *find(const char *id, uint32_t hash)
+{
+  session_t *session;
+  for (session = buckets[hash % BUCKETS]; session;
+       session = session->hash_next) {
     if (!strcmp(session->id, id)) {
-      session->last_request = time(NULL);
       return session;
     }
   }
   return NULL;
 }
 
-static char *generate_session_id()
+static bool is_missing(const char *id, uint32_t hash)
+{
+  bool result;
+  pthread_mutex_lock(&missing_mutex);
+  result = !strcmp(missing[hash % MISSING_SLOTS], id);
+  pthread_mutex_unlock(&missing_mutex);
+  return result;
+}
+
+/**
+ * Remembers that @p id is missing if @p is_missing, otherwise forgets it.
+ */
+static void set_missing(const char *id, uint32_t hash, bool is_missing)
+{
+  char *slot = missing[hash % MISSING_SLOTS];
+
+  if (strlen(id) >= MISSING_ID_MAX) {
+    return;
+  }
+  pthread_mutex_lock(&missing_mutex);
+  if (is_missing) {
+    strcpy(slot, id);
+  } else if (!strcmp(slot, id)) {
+    slot[0] = '\0';
+  }
+  pthread_mutex_unlock(&missing_mutex);
+}
+
+/**
+ * Queues last_request of @p session to be stored.
+ * @note Must be called with the stripe of @p session locked.
+ */
+static void mark_dirty(session_t *session)
 {
-  char *id = NULL;
+  if (session->dirty) {
+    return;
+  }
+  session->dirty = true;
 
-  do {
-    free(id);
-    id = stringf("%" PRIx64 "%x", (int64_t)time(NULL), rand());
-  } while (get_session(id));
- 
+  pthread_mutex_lock(&pending_mutex);
+  if (pending_count == pending_size) {
+    pending_size = pending_size ? pending_size * 2 : 64;
+    pending = realloc(pending, pending_size * sizeof(char *));
+  }
+  pending[pending_count++] = strcopy(session->id);
+  pthread_mutex_unlock(&pending_mutex);
+}
+
+static void free_session(session_t *session)
+{
+  free(session->id);
+  free(session->user);
+  free(session);
+}
+
+
+static bool prepare_query(const char *sql, sqlite3_stmt **query)
+{
+  if (sqlite3_prepare_v2(db_handle(), sql, -1, query, NULL) != SQLITE_OK) {
+    musicd_log(LOG_ERROR, "session", "can't prepare '%s': %s",
+               sql, db_error());
+    return false;
+  }
+  return true;
+}
+
+static void execute(sqlite3_stmt *query, const char *sql)
+{
+  if (db_step(query) != SQLITE_DONE) {
+    musicd_log(LOG_ERROR, "session", "sqlite3_step failed for '%s': %s",
+               sql, db_error());
+  }
+  sqlite3_finalize(query);
+}
+
+static void store_session(session_t *session)
+{
+  static const char *sql =
+    "INSERT OR REPLACE INTO sessions (id, user, last_request) VALUES(?, ?, ?)";
+  sqlite3_stmt *query;
+
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+  sqlite3_bind_text(query, 1, session->id, -1, NULL);
+  sqlite3_bind_text(query, 2, session->user, -1, NULL);
+  sqlite3_bind_int64(query, 3, session->last_request);
+  execute(query, sql);
+}
+
+/**
+ * @returns session @p id from the database or NULL if not found or expired.
+ */
+static session_t *load_session(const char *id, time_t now)
+{
+  static const char *sql =
+    "SELECT user, last_request FROM sessions WHERE id = ? AND last_request > ?";
+  sqlite3_stmt *query;
+  session_t *session = NULL;
+  int result;
+
+  if (!prepare_query(sql, &query)) {
+    return NULL;
+  }
+  sqlite3_bind_text(query, 1, id, -1, NULL);
+  sqlite3_bind_int64(query, 2, now - timeout);
+
+  result = db_step(query);
+  if (result == SQLITE_ROW) {
+    session = calloc(1, sizeof(session_t));
+    session->id = strcopy(id);
+    session->user = strcopy((const char *)sqlite3_column_text(query, 0));
+    session->last_request = sqlite3_column_int64(query, 1);
+    session->hash = hash_id(id);
+    session->tick = -1;
+  } else if (result != SQLITE_DONE) {
+    musicd_log(LOG_ERROR, "session", "sqlite3_step failed for '%s': %s",
+               sql, db_error());
+  }
+  sqlite3_finalize(query);
+  return session;
+}
+
+static bool session_stored(const char *id)
+{
+  static const char *sql = "SELECT 1 FROM sessions WHERE id = ?";
+  sqlite3_stmt *query;
+  bool result;
+
+  if (!prepare_query(sql, &query)) {
+    return false;
+  }
+  sqlite3_bind_text(query, 1, id, -1, NULL);
+  result = db_step(query) == SQLITE_ROW;
+  sqlite3_finalize(query);
+  return result;
+}
+
+static void delete_stored(const char *id)
+{
+  static const char *sql = "DELETE FROM sessions WHERE id = ?";
+  sqlite3_stmt *query;
+
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+  sqlite3_bind_text(query, 1, id, -1, NULL);
+  execute(query, sql);
+}
+
+/**
+ * Deletes stored sessions idle since before @p time, including ones which
+ * were never loaded.
+ */
+static void delete_stored_before(time_t time)
+{
+  static const char *sql = "DELETE FROM sessions WHERE last_request < ?";
+  sqlite3_stmt *query;
+
+  if (!prepare_query(sql, &query)) {
+    return;
+  }
+  sqlite3_bind_int64(query, 1, time);
+  execute(query, sql);
+}
+
+/**
+ * Stores last_request of pending sessions.
+ * @note Must be called with reap_mutex locked.
+ */
+static void flush(time_t now)
+{
+  char **ids;
+  string_t *sql;
+  sqlite3_stmt *query;
+  session_t *session;
+  pthread_mutex_t *stripe;
+  int count, i, j;
+
+  pthread_mutex_lock(&pending_mutex);
+  ids = pending;
+  count = pending_count;
+  pending = NULL;
+  pending_count = pending_size = 0;
+  pthread_mutex_unlock(&pending_mutex);
+
+  __atomic_store_n(&next_flush, now + FLUSH_INTERVAL, __ATOMIC_RELAXED);
+
+  for (i = 0; i < count; ++i) {
+    stripe = stripe_of(hash_id(ids[i]));
+    pthread_mutex_lock(stripe);
+    session = find(ids[i], hash_id(ids[i]));
+    if (session) {
+      session->dirty = false;
+    }
+    pthread_mutex_unlock(stripe);
+  }
+
+  /* Every pending session was used during the last interval, so storing the
+   * flush time is accurate enough for expiry. */
+  for (i = 0; i < count; i += FLUSH_BATCH) {
+    sql = string_new();
+    string_append(sql, "UPDATE sessions SET last_request = ? WHERE id IN (?");
+    for (j = i + 1; j < count && j < i + FLUSH_BATCH; ++j) {
+      string_append(sql, ",?");
+    }
+    string_append(sql, ")");
+
+    if (prepare_query(string_string(sql), &query)) {
+      sqlite3_bind_int64(query, 1, now);
+      for (j = i; j < count && j < i + FLUSH_BATCH; ++j) {
+        sqlite3_bind_text(query, j - i + 2, ids[j], -1, NULL);
+      }
+      execute(query, string_string(sql));
+    }
+    string_free(sql);
+  }
+
+  for (i = 0; i < count; ++i) {
+    free(ids[i]);
+  }
+  free(ids);
+}
+
+static void maybe_flush(time_t now)
+{
+  if (now < __atomic_load_n(&next_flush, __ATOMIC_RELAXED)
+   || pthread_mutex_trylock(&reap_mutex)) {
+    return;
+  }
+  flush(now);
+  pthread_mutex_unlock(&reap_mutex);
+}
+
+
+/**
+ * Unloads @p session taken out of the wheel, unless it has been used or
+ * referenced meanwhile, in which case it's put back.
+ * @returns id of the unloaded session, which must be freed, or NULL.
+ * @note Must be called with reap_mutex locked.
+ */
+static char *reap(session_t *session, int64_t tick)
+{
+  char *id;
+
+  pthread_mutex_t *stripe = stripe_of(session->hash);
+  session_t **p;
+
+  pthread_mutex_lock(stripe);
+  if (session->tick >= 0) {
+    /* Touched after it was taken out */
+    pthread_mutex_unlock(stripe);
+    return NULL;
+  }
+  if (session->refs > 0) {
+    pthread_mutex_lock(&wheel_mutex);
+    wheel_add(session, tick);
+    pthread_mutex_unlock(&wheel_mutex);
+    pthread_mutex_unlock(stripe);
+    return NULL;
+  }
+
+  for (p = &buckets[session->hash % BUCKETS]; *p != session;
+       p = &(*p)->hash_next) { }
+  *p = session->hash_next;
+  pthread_mutex_unlock(stripe);
+
+  id = session->id;
+  session->id = NULL;
+  free_session(session);
+  __atomic_sub_fetch(&n_sessions, 1, __ATOMIC_RELAXED);
   return id;
 }
 
-static int purge_oldest_session()
+/**
+ * Deletes sessions which have been idle for session-timeout.
+ */
+static void expire(time_t now)
 {
-  session_t *p, *oldest = NULL;
-  for (p = sessions; p; p = p->next) {
-    if (!oldest || (p->last_request < oldest->last_request && p->refs == 0)) {
-      oldest = p;
+  int64_t tick = now / tick_seconds, span = timeout_ticks, sweep;
+  session_t *session, *next, **expired = NULL;
+  char *id;
+  int count = 0, size = 0, i;
+
+  if (__atomic_load_n(&wheel_tick, __ATOMIC_RELAXED) >= tick
+   || pthread_mutex_trylock(&reap_mutex)) {
+    return;
+  }
+
+  /* Stored last_request must be current before deleting by it */
+  flush(now);
+
+  pthread_mutex_lock(&wheel_mutex);
+  if (wheel_tick < 0 || tick - wheel_tick > WHEEL_SLOTS) {
+    wheel_tick = tick - WHEEL_SLOTS;
+  }
+  for (sweep = wheel_tick + 1; sweep <= tick; ++sweep) {
+    /* With the longest timeouts the slot is shared with new sessions */
+    for (session = wheel[(sweep - span) % WHEEL_SLOTS].first; session;
+         session = next) {
+      next = session->wheel_next;
+      if (session->tick > sweep - span) {
+        continue;
+      }
+      wheel_remove(session);
+      if (count == size) {
+        size = size ? size * 2 : 64;
+        expired = realloc(expired, size * sizeof(session_t *));
+      }
+      expired[count++] = session;
     }
   }
+  __atomic_store_n(&wheel_tick, tick, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&wheel_mutex);
 
-  if (!oldest) {
-    /* This block shouldn't execute without a bug related to dereferencing */
-    musicd_log(LOG_WARNING, "session",
-               "MAX_SESSIONS reached but all sessions in use");
-    return -1;
+  for (i = 0; i < count; ++i) {
+    id = reap(expired[i], tick);
+    if (id) {
+      musicd_log(LOG_DEBUG, "session", "session %s expired", id);
+      delete_stored(id);
+      free(id);
+    }
   }
+  delete_stored_before(now - timeout);
 
-  musicd_log(LOG_DEBUG, "session", "MAX_SESSIONS reached, purging %s",
-             oldest->id);
+  pthread_mutex_unlock(&reap_mutex);
+  free(expired);
+}
 
-  if (oldest->prev) {
-    oldest->prev->next = oldest->next;
+/**
+ * Unloads least recently used sessions until there are less than
+ * MAX_SESSIONS in memory. They stay in the database.
+ */
+static void purge_oldest_sessions(time_t now)
+{
+  int64_t tick = now / tick_seconds, sweep;
+  session_t *oldest;
+  int attempts = 0;
+
+  pthread_mutex_lock(&reap_mutex);
+  flush(now);
+
+  while (__atomic_load_n(&n_sessions, __ATOMIC_RELAXED) >= MAX_SESSIONS) {
+    oldest = NULL;
+
+    /* Sessions in use are put back as the newest, so each is tried once */
+    if (attempts++ < MAX_SESSIONS) {
+      pthread_mutex_lock(&wheel_mutex);
+      for (sweep = tick - WHEEL_SLOTS + 1; sweep <= tick && !oldest; ++sweep) {
+        oldest = wheel[sweep % WHEEL_SLOTS].first;
+      }
+      if (oldest) {
+        wheel_remove(oldest);
+      }
+      pthread_mutex_unlock(&wheel_mutex);
+    }
+
+    if (!oldest) {
+      /* This block shouldn't execute without a bug related to dereferencing */
+      musicd_log(LOG_WARNING, "session",
+                 "MAX_SESSIONS reached but all sessions in use");
+      break;
+    }
+
+    musicd_log(LOG_DEBUG, "session", "MAX_SESSIONS reached, unloading %s",
+               oldest->id);
+    free(reap(oldest, tick));
   }
-  if (oldest->next) {
-    oldest->next->prev = oldest->prev;
+
+  pthread_mutex_unlock(&reap_mutex);
+}
+
+/**
+ * Adds loaded or new @p session to the hash table and wheel.
+ * @returns the session with the same id already in memory, or NULL.
+ * @note Must be called with the stripe of @p session locked.
+ */
+static session_t *add_session(session_t *session, time_t now)
+{
+  session_t *existing = find(session->id, session->hash);
+  if (existing) {
+    return existing;
   }
-  if (sessions == oldest) {
-    sessions = oldest->next;
+
+  session->hash_next = buckets[session->hash % BUCKETS];
+  buckets[session->hash % BUCKETS] = session;
+  touch(session, now);
+  __atomic_add_fetch(&n_sessions, 1, __ATOMIC_RELAXED);
+  return NULL;
+}
+
+/**
+ * Makes room for a session to be loaded or created.
+ */
+static void prepare_add(time_t now)
+{
+  expire(now);
+  if (__atomic_load_n(&n_sessions, __ATOMIC_RELAXED) >= MAX_SESSIONS) {
+    purge_oldest_sessions(now);
   }
+}
 
-  free(oldest->id);
-  free(oldest);
+/**
+ * @returns ID_BYTES from /dev/urandom in hex, which must be freed, or NULL on
+ * error. Ids are stored for session-timeout, so they must not be guessable.
+ */
+static char *random_id()
+{
+  uint8_t bytes[ID_BYTES];
+  char *id;
+  ssize_t n;
+  int fd, done = 0, i;
+
+  fd = open("/dev/urandom", O_RDONLY);
+  if (fd < 0) {
+    musicd_perror(LOG_ERROR, "session", "can't open /dev/urandom");
+    return NULL;
+  }
+  while (done < ID_BYTES
+      && (n = read(fd, bytes + done, ID_BYTES - done)) > 0) {
+    done += n;
+  }
+  close(fd);
+  if (done < ID_BYTES) {
+    musicd_perror(LOG_ERROR, "session", "can't read /dev/urandom");
+    return NULL;
+  }
 
-  --n_sessions;
-  return 0;
+  id = malloc(ID_BYTES * 2 + 1);
+  for (i = 0; i < ID_BYTES; ++i) {
+    sprintf(id + i * 2, "%02x", bytes[i]);
+  }
+  return id;
 }
 
-session_t *session_new()
+session_t *session_new(const char *user)
 {
-  pthread_mutex_lock(&session_mutex);
+  session_t *session;
+  pthread_mutex_t *stripe;
+  time_t now = time(NULL);
 
-  while (n_sessions >= MAX_SESSIONS && !purge_oldest_session()) { }
+  pthread_once(&init_once, init);
 
-  session_t *session = malloc(sizeof(session_t));
-  memset(session, 0, sizeof(session_t));
+  prepare_add(now);
 
-  session->id = generate_session_id();
+  session = malloc(sizeof(session_t));
+  memset(session, 0, sizeof(session_t));
+  session->user = strcopy(user);
   session->refs = 1;
+  session->tick = -1;
 
-  musicd_log(LOG_DEBUG, "session", "new session %s", session->id);
+  while (true) {
+    session->id = random_id();
+    if (!session->id) {
+      free(session->user);
+      free(session);
+      return NULL;
+    }
+    session->hash = hash_id(session->id);
+    stripe = stripe_of(session->hash);
 
-  if (sessions) {
-    session->next = sessions;
-    sessions->prev = session;
+    if (!session_stored(session->id)) {
+      pthread_mutex_lock(stripe);
+      if (!add_session(session, now)) {
+        pthread_mutex_unlock(stripe);
+        set_missing(session->id, session->hash, false);
+        break;
+      }
+      pthread_mutex_unlock(stripe);
+    }
+    free(session->id);
   }
-  sessions = session;
 
-  ++n_sessions;
+  store_session(session);
 
-  pthread_mutex_unlock(&session_mutex);
+  musicd_log(LOG_DEBUG, "session", "new session %s", session->id);
   return session;
 }
 
 session_t *session_get(const char *id)
 {  
-  session_t *session;
+  session_t *session, *loaded;
+  pthread_mutex_t *stripe;
+  uint32_t hash = hash_id(id);
+  time_t now = time(NULL);
+
+  pthread_once(&init_once, init);
+
+  expire(now);
+  maybe_flush(now);
 
-  pthread_mutex_lock(&session_mutex);
-  session = get_session(id);
+  stripe = stripe_of(hash);
+  pthread_mutex_lock(stripe);
+  session = find(id, hash);
   if (session) {
     ++session->refs;
+    touch(session, now);
+    mark_dirty(session);
   }
-  pthread_mutex_unlock(&session_mutex);
+  pthread_mutex_unlock(stripe);
+
+  if (session) {
+    return session;
+  }
+
+  if (is_missing(id, hash)) {
+    return NULL;
+  }
+  loaded = load_session(id, now);
+  if (!loaded) {
+    set_missing(id, hash, true);
+    return NULL;
+  }
+  musicd_log(LOG_DEBUG, "session", "loaded session %s", id);
+
+  prepare_add(now);
+
+  pthread_mutex_lock(stripe);
+  session = add_session(loaded, now);
+  if (session) {
+    /* Loaded by another thread meanwhile */
+    free_session(loaded);
+    touch(session, now);
+  } else {
+    session = loaded;
+  }
+  ++session->refs;
+  mark_dirty(session);
+  pthread_mutex_unlock(stripe);
 
   return session;
 }
 
 void session_deref(session_t *session)
 {
+  pthread_mutex_t *stripe;
+
   if (!session) {
     return;
   }
-  pthread_mutex_lock(&session_mutex);
+  stripe = stripe_of(session->hash);
+  pthread_mutex_lock(stripe);
   --session->refs;
-  pthread_mutex_unlock(&session_mutex);
+  pthread_mutex_unlock(stripe);
 }
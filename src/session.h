@@ -19,6 +19,8 @@
 #ifndef MUSICD_SESSION_H
 #define MUSICD_SESSION_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #define MAX_SESSIONS 10000
@@ -32,14 +34,28 @@ typedef struct session {
 
   int refs;
 
-  struct session *prev, *next;
+  /* Private */
+  uint32_t hash;
+  /** Expiry wheel tick of last_request, -1 if not in the wheel */
+  int64_t tick;
+  /** last_request changed since it was stored */
+  bool dirty;
+  struct session *hash_next;
+  struct session *wheel_prev, *wheel_next;
 } session_t;
 
 
 /**
- * @return New session with random id and reference counter of 1
+ * Sessions are stored in the database, so they survive restarts. At most
+ * MAX_SESSIONS are kept in memory and the rest are loaded when first used.
+ * Changes to last_request are written in batches every minute.
  */
-session_t *session_new();
+
+/**
+ * @return New session of @p user, or share if NULL, with random id and
+ * reference counter of 1, or NULL if no id could be generated
+ */
+session_t *session_new(const char *user);
 
 /**
  * Raises reference counter by one
@@ -49,7 +65,8 @@ session_t *session_get(const char *id);
 
 /**
  * Must be called when done with the session to prevent it hanging around when
- * it would be deleted
+ * it would be deleted. Sessions without references are deleted once they have
+ * been idle for session-timeout seconds.
  */
 void session_deref(session_t *session);
 
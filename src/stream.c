@@ -671,3 +671,12 @@ bool stream_seek(stream_t *stream, double position)
 
   return result >= 0 ? true : false;
 }
+
+double stream_position(stream_t *stream)
+{
+  if (!stream->src_ctx || stream->src_packet.pts == AV_NOPTS_VALUE) {
+    return -1;
+  }
+  return stream->src_packet.pts *
+    av_q2d(stream->src_ctx->streams[0]->time_base) - stream->track->start;
+}
@@ -121,4 +121,10 @@ int stream_next(stream_t *stream);
  */
 bool stream_seek(stream_t *stream, double position);
 
+/**
+ * @returns position of the last packet read in seconds from the beginning of
+ * the track or negative if unknown
+ */
+double stream_position(stream_t *stream);
+
 #endif
@@ -33,6 +33,18 @@ string_t *string_new()
   string->string[0] = '\0';
   string->size = 0;
   string->max_size = 64;
+  string->arena = NULL;
+  return string;
+}
+
+string_t *string_new_in(arena_t *arena)
+{
+  string_t *string = arena_alloc(arena, sizeof(string_t));
+  string->string = arena_alloc(arena, 64 + 1);
+  string->string[0] = '\0';
+  string->size = 0;
+  string->max_size = 64;
+  string->arena = arena;
   return string;
 }
 
@@ -42,6 +54,7 @@ string_t *string_of(char *string2)
   string->string = string2;
   string->size = strlen(string2);
   string->max_size = string->size;
+  string->arena = NULL;
   return string;
 }
 
@@ -51,24 +64,32 @@ string_t *string_from(const char *string2)
   string->string = strcopy(string2);
   string->size = strlen(string->string);
   string->max_size = string->size;
+  string->arena = NULL;
   return string;
 }
 
 char *string_release(string_t *string)
 {
   char *result = string->string;
-  free(string);
+  if (!string->arena) {
+    free(string);
+  }
   return result;
 }
 
 void string_free(string_t *string)
 {
+  if (string->arena) {
+    return;
+  }
   free(string->string);
   free(string);
 }
 
 void string_ensure_space(string_t *string, size_t size)
 {
+  size_t old_size = string->max_size;
+
   if (string->max_size >= size) {
     return;
   }
@@ -78,7 +99,12 @@ void string_ensure_space(string_t *string, size_t size)
     string->max_size *= 2;
   }
   
-  string->string = realloc(string->string, string->max_size + 1);
+  if (string->arena) {
+    string->string = arena_realloc(string->arena, string->string,
+                                   old_size + 1, string->max_size + 1);
+  } else {
+    string->string = realloc(string->string, string->max_size + 1);
+  }
 }
 
 const char *string_string(string_t *string)
@@ -98,31 +124,27 @@ void string_append(string_t *string, const char *string2)
 
 void string_appendf(string_t *string, const char *format, ...)
 {
-  int n, size = 128;
-  char *buf;
+  size_t available = string->max_size - string->size + 1;
+  int n;
   va_list va_args;
 
-  buf = malloc(size);
+  /* Format straight to the end, again with enough space if it didn't fit */
+  va_start(va_args, format);
+  n = vsnprintf(string->string + string->size, available, format, va_args);
+  va_end(va_args);
 
-  while (1) {
+  if (n < 0) {
+    string->string[string->size] = '\0';
+    return;
+  }
+
+  if ((size_t)n >= available) {
+    string_ensure_space(string, string->size + n);
     va_start(va_args, format);
-    n = vsnprintf(buf, size, format, va_args);
+    vsnprintf(string->string + string->size, n + 1, format, va_args);
     va_end(va_args);
-
-    if (n > -1 && n < size) {
-      break;
-    }
-
-    if (n > -1) {
-      size = n + 1;
-    } else {
-      size *= 2;
-    }
-
-    buf = realloc(buf, size);
   }
-  string_nappend(string, buf, n);
-  free(buf);
+  string->size += n;
 }
 
 void string_nappend(string_t *string, const char *string2, size_t addlen)
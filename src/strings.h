@@ -18,6 +18,8 @@
 #ifndef MUSICD_STRINGS_H
 #define MUSICD_STRINGS_H
 
+#include "arena.h"
+
 #include <string.h>
 
 /**
@@ -29,9 +31,15 @@ typedef struct string {
   char *string;
   size_t size;
   size_t max_size;
+  arena_t *arena; /**< Allocator of the string, NULL for malloc */
 } string_t;
 
 string_t *string_new();
+/**
+ * @returns new string allocated from @p arena. Freeing it does nothing, it
+ * goes away with the arena.
+ */
+string_t *string_new_in(arena_t *arena);
 
 /**
  * Starts using @p string as data. @p string is no longer valid after calling
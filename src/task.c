@@ -17,138 +17,345 @@
  */
 #include "task.h"
 
+#include "config.h"
 #include "log.h"
+#include "metrics.h"
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/eventfd.h>
 
 /*
- * thread = any thread running tasks
- * worker = task that is marked as a worker
+ * Tasks run in a pool of long-lived threads started by task_pool_start. The
+ * pool is split in lanes, each with its own queues and threads:
  *
- * In total MAX_ACTIVE_THREADS can be running simultaneously, but only
- * MAX_ACTIVE_WORKERS of those can be running worker tasks.
+ * CPU lane runs CPU intensive tasks (like image scaling) and has one thread
+ * per processor by default, so they can't lock up the system.
  *
- * This means that too many CPU intensive tasks (like image scaling) can't be
- * running simultaneously locking up the system, but tasks that are mostly
- * waiting (like lyrics fetching) can be doing their waiting without disturbing
- * tasks that actually need resources.
+ * IO lane runs tasks that are mostly waiting (like lyrics fetching) and has
+ * more threads, so they can do their waiting without disturbing tasks that
+ * actually need resources.
+ *
+ * Each lane has a queue per priority and low priority tasks are only started
+ * when there are no high priority tasks queued. Idle threads sleep on their
+ * lane's condition variable.
+ *
+ * Finished tasks are pushed to a lock-free completion stack and signaled
+ * through a single eventfd, which the server polls.
+ *
+ * Tasks with a key are kept in an in-flight table until they finish. A task
+ * started with the key of an in-flight task becomes its follower: it isn't
+ * queued and finishes along with the leader.
  */
 
-#define MAX_ACTIVE_WORKERS 4
-#define MAX_ACTIVE_THREADS 32
+#define MIN_IO_THREADS 8
+#define INFLIGHT_BUCKETS 64
+
+typedef struct queue {
+  task_t *next, *last;
+} queue_t;
+
+typedef struct lane {
+  const char *name;
+  queue_t queues[TASK_PRIORITIES];
+  pthread_cond_t cond;
+  int threads;
+  int active;
+  int queued[TASK_PRIORITIES];
+} lane_t;
 
 static pthread_mutex_t task_mutex = PTHREAD_MUTEX_INITIALIZER;
-static task_t *next_task = NULL, *last_task = NULL;
-static int active_workers = 0, active_threads = 0;
+static lane_t lanes[TASK_LANES] = {
+  { "io", { { NULL, NULL } }, PTHREAD_COND_INITIALIZER, 0, 0, { 0 } },
+  { "cpu", { { NULL, NULL } }, PTHREAD_COND_INITIALIZER, 0, 0, { 0 } },
+};
 
-static void *thread_func(void *data)
+static task_t *inflight[INFLIGHT_BUCKETS];
+
+static task_t *finished = NULL;
+static int finished_fd = -1;
+
+static __thread task_t *current_task = NULL;
+
+static void push_finished(task_t *task)
 {
-  (void)data;
-  task_t *task;
+  uint64_t one = 1;
+  task_t *head = __atomic_load_n(&finished, __ATOMIC_RELAXED);
 
-  while (1) {
-    pthread_mutex_lock(&task_mutex);
+  do {
+    task->next = head;
+  } while (!__atomic_compare_exchange_n(&finished, &head, task, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
 
-    for (task = next_task; task; task = task->next) {
-      if (!task->worker || active_workers < MAX_ACTIVE_WORKERS) {
-        /* Task is not worker or worker limit not reached */
-        break;
-      }
-    }
+  write(finished_fd, &one, sizeof(one));
+}
 
-    if (!task) {
-      --active_threads;
-      musicd_log(LOG_DEBUG, "task",
-                 "quitting thread (%d/%d workers of %d/%d remaining)",
-                 active_workers, MAX_ACTIVE_WORKERS,
-                 active_threads, MAX_ACTIVE_THREADS);
-      pthread_mutex_unlock(&task_mutex);
-      return NULL;
-    }
+static task_t **inflight_bucket(const char *key)
+{
+  uint32_t hash = 2166136261u;
+  for (; *key; ++key) {
+    hash = (hash ^ (unsigned char)*key) * 16777619u;
+  }
+  return &inflight[hash % INFLIGHT_BUCKETS];
+}
 
-    if (task->prev) {
-      task->prev->next = task->next;
+static task_t *inflight_find(const char *key)
+{
+  task_t *task;
+  for (task = *inflight_bucket(key); task; task = task->inflight_next) {
+    if (!strcmp(task->key, key)) {
+      return task;
     }
-    if (task->next) {
-      task->next->prev = task->prev;
+  }
+  return NULL;
+}
+
+static void inflight_remove(task_t *task)
+{
+  task_t **p;
+  for (p = inflight_bucket(task->key); *p; p = &(*p)->inflight_next) {
+    if (*p == task) {
+      *p = task->inflight_next;
+      return;
     }
-    if (task == next_task) {
-      next_task = task->next;
+  }
+}
+
+static void unlink_follower(task_t *task)
+{
+  task_t **p;
+  for (p = &task->leader->followers; *p; p = &(*p)->next) {
+    if (*p == task) {
+      *p = task->next;
+      return;
     }
-    if (task == last_task) {
-      last_task = task->prev;
+  }
+}
+
+static void unlink_task(task_t *task)
+{
+  lane_t *lane = &lanes[task->lane];
+  queue_t *queue = &lane->queues[task->priority];
+
+  if (task->prev) {
+    task->prev->next = task->next;
+  }
+  if (task->next) {
+    task->next->prev = task->prev;
+  }
+  if (task == queue->next) {
+    queue->next = task->next;
+  }
+  if (task == queue->last) {
+    queue->last = task->prev;
+  }
+  task->next = task->prev = NULL;
+  --lane->queued[task->priority];
+}
+
+static task_t *dequeue(lane_t *lane)
+{
+  queue_t *queue;
+  task_t *task;
+
+  for (queue = lane->queues; queue < lane->queues + TASK_PRIORITIES; ++queue) {
+    if (queue->next) {
+      task = queue->next;
+      unlink_task(task);
+      return task;
     }
+  }
+  return NULL;
+}
 
-    if (task->worker) {
-      ++active_workers;
-      musicd_log(LOG_DEBUG, "task", "%p starting worker %d/%d", task,
-                 active_workers, MAX_ACTIVE_WORKERS);
-    } else {
-      musicd_log(LOG_DEBUG, "task", "%p starting", task);
+static void discard(task_t *task)
+{
+  if (task->discard) {
+    task->discard(task->data);
+  }
+}
+
+static void *thread_func(void *data)
+{
+  lane_t *lane = (lane_t *)data;
+  task_t *task, *follower;
+  bool expired;
+
+  pthread_mutex_lock(&task_mutex);
+
+  while (1) {
+    while (!(task = dequeue(lane))) {
+      pthread_cond_wait(&lane->cond, &task_mutex);
     }
 
+    task->started = 1;
+    ++lane->active;
+    musicd_log(LOG_DEBUG, "task", "%p starting in %s lane (%d/%d)", task,
+               lane->name, lane->active, lane->threads);
     pthread_mutex_unlock(&task_mutex);
-    task->func(task->data);
-    pthread_mutex_lock(&task_mutex);
 
-    if (task->worker) {
-      --active_workers;
-      musicd_log(LOG_DEBUG, "task", "%p finished worker (%d/%d remain)", task,
-                 active_workers, MAX_ACTIVE_WORKERS);
+    expired = task->deadline && metrics_usec() > task->deadline;
+    if (expired) {
+      musicd_log(LOG_VERBOSE, "task", "%p missed its deadline", task);
+      discard(task);
     } else {
-      musicd_log(LOG_DEBUG, "task", "%p finished", task);
+      current_task = task;
+      task->func(task->data);
+      current_task = NULL;
     }
 
-    pthread_mutex_unlock(&task_mutex);
+    pthread_mutex_lock(&task_mutex);
+    --lane->active;
 
-    if (!task->detached) {
-      write(task->pipe[1], "\0", 1);
-    } else {
+    musicd_log(LOG_DEBUG, "task", "%p finished", task);
+    if (task->key) {
+      inflight_remove(task);
+    }
+    while (task->followers) {
+      follower = task->followers;
+      task->followers = follower->next;
+      follower->leader = NULL;
+      if (follower->detached) {
+        /* Launched, nobody is waiting for it */
+        task_free(follower);
+      } else {
+        push_finished(follower);
+      }
+    }
+    if (task->detached || task->cancelled) {
+      /* Nobody is waiting */
       task_free(task);
+    } else {
+      push_finished(task);
     }
   }
 
+  return NULL;
 }
 
 
-static void start(task_t *task)
+static void enqueue(task_t *task)
 {
-  pthread_t thread;
+  lane_t *lane = &lanes[task->lane];
+  queue_t *queue = &lane->queues[task->priority];
 
-  if (!last_task) {
-    next_task = last_task = task;
+  if (!queue->last) {
+    queue->next = queue->last = task;
   } else {
-    last_task->next = task;
-    task->prev = last_task;
-    last_task = task;
+    queue->last->next = task;
+    task->prev = queue->last;
+    queue->last = task;
   }
+  ++lane->queued[task->priority];
+}
 
-  if (active_threads < MAX_ACTIVE_THREADS
-   && active_workers < MAX_ACTIVE_WORKERS) {
-    musicd_log(LOG_DEBUG, "task", "%p spawning thread %d/%d", task,
-             active_threads + 1, MAX_ACTIVE_THREADS);
+static void start(task_t *task)
+{
+  lane_t *lane = &lanes[task->lane];
+  task_t *leader, **bucket;
 
-    if (pthread_create(&thread, NULL, thread_func, NULL)) {
-      musicd_perror(LOG_FATAL, "task", "pthread_create: ");
-      abort();
+  if (task->key) {
+    leader = inflight_find(task->key);
+    if (leader && leader->started
+     && (__atomic_load_n(&leader->cancelled, __ATOMIC_RELAXED)
+      || (leader->deadline && metrics_usec() > leader->deadline))) {
+      /* The leader may already have given up without a result, so the work
+       * is done again by this task */
+      inflight_remove(leader);
+      leader = NULL;
     }
-    pthread_detach(thread);
-
-    ++active_threads;
-  } else {
-    musicd_log(LOG_DEBUG, "task", "%p queued");
+    if (leader) {
+      /* Identical work is already in flight, just wait for it */
+      musicd_log(LOG_DEBUG, "task", "%p follows %p (%s)", task, leader,
+                 task->key);
+      if (!leader->started && task->priority < leader->priority) {
+        /* Don't keep the follower waiting behind background work */
+        unlink_task(leader);
+        leader->priority = task->priority;
+        enqueue(leader);
+      }
+      if (!leader->started) {
+        /* The leader works for the follower too, so it must not expire
+         * before the follower would */
+        if (!task->deadline) {
+          leader->deadline = 0;
+        } else if (leader->deadline && task->deadline > leader->deadline) {
+          leader->deadline = task->deadline;
+        }
+      }
+      discard(task);
+      task->started = 1;
+      task->leader = leader;
+      task->next = leader->followers;
+      leader->followers = task;
+      metrics_add(METRICS_TASKS_COALESCED, 1);
+      return;
+    }
+    bucket = inflight_bucket(task->key);
+    task->inflight_next = *bucket;
+    *bucket = task;
   }
+
+  enqueue(task);
+
+  musicd_log(LOG_DEBUG, "task", "%p queued in %s lane", task, lane->name);
+  pthread_cond_signal(&lane->cond);
 }
 
 
+int task_pool_start()
+{
+  pthread_t thread;
+  lane_t *lane;
+  int cpus, threads[TASK_LANES], i;
+
+  finished_fd = eventfd(0, EFD_NONBLOCK);
+  if (finished_fd < 0) {
+    musicd_perror(LOG_ERROR, "task", "eventfd: ");
+    return -1;
+  }
+
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus < 1) {
+    cpus = 1;
+  }
+
+  threads[TASK_LANE_CPU] = config_to_int("task-cpu-threads");
+  if (threads[TASK_LANE_CPU] <= 0) {
+    threads[TASK_LANE_CPU] = cpus;
+  }
+  threads[TASK_LANE_IO] = config_to_int("task-io-threads");
+  if (threads[TASK_LANE_IO] <= 0) {
+    threads[TASK_LANE_IO] =
+      cpus * 2 > MIN_IO_THREADS ? cpus * 2 : MIN_IO_THREADS;
+  }
+
+  pthread_mutex_lock(&task_mutex);
+  for (lane = lanes; lane < lanes + TASK_LANES; ++lane) {
+    for (i = 0; i < threads[lane - lanes]; ++i) {
+      if (pthread_create(&thread, NULL, thread_func, lane)) {
+        musicd_perror(LOG_ERROR, "task", "pthread_create: ");
+        break;
+      }
+      pthread_detach(thread);
+      ++lane->threads;
+    }
+    musicd_log(LOG_VERBOSE, "task", "%d threads in %s lane", lane->threads,
+               lane->name);
+  }
+  pthread_mutex_unlock(&task_mutex);
+
+  return lanes[TASK_LANE_CPU].threads && lanes[TASK_LANE_IO].threads ? 0 : -1;
+}
+
 task_t *task_new()
 {
   task_t *task = malloc(sizeof(task_t));
   memset(task, 0, sizeof(task_t));
-  pipe(task->pipe);
 
   return task;
 }
@@ -160,16 +367,75 @@ void task_start(task_t *task)
   pthread_mutex_unlock(&task_mutex);
 }
 
+void task_cancel(task_t *task)
+{
+  pthread_mutex_lock(&task_mutex);
+
+  if (task->leader) {
+    /* A follower has no work of its own */
+    unlink_follower(task);
+    task_free(task);
+  } else if (task->followers) {
+    /* Others are still waiting for the result */
+    task->detached = 1;
+  } else if (!task->started) {
+    musicd_log(LOG_DEBUG, "task", "%p cancelled before starting", task);
+    if (task->key) {
+      inflight_remove(task);
+    }
+    unlink_task(task);
+    discard(task);
+    task_free(task);
+  } else {
+    /* Freed by the thread running it or by task_finished */
+    __atomic_store_n(&task->cancelled, 1, __ATOMIC_RELAXED);
+  }
+
+  pthread_mutex_unlock(&task_mutex);
+}
+
+bool task_cancelled()
+{
+  task_t *task = current_task;
+
+  if (!task) {
+    return false;
+  }
+  return __atomic_load_n(&task->cancelled, __ATOMIC_RELAXED)
+      || (task->deadline && metrics_usec() > task->deadline);
+}
+
 
-int task_pollfd(task_t *task)
+int task_pollfd()
 {
-  return task->pipe[0];
+  return finished_fd;
+}
+
+task_t *task_finished()
+{
+  uint64_t count;
+  task_t *task, *next, *result = NULL;
+
+  read(finished_fd, &count, sizeof(count));
+
+  /* The stack is in reverse finishing order */
+  task = __atomic_exchange_n(&finished, NULL, __ATOMIC_ACQUIRE);
+  for (; task; task = next) {
+    next = task->next;
+    if (task->cancelled) {
+      /* Cancelled after it was finished, nobody is waiting anymore */
+      task_free(task);
+      continue;
+    }
+    task->next = result;
+    result = task;
+  }
+  return result;
 }
 
 void task_free(task_t* task)
 {
-  close(task->pipe[0]);
-  close(task->pipe[1]);
+  free(task->key);
   free(task);
 }
 
@@ -180,3 +446,19 @@ void task_launch(task_t *task)
   start(task);
   pthread_mutex_unlock(&task_mutex);
 }
+
+void task_stats(task_stats_t *stats)
+{
+  lane_t *lane;
+
+  memset(stats, 0, sizeof(task_stats_t));
+  pthread_mutex_lock(&task_mutex);
+  for (lane = lanes; lane < lanes + TASK_LANES; ++lane) {
+    stats->queued += lane->queued[TASK_PRIORITY_HIGH]
+                   + lane->queued[TASK_PRIORITY_LOW];
+    stats->queued_low += lane->queued[TASK_PRIORITY_LOW];
+    stats->threads += lane->threads;
+    stats->active += lane->active;
+  }
+  pthread_mutex_unlock(&task_mutex);
+}
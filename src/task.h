@@ -19,22 +19,59 @@
 #define MUSICD_TASK_H
 
 #include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum task_lane {
+  TASK_LANE_IO = 0, /**< Mostly waiting, default */
+  TASK_LANE_CPU, /**< CPU intensive */
+  TASK_LANES /**< Amount of lanes, not a lane */
+} task_lane_t;
+
+typedef enum task_priority {
+  TASK_PRIORITY_HIGH = 0, /**< Someone is waiting, default */
+  TASK_PRIORITY_LOW, /**< Background work */
+  TASK_PRIORITIES /**< Amount of priorities, not a priority */
+} task_priority_t;
 
 typedef struct task {
   /* Set before starting/launching */
   void *(*func)(void *);
   void *data;
-  int worker; /**< Is this CPU intensive tasks */
+  task_lane_t lane;
+  task_priority_t priority;
+  /** metrics_usec() time after which the task is not started, 0 if none */
+  int64_t deadline;
+  /** Called with data instead of func if the task is not run, can be NULL */
+  void (*discard)(void *);
+  /** Identifies the work, task_start coalesces tasks with equal keys.
+   * Freed by task_free, can be NULL. */
+  char *key;
+  void *owner; /**< Free for the waiter to use */
 
   /* Private */
-  int pipe[2];
-  int running;
+  int started;
+  int cancelled;
   int detached; /* Launched with task_launch */
   struct task *prev, *next;
+  struct task *leader; /* Task doing the work of this one */
+  struct task *followers; /* Tasks waiting for this one */
+  struct task *inflight_next; /* Bucket in the in-flight table */
 } task_t;
 
+/**
+ * Starts the thread pool. Sizes of the lanes are read from task-cpu-threads
+ * and task-io-threads.
+ * @returns 0 on success, nonzero on failure
+ */
+int task_pool_start();
+
 task_t *task_new();
 
+/**
+ * Queues @p task. If a task with the same key is already queued or running,
+ * @p task only waits for it and finishes at the same time.
+ */
 void task_start(task_t *task);
 
 /**
@@ -44,17 +81,46 @@ void task_start(task_t *task);
 void task_launch(task_t *task);
 
 /**
- * @returns file descriptor which will trigger POLLIN event once the task is
- * finished
+ * Cancels @p task started with task_start. If it hasn't started yet, it is
+ * removed from the queue and freed. Otherwise it is freed once finished.
+ * @p task is not valid after calling.
  */
-int task_pollfd(task_t *task);
+void task_cancel(task_t *task);
 
 /**
- * Frees resources allocated by task_start
+ * @returns true if the task running in the calling thread has been cancelled
+ * or has missed its deadline. Long tasks should check this and give up.
+ */
+bool task_cancelled();
+
+/**
+ * @returns file descriptor which will trigger POLLIN event once any task
+ * started with task_start has finished
+ */
+int task_pollfd();
+
+/**
+ * Takes finished tasks from the completion queue.
+ * @returns finished tasks linked through next in finishing order or NULL
+ * @note Only one thread may take finished tasks.
+ */
+task_t *task_finished();
+
+/**
+ * Frees @p task
  * @warning If called before the task is actually finished bad things will
  * happen
  */
 void task_free(task_t *task);
 
+typedef struct task_stats {
+  int queued; /**< Tasks waiting for a thread */
+  int queued_low; /**< Low priority tasks waiting for a thread */
+  int threads; /**< Threads in the pool */
+  int active; /**< Threads running a task */
+} task_stats_t;
+
+void task_stats(task_stats_t *stats);
+
 
 #endif
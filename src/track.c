@@ -42,6 +42,12 @@ static char *copy_metadata(AVFormatContext *avctx, const char *key)
   return strcopy(result);
 }
 
+static char *copy_stream_metadata(AVStream *stream, const char *key)
+{
+  AVDictionaryEntry *entry = av_dict_get(stream->metadata, key, NULL, 0);
+  return entry ? strcopy(entry->value) : NULL;
+}
+
 track_t *track_new()
 {
   track_t *result = malloc(sizeof(track_t));
@@ -134,7 +140,27 @@ static track_t *track_create(const char *path,
   return track;
 }
 
-track_t **tracks_from_path(const char *path)
+static void read_picture(AVFormatContext *avctx, track_picture_t *picture)
+{
+  AVStream *stream;
+  unsigned int i;
+
+  for (i = 0; i < avctx->nb_streams; ++i) {
+    stream = avctx->streams[i];
+    if (!(stream->disposition & AV_DISPOSITION_ATTACHED_PIC)
+     || stream->attached_pic.size <= 0) {
+      continue;
+    }
+
+    picture->size = stream->attached_pic.size;
+    picture->data = malloc(picture->size);
+    memcpy(picture->data, stream->attached_pic.data, picture->size);
+    picture->description = copy_stream_metadata(stream, "comment");
+    return;
+  }
+}
+
+track_t **tracks_from_path(const char *path, track_picture_t *picture)
 {
   AVFormatContext *avctx = NULL;
   track_t **tracks; /* NULL terminated */
@@ -142,6 +168,10 @@ track_t **tracks_from_path(const char *path)
   int i;
   char *tmp;
 
+  if (picture) {
+    memset(picture, 0, sizeof(track_picture_t));
+  }
+
   if (avformat_open_input(&avctx, path, NULL, NULL)) {
     return NULL;
   }
@@ -149,6 +179,10 @@ track_t **tracks_from_path(const char *path)
     return NULL;
   }
 
+  if (picture) {
+    read_picture(avctx, picture);
+  }
+
   tmp = copy_metadata(avctx, "tracks");
   if (tmp) {
     sscanf(tmp, "%d", &track_count);
@@ -200,3 +234,9 @@ void track_free(track_t *track)
   free(track);
 }
 
+void track_picture_clear(track_picture_t *picture)
+{
+  free(picture->data);
+  free(picture->description);
+  memset(picture, 0, sizeof(track_picture_t));
+}
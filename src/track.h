@@ -44,13 +44,34 @@ typedef struct track {
 } track_t;
 
 
+/**
+ * Picture attached to an audio file, such as ID3 APIC, FLAC PICTURE or MP4
+ * covr.
+ */
+typedef struct track_picture {
+  char *data;
+  int size;
+  /** Picture type such as "Cover (front)", NULL if not known */
+  char *description;
+} track_picture_t;
+
+
 track_t *track_new();
 
 track_t *track_from_path(const char *path);
-track_t **tracks_from_path(const char *path);
+/**
+ * Reads tracks in @p path. If @p picture is not NULL, the first attached
+ * picture is stored in it, or it is zeroed if there is none.
+ */
+track_t **tracks_from_path(const char *path, track_picture_t *picture);
 
 void tracks_free(track_t **track);
 void track_free(track_t *track);
 
+/**
+ * Frees contents of @p picture.
+ */
+void track_picture_clear(track_picture_t *picture);
+
 
 #endif
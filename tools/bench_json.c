@@ -0,0 +1,330 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * JSON serializer benchmark. Serializes a synthetic /tracks dump with the
+ * serializer in src/json.c and with the previous one, which escaped through
+ * string_push_back and formatted integers and keys through the previous
+ * string_appendf (a malloc'd temporary buffer per call, copied in), checks
+ * they agree and reports the best time and throughput of each.
+ *
+ * Usage: bench_json [tracks] [rounds]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/json.h"
+#include "../src/strings.h"
+
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+/*** Previous implementation ***/
+
+/* string_appendf as it was before formatting straight into the string */
+static void old_appendf(string_t *string, const char *format, ...)
+{
+  int n, size = 128;
+  char *buf;
+  va_list va_args;
+
+  buf = malloc(size);
+
+  while (1) {
+    va_start(va_args, format);
+    n = vsnprintf(buf, size, format, va_args);
+    va_end(va_args);
+
+    if (n > -1 && n < size) {
+      break;
+    }
+
+    if (n > -1) {
+      size = n + 1;
+    } else {
+      size *= 2;
+    }
+
+    buf = realloc(buf, size);
+  }
+  string_nappend(string, buf, n);
+  free(buf);
+}
+
+static void old_comma(json_t *json)
+{
+  if (json->comma) {
+    string_append(json->buf, ",");
+    json->comma = 0;
+  }
+}
+
+static void old_object_begin(json_t *json)
+{
+  old_comma(json);
+  string_append(json->buf, "{");
+}
+
+static void old_object_end(json_t *json)
+{
+  string_append(json->buf, "}");
+  json->comma = 1;
+}
+
+static void old_array_begin(json_t *json)
+{
+  old_comma(json);
+  string_append(json->buf, "[");
+}
+
+static void old_array_end(json_t *json)
+{
+  string_append(json->buf, "]");
+  json->comma = 1;
+}
+
+static void old_define(json_t *json, const char *name)
+{
+  old_comma(json);
+  old_appendf(json->buf, "\"%s\":", name);
+}
+
+static void old_int(json_t *json, int i)
+{
+  old_comma(json);
+  old_appendf(json->buf, "%d", i);
+  json->comma = 1;
+}
+
+static void old_int64(json_t *json, int64_t i)
+{
+  old_comma(json);
+  old_appendf(json->buf, "%" PRId64 "", i);
+  json->comma = 1;
+}
+
+static const char *escape_from = "\"\\\b\f\n\r\t";
+static const char *escape_to = "\"\\bfnrt";
+static const int n_escape = 7;
+
+static void old_string(json_t *json, const char *string)
+{
+  int i;
+
+  old_comma(json);
+
+  string_push_back(json->buf, '"');
+
+  if (string) {
+    for (; *string != '\0'; ++string) {
+      for (i = 0; i < n_escape; ++i) {
+        if (*string == escape_from[i]) {
+          break;
+        }
+      }
+      if (i < n_escape) {
+        string_push_back(json->buf, '\\');
+        string_push_back(json->buf, escape_to[i]);
+      } else {
+        string_push_back(json->buf, *string);
+      }
+    }
+  }
+
+  string_push_back(json->buf, '"');
+  json->comma = 1;
+}
+
+
+/*** Benchmark ***/
+
+typedef struct {
+  int64_t id;
+  int track;
+  char *title;
+  int64_t artistid;
+  char *artist;
+  int64_t albumid;
+  char *album;
+  int duration;
+} bench_track_t;
+
+static const char *words[] = {
+  "Love", "Night", "Blue", "Song", "Dream", "Fire", "Rain", "Heart", "Road",
+  "Moon", "Déjà", "Vu", "東京", "Sommernacht", "\"Live\"", "Part\\2",
+  "(Remix)", "Tab\tSeparated", "Line\nBreak", "ÆØÅ"
+};
+#define WORDS (sizeof(words) / sizeof(words[0]))
+
+static char *make_name(unsigned int *seed, int min_words, int max_words)
+{
+  string_t *name = string_new();
+  int i, n = min_words + rand_r(seed) % (max_words - min_words + 1);
+
+  for (i = 0; i < n; ++i) {
+    if (i > 0) {
+      string_push_back(name, ' ');
+    }
+    /* Most titles are plain, escapes are the exception */
+    string_append(name, words[rand_r(seed) % (rand_r(seed) % 8 ? 14 : WORDS)]);
+  }
+  return string_release(name);
+}
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static char *dump_new(bench_track_t *tracks, int count)
+{
+  json_t json;
+  int i;
+
+  json_init(&json);
+  json_object_begin(&json);
+  json_define(&json, "total"); json_int64(&json, count);
+  json_define(&json, "tracks");
+  json_array_begin(&json);
+  for (i = 0; i < count; ++i) {
+    json_object_begin(&json);
+    json_define(&json, "id");       json_int64(&json, tracks[i].id);
+    json_define(&json, "track");    json_int(&json, tracks[i].track);
+    json_define(&json, "title");    json_string(&json, tracks[i].title);
+    json_define(&json, "artistid"); json_int64(&json, tracks[i].artistid);
+    json_define(&json, "artist");   json_string(&json, tracks[i].artist);
+    json_define(&json, "albumid");  json_int64(&json, tracks[i].albumid);
+    json_define(&json, "album");    json_string(&json, tracks[i].album);
+    json_define(&json, "duration"); json_int(&json, tracks[i].duration);
+    json_object_end(&json);
+  }
+  json_array_end(&json);
+  json_object_end(&json);
+  return string_release(json.buf);
+}
+
+static char *dump_old(bench_track_t *tracks, int count)
+{
+  json_t json;
+  int i;
+
+  json_init(&json);
+  old_object_begin(&json);
+  old_define(&json, "total"); old_int64(&json, count);
+  old_define(&json, "tracks");
+  old_array_begin(&json);
+  for (i = 0; i < count; ++i) {
+    old_object_begin(&json);
+    old_define(&json, "id");       old_int64(&json, tracks[i].id);
+    old_define(&json, "track");    old_int(&json, tracks[i].track);
+    old_define(&json, "title");    old_string(&json, tracks[i].title);
+    old_define(&json, "artistid"); old_int64(&json, tracks[i].artistid);
+    old_define(&json, "artist");   old_string(&json, tracks[i].artist);
+    old_define(&json, "albumid");  old_int64(&json, tracks[i].albumid);
+    old_define(&json, "album");    old_string(&json, tracks[i].album);
+    old_define(&json, "duration"); old_int(&json, tracks[i].duration);
+    old_object_end(&json);
+  }
+  old_array_end(&json);
+  old_object_end(&json);
+  return string_release(json.buf);
+}
+
+static double run(char *(*dump)(bench_track_t *, int), bench_track_t *tracks,
+                  int count, int rounds, char **result)
+{
+  double best = 0, start, elapsed;
+  int i;
+
+  for (i = 0; i < rounds; ++i) {
+    start = now();
+    *result = dump(tracks, count);
+    elapsed = now() - start;
+    if (i == 0 || elapsed < best) {
+      best = elapsed;
+    }
+    if (i < rounds - 1) {
+      free(*result);
+    }
+  }
+  return best;
+}
+
+int main(int argc, char *argv[])
+{
+  int count = argc > 1 ? atoi(argv[1]) : 100000;
+  int rounds = argc > 2 ? atoi(argv[2]) : 10;
+  unsigned int seed = 1;
+  bench_track_t *tracks;
+  char *old_result, *new_result;
+  double old_time, new_time;
+  size_t size;
+  int i;
+
+  if (count <= 0 || rounds <= 0) {
+    printf("Usage: %s [tracks] [rounds]\n", argv[0]);
+    return 1;
+  }
+
+  tracks = malloc(count * sizeof(bench_track_t));
+  for (i = 0; i < count; ++i) {
+    tracks[i].id = i + 1;
+    tracks[i].track = 1 + i % 12;
+    tracks[i].title = make_name(&seed, 1, 5);
+    tracks[i].artistid = 1 + i / 120;
+    tracks[i].artist = make_name(&seed, 1, 3);
+    tracks[i].albumid = 1 + i / 12;
+    tracks[i].album = make_name(&seed, 1, 4);
+    tracks[i].duration = 60 + rand_r(&seed) % 600;
+  }
+
+  old_time = run(dump_old, tracks, count, rounds, &old_result);
+  new_time = run(dump_new, tracks, count, rounds, &new_result);
+
+  if (strcmp(old_result, new_result)) {
+    fprintf(stderr, "outputs differ\n");
+    return 1;
+  }
+  size = strlen(new_result);
+
+  printf("%d tracks, %.1f MiB, best of %d\n", count, size / 1048576.0, rounds);
+  printf("%-8s %10s %10s\n", "", "ms", "MiB/s");
+  printf("%-8s %10.2f %10.1f\n", "old", old_time * 1e3,
+         size / 1048576.0 / old_time);
+  printf("%-8s %10.2f %10.1f\n", "new", new_time * 1e3,
+         size / 1048576.0 / new_time);
+  printf("speedup %.2fx\n", old_time / new_time);
+
+  free(old_result);
+  free(new_result);
+  for (i = 0; i < count; ++i) {
+    free(tracks[i].title);
+    free(tracks[i].artist);
+    free(tracks[i].album);
+  }
+  free(tracks);
+  return 0;
+}
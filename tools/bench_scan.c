@@ -0,0 +1,345 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scan benchmark. Generates a synthetic library of tiny tagged WAV files,
+ * single-file albums with CUE sheets and cover images, then runs a full scan
+ * against a fresh database and reports wall time, files per second, time
+ * spent in SQLite and peak RSS.
+ *
+ * Usage: bench_scan <directory> [albums] [tracks per album]
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/config.h"
+#include "../src/db.h"
+#include "../src/libav.h"
+#include "../src/library.h"
+#include "../src/log.h"
+#include "../src/musicd.h"
+#include "../src/scan.h"
+#include "../src/strings.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <FreeImage.h>
+#include <sqlite3.h>
+
+/** Every nth album is a single file with a CUE sheet. */
+#define CUE_ALBUM_INTERVAL 4
+/** Albums per artist. */
+#define ARTIST_ALBUMS 3
+
+#define WAV_RATE 8000
+
+static int files_generated = 0;
+
+static int64_t sqlite_ns = 0;
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void make_directory(const char *path)
+{
+  if (mkdir(path, 0755) && errno != EEXIST) {
+    perror(path);
+    exit(1);
+  }
+}
+
+static void write_u16(FILE *file, uint16_t value)
+{
+  fputc(value & 0xff, file);
+  fputc(value >> 8, file);
+}
+
+static void write_u32(FILE *file, uint32_t value)
+{
+  write_u16(file, value & 0xffff);
+  write_u16(file, value >> 16);
+}
+
+static uint32_t info_size(const char *value)
+{
+  uint32_t size = strlen(value) + 1;
+  return 8 + size + (size & 1);
+}
+
+static void write_info(FILE *file, const char *id, const char *value)
+{
+  uint32_t size = strlen(value) + 1;
+  fwrite(id, 1, 4, file);
+  write_u32(file, size);
+  fwrite(value, 1, size, file);
+  if (size & 1) {
+    fputc(0, file);
+  }
+}
+
+/**
+ * Writes a silent 8-bit mono WAV file of @p seconds with a LIST INFO chunk,
+ * which libavformat reads as title, artist, album and track metadata.
+ */
+static void write_wav(const char *path, const char *title, const char *artist,
+                      const char *album, int track, int seconds)
+{
+  FILE *file;
+  char track_str[16];
+  uint32_t list_size, data_size = WAV_RATE * seconds, i;
+
+  file = fopen(path, "wb");
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+
+  snprintf(track_str, sizeof(track_str), "%d", track);
+
+  list_size = 4;
+  if (title) {
+    list_size += info_size(title) + info_size(track_str);
+  }
+  list_size += info_size(artist) + info_size(album);
+
+  fwrite("RIFF", 1, 4, file);
+  write_u32(file, 4 + (8 + 16) + (8 + list_size) + (8 + data_size));
+  fwrite("WAVE", 1, 4, file);
+
+  fwrite("fmt ", 1, 4, file);
+  write_u32(file, 16);
+  write_u16(file, 1); /* PCM */
+  write_u16(file, 1); /* Channels */
+  write_u32(file, WAV_RATE);
+  write_u32(file, WAV_RATE); /* Byte rate */
+  write_u16(file, 1); /* Block align */
+  write_u16(file, 8); /* Bits per sample */
+
+  fwrite("LIST", 1, 4, file);
+  write_u32(file, list_size);
+  fwrite("INFO", 1, 4, file);
+  if (title) {
+    write_info(file, "INAM", title);
+    write_info(file, "IPRT", track_str);
+  }
+  write_info(file, "IART", artist);
+  write_info(file, "IPRD", album);
+
+  fwrite("data", 1, 4, file);
+  write_u32(file, data_size);
+  for (i = 0; i < data_size; ++i) {
+    fputc(0x80, file);
+  }
+
+  fclose(file);
+  ++files_generated;
+}
+
+static void write_cue(const char *path, const char *wav, const char *artist,
+                      const char *album, int tracks)
+{
+  FILE *file;
+  int i;
+
+  file = fopen(path, "w");
+  if (!file) {
+    perror(path);
+    exit(1);
+  }
+
+  fprintf(file, "PERFORMER \"%s\"\n", artist);
+  fprintf(file, "TITLE \"%s\"\n", album);
+  fprintf(file, "FILE \"%s\" WAVE\n", wav);
+  for (i = 0; i < tracks; ++i) {
+    fprintf(file, "  TRACK %02d AUDIO\n", i + 1);
+    fprintf(file, "    TITLE \"Track %d\"\n", i + 1);
+    fprintf(file, "    INDEX 01 %02d:%02d:00\n", i / 60, i % 60);
+  }
+
+  fclose(file);
+  ++files_generated;
+}
+
+static void write_image(const char *path, int size, int seed)
+{
+  FIBITMAP *bitmap;
+  RGBQUAD color;
+  int x, y;
+
+  bitmap = FreeImage_Allocate(size, size, 24, 0, 0, 0);
+  for (y = 0; y < size; ++y) {
+    for (x = 0; x < size; ++x) {
+      color.rgbRed = x + seed;
+      color.rgbGreen = y * seed;
+      color.rgbBlue = x ^ y;
+      FreeImage_SetPixelColor(bitmap, x, y, &color);
+    }
+  }
+  if (!FreeImage_Save(FIF_JPEG, bitmap, path, JPEG_DEFAULT)) {
+    fprintf(stderr, "can't write %s\n", path);
+    exit(1);
+  }
+  FreeImage_Unload(bitmap);
+  ++files_generated;
+}
+
+static void generate(const char *root, int albums, int tracks)
+{
+  char artist[64], album[64], title[64];
+  char *artist_dir, *album_dir, *path;
+  int i, j;
+
+  make_directory(root);
+
+  for (i = 0; i < albums; ++i) {
+    snprintf(artist, sizeof(artist), "Artist %d", i / ARTIST_ALBUMS);
+    snprintf(album, sizeof(album), "Album %d", i);
+
+    artist_dir = stringf("%s/%s", root, artist);
+    album_dir = stringf("%s/%s", artist_dir, album);
+    make_directory(artist_dir);
+    make_directory(album_dir);
+
+    if (i % CUE_ALBUM_INTERVAL == 0) {
+      path = stringf("%s/album.wav", album_dir);
+      write_wav(path, NULL, artist, album, 0, tracks);
+      free(path);
+      path = stringf("%s/album.cue", album_dir);
+      write_cue(path, "album.wav", artist, album, tracks);
+      free(path);
+    } else {
+      for (j = 0; j < tracks; ++j) {
+        snprintf(title, sizeof(title), "Track %d", j + 1);
+        path = stringf("%s/%02d - %s.wav", album_dir, j + 1, title);
+        write_wav(path, title, artist, album, j + 1, 1);
+        free(path);
+      }
+    }
+
+    path = stringf("%s/cover.jpg", album_dir);
+    write_image(path, 256, i);
+    free(path);
+    path = stringf("%s/back.jpg", album_dir);
+    write_image(path, 64, i + 1);
+    free(path);
+
+    free(album_dir);
+    free(artist_dir);
+  }
+}
+
+static int trace_cb(unsigned type, void *opaque, void *p, void *x)
+{
+  (void)opaque;
+  (void)p;
+  if (type == SQLITE_TRACE_PROFILE) {
+    sqlite_ns += *(sqlite3_int64 *)x;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[])
+{
+  char *music, *db;
+  int albums = 200, tracks = 10;
+  double start, elapsed;
+  scan_status_t status;
+  struct rusage usage;
+  struct timespec wait = { 0, 10000000 };
+
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <directory> [albums] [tracks per album]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 2) {
+    albums = atoi(argv[2]);
+  }
+  if (argc > 3) {
+    tracks = atoi(argv[3]);
+  }
+
+  musicd_start_time = time(NULL);
+
+  config_init();
+  config_set_hook("log-level", log_level_changed);
+  config_set("log-level", "warning");
+  config_set_hook("image-prefix", scan_image_prefix_changed);
+  config_set("image-prefix", "front,cover,jacket");
+
+  av_register_all();
+  avcodec_register_all();
+  av_log_set_level(AV_LOG_QUIET);
+
+  make_directory(argv[1]);
+  music = stringf("%s/music", argv[1]);
+  db = stringf("%s/bench.db", argv[1]);
+
+  printf("generating %d albums of %d tracks in %s\n", albums, tracks, music);
+  start = now();
+  generate(music, albums, tracks);
+  printf("generated %d files in %.2f s\n", files_generated, now() - start);
+
+  /* Always start from a fresh database. */
+  unlink(db);
+  config_set("db-file", db);
+  config_set("music-directory", music);
+
+  if (db_open()) {
+    fprintf(stderr, "can't open database %s\n", db);
+    return 1;
+  }
+  sqlite3_trace_v2(db_handle(), SQLITE_TRACE_PROFILE, trace_cb, NULL);
+
+  start = now();
+  if (scan_start()) {
+    fprintf(stderr, "can't start scan\n");
+    return 1;
+  }
+  do {
+    nanosleep(&wait, NULL);
+    scan_status(&status);
+  } while (!status.end_time);
+  elapsed = now() - start;
+
+  getrusage(RUSAGE_SELF, &usage);
+
+  printf("tracks:     %d\n", status.new_tracks);
+  printf("wall time:  %.3f s\n", elapsed);
+  printf("files/sec:  %.1f\n", files_generated / elapsed);
+  printf("sqlite:     %.3f s (%.1f%%)\n", sqlite_ns / 1e9,
+         100.0 * sqlite_ns / 1e9 / elapsed);
+  printf("peak rss:   %ld KiB\n", usage.ru_maxrss);
+
+  db_close();
+  free(music);
+  free(db);
+  return 0;
+}
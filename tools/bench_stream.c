@@ -0,0 +1,284 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Transcode benchmark. Drives stream_open, stream_transcode, stream_remux and
+ * stream_next over a corpus of files for each codec and bitrate and reports
+ * realtime factor per core, heap allocations per packet and peak heap memory
+ * per stream.
+ *
+ * Allocations are counted by interposing malloc and friends, which relies on
+ * glibc's __libc_* entry points.
+ *
+ * Usage: bench_stream [-c codecs] [-b bitrates] FILE...
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "../src/config.h"
+#include "../src/libav.h"
+#include "../src/log.h"
+#include "../src/musicd.h"
+#include "../src/stream.h"
+#include "../src/track.h"
+
+#include <inttypes.h>
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+
+/*** Allocation accounting ***/
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+static int64_t allocations = 0;
+static int64_t live_bytes = 0;
+static int64_t peak_bytes = 0;
+
+static void account(void *ptr, int64_t sign)
+{
+  int64_t size, live, peak;
+
+  if (!ptr) {
+    return;
+  }
+  size = malloc_usable_size(ptr);
+  if (sign > 0) {
+    __atomic_add_fetch(&allocations, 1, __ATOMIC_RELAXED);
+  }
+  live = __atomic_add_fetch(&live_bytes, sign * size, __ATOMIC_RELAXED);
+  peak = __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED);
+  while (live > peak
+      && !__atomic_compare_exchange_n(&peak_bytes, &peak, live, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { }
+}
+
+void *malloc(size_t size)
+{
+  void *ptr = __libc_malloc(size);
+  account(ptr, 1);
+  return ptr;
+}
+
+void *calloc(size_t count, size_t size)
+{
+  void *ptr = __libc_calloc(count, size);
+  account(ptr, 1);
+  return ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+  account(ptr, -1);
+  ptr = __libc_realloc(ptr, size);
+  account(ptr, 1);
+  return ptr;
+}
+
+int posix_memalign(void **ptr, size_t alignment, size_t size)
+{
+  *ptr = __libc_memalign(alignment, size);
+  account(*ptr, 1);
+  return *ptr ? 0 : 12; /* ENOMEM */
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+  void *ptr = __libc_memalign(alignment, size);
+  account(ptr, 1);
+  return ptr;
+}
+
+void free(void *ptr)
+{
+  account(ptr, -1);
+  __libc_free(ptr);
+}
+
+
+/*** Benchmark ***/
+
+typedef struct {
+  double media_seconds;
+  double cpu_seconds;
+  int64_t packets;
+  int64_t allocations;
+  int64_t peak_bytes;
+  int64_t output_bytes;
+  int streams;
+  int failures;
+} result_t;
+
+static double cpu_time()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int count_write(void *opaque, uint8_t *buf, int buf_size)
+{
+  (void)buf;
+  *(int64_t *)opaque += buf_size;
+  return buf_size;
+}
+
+static void run_stream(const char *path, codec_type_t codec, int bitrate,
+                       result_t *result)
+{
+  stream_t *stream;
+  track_t *track;
+  int64_t start_allocations, base_bytes, packets = 0, output = 0;
+  double start;
+
+  track = track_from_path(path);
+  if (!track) {
+    fprintf(stderr, "can't read track from %s\n", path);
+    ++result->failures;
+    return;
+  }
+
+  base_bytes = __atomic_load_n(&live_bytes, __ATOMIC_RELAXED);
+  __atomic_store_n(&peak_bytes, base_bytes, __ATOMIC_RELAXED);
+  start_allocations = __atomic_load_n(&allocations, __ATOMIC_RELAXED);
+  start = cpu_time();
+
+  stream = stream_new();
+  if (!stream_open(stream, track)) {
+    track_free(track);
+    stream_close(stream);
+    ++result->failures;
+    return;
+  }
+  if (!stream_transcode(stream, codec, bitrate)
+   || !stream_remux(stream, count_write, &output)) {
+    stream_close(stream);
+    ++result->failures;
+    return;
+  }
+
+  stream_start(stream);
+  while (stream_next(stream) > 0) {
+    ++packets;
+  }
+
+  result->media_seconds += stream->track->duration;
+  stream_close(stream);
+
+  result->cpu_seconds += cpu_time() - start;
+  result->packets += packets;
+  result->allocations +=
+    __atomic_load_n(&allocations, __ATOMIC_RELAXED) - start_allocations;
+  if (__atomic_load_n(&peak_bytes, __ATOMIC_RELAXED) - base_bytes
+      > result->peak_bytes) {
+    result->peak_bytes =
+      __atomic_load_n(&peak_bytes, __ATOMIC_RELAXED) - base_bytes;
+  }
+  result->output_bytes += output;
+  ++result->streams;
+}
+
+static void print_usage(const char *arg0)
+{
+  printf("Usage: %s [-c CODECS] [-b BITRATES] FILE...\n\n", arg0);
+  printf("  -c CODECS\tComma separated codecs, default "
+         "mp3,vorbis,aac,opus,flac\n");
+  printf("  -b BITRATES\tComma separated bitrates in bps, default "
+         "96000,192000,320000\n");
+}
+
+int main(int argc, char *argv[])
+{
+  char *codecs = "mp3,vorbis,aac,opus,flac";
+  char *bitrates = "96000,192000,320000";
+  char *codec_list, *bitrate_list, *codec, *bitrate_str, *save1, *save2;
+  codec_type_t codec_type;
+  result_t result;
+  int opt, bitrate, i;
+
+  while ((opt = getopt(argc, argv, "c:b:")) != -1) {
+    switch (opt) {
+    case 'c': codecs = optarg; break;
+    case 'b': bitrates = optarg; break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind >= argc) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  musicd_start_time = time(NULL);
+
+  config_init();
+  config_set_hook("log-level", log_level_changed);
+  config_set("log-level", "error");
+
+  av_register_all();
+  avcodec_register_all();
+  av_log_set_level(AV_LOG_QUIET);
+
+  printf("%d files\n", argc - optind);
+  printf("%-8s %8s %8s %10s %12s %14s %12s %8s\n",
+         "codec", "bitrate", "streams", "packets", "rt/core", "allocs/packet",
+         "peak KiB", "failed");
+
+  codec_list = strdup(codecs);
+  for (codec = strtok_r(codec_list, ",", &save1); codec;
+       codec = strtok_r(NULL, ",", &save1)) {
+    codec_type = codec_type_from_string(codec);
+    if (codec_type <= CODEC_TYPE_NONE) {
+      fprintf(stderr, "unknown codec %s\n", codec);
+      continue;
+    }
+
+    bitrate_list = strdup(bitrates);
+    for (bitrate_str = strtok_r(bitrate_list, ",", &save2); bitrate_str;
+         bitrate_str = strtok_r(NULL, ",", &save2)) {
+      bitrate = atoi(bitrate_str);
+
+      memset(&result, 0, sizeof(result));
+      for (i = optind; i < argc; ++i) {
+        run_stream(argv[i], codec_type, bitrate, &result);
+      }
+
+      printf("%-8s %8d %8d %10" PRId64 " %12.1f %14.2f %12.1f %8d\n",
+             codec, bitrate, result.streams, result.packets,
+             result.cpu_seconds > 0
+               ? result.media_seconds / result.cpu_seconds : 0,
+             result.packets
+               ? result.allocations / (double)result.packets : 0,
+             result.peak_bytes / 1024.0, result.failures);
+    }
+    free(bitrate_list);
+  }
+  free(codec_list);
+
+  return 0;
+}
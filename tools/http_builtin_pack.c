@@ -16,12 +16,87 @@
  * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * Generates the HTTP router: a state machine that walks the request path one
+ * character at a time and ends up at the API method from HTTP_METHODS or the
+ * builtin file the path names.
+ *
+ * Usage: http_builtin_pack [DIRECTORY] > http_routes.c
+ *
+ * Files in DIRECTORY are built in, without DIRECTORY only the methods are
+ * routed.
+ */
+
+#include "../src/http_routes.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <sys/stat.h>
 #include <string.h>
 
+struct method {
+  const char *name;
+  int flags;
+};
+
+#define METHOD(name, handler, flags) { name, flags },
+static const struct method methods[] = {
+  HTTP_METHODS(METHOD)
+};
+
+/* Trie of routes, 0 is the root and is never a child */
+struct node {
+  int children[256];
+  int exact; /* Route of the path ending here or -1 */
+  int prefix; /* Route of paths continuing from here or -1 */
+};
+
+static struct node *nodes = NULL;
+static int node_count = 0, nodes_size = 0;
+static int route_count = 0;
+
+int new_node() {
+  if (node_count == nodes_size) {
+    nodes_size = nodes_size ? nodes_size * 2 : 256;
+    nodes = realloc(nodes, nodes_size * sizeof(struct node));
+    if (!nodes) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  
+  memset(&nodes[node_count], 0, sizeof(struct node));
+  nodes[node_count].exact = -1;
+  nodes[node_count].prefix = -1;
+  return node_count++;
+}
+
+int insert(const char *url) {
+  const unsigned char *p;
+  int node = 0;
+  
+  for (p = (const unsigned char *)url; *p; p++) {
+    if (!nodes[node].children[*p]) {
+      int child = new_node();
+      nodes[node].children[*p] = child;
+    }
+    node = nodes[node].children[*p];
+  }
+  
+  return node;
+}
+
+int find(const char *url) {
+  const unsigned char *p;
+  int node = 0;
+  
+  for (p = (const unsigned char *)url; *p && node >= 0; p++)
+    node = nodes[node].children[*p] ? nodes[node].children[*p] : -1;
+  
+  return node;
+}
+
 char *join_path(char *a, char *b) {
   char *result = malloc(strlen(a) + strlen(b) + 2);
   result[0] = '\0';
@@ -33,6 +108,17 @@ char *join_path(char *a, char *b) {
   return result;
 }
 
+void process_method(int index) {
+  int node = insert(methods[index].name);
+  
+  nodes[node].exact = route_count;
+  if (methods[index].flags & ONLY_PREFIX)
+    nodes[node].prefix = route_count;
+  
+  printf("  { HTTP_ROUTE_METHOD, %d, NULL, NULL, 0 },\n", index);
+  route_count++;
+}
+
 void process_file(char *path, char *url) {
   static char buf[4096];
   
@@ -47,7 +133,7 @@ void process_file(char *path, char *url) {
   int length = ftell(file);
   fseek(file, 0, SEEK_SET);
   
-  printf("  { .url = \"%s\", .length = %d, .data = \"", url, length);
+  printf("  { HTTP_ROUTE_BUILTIN, 0, \"%s\", \"", url);
   
   int len;
   while ((len = fread(buf, 1, sizeof(buf), file)) > 0) {
@@ -56,9 +142,15 @@ void process_file(char *path, char *url) {
       printf("\\x%02hhx", *p);
   }
   
-  printf("\" },\n");
+  printf("\", %d },\n", length);
   
   fclose(file);
+  
+  /* Methods take precedence */
+  int node = insert(url);
+  if (nodes[node].exact < 0)
+    nodes[node].exact = route_count;
+  route_count++;
 }
 
 void process_directory(char *path, char *url) {
@@ -89,39 +181,77 @@ void process_directory(char *path, char *url) {
   closedir(dir);
 }
 
+void print_case(int c) {
+  if (c > ' ' && c < 127 && c != '\'' && c != '\\')
+    printf("  case '%c':", c);
+  else
+    printf("  case %d:", c);
+}
+
+void print_node(int node) {
+  int c;
+  
+  /* The root is entered by falling through, not by goto */
+  if (node)
+    printf("n%d:\n", node);
+  if (nodes[node].prefix >= 0)
+    printf("  prefix = &routes[%d];\n", nodes[node].prefix);
+  
+  printf("  switch ((unsigned char)*p++) {\n");
+  if (nodes[node].exact >= 0)
+    printf("  case '\\0': return &routes[%d];\n", nodes[node].exact);
+  for (c = 1; c < 256; c++) {
+    if (nodes[node].children[c]) {
+      print_case(c);
+      printf(" goto n%d;\n", nodes[node].children[c]);
+    }
+  }
+  printf("  default: return prefix;\n  }\n");
+}
+
 int main(int argc, char **argv) {
-  printf("#include <stdlib.h>\n\
-#include <string.h>\
+  unsigned int i;
+  int node, index;
+  
+  printf("/* This is a generated file. Do not edit by hand. */\n\
 \n\
-/* This is a generated file. Do not edit by hand. */\n\
+#include \"http_routes.h\"\n\
 \n\
-struct file_entry {\n\
-  char *url;\n\
-  int length;\n\
-  char *data;\n\
-};\n\
+#include <stddef.h>\n\
 \n\
-static const struct file_entry entries[] = {\n\
+static const http_route_t routes[] = {\n\
 ");
 
-  process_directory((argc == 1 ? "." : argv[1]), "");
+  new_node();
+  
+  for (i = 0; i < sizeof(methods) / sizeof(methods[0]); i++)
+    process_method(i);
+  
+  if (argc > 1)
+    process_directory(argv[1], "");
+  
+  /* "/" is served as "/index.html" */
+  node = find("/index.html");
+  if (node >= 0 && nodes[node].exact >= 0) {
+    index = nodes[node].exact;
+    node = insert("/");
+    if (nodes[node].exact < 0)
+      nodes[node].exact = index;
+  }
   
-  printf("  { .url = NULL }\n\
-};\n\
+  printf("};\n\
+\n\
+const http_route_t *http_route_find(const char *path)\n\
+{\n\
+  const http_route_t *prefix = NULL;\n\
+  const char *p = path;\n\
 \n\
-int http_builtin_file(char *url, char **data, int *length) {\n\
-  const struct file_entry *entry;\n\
-  \n\
-  for (entry = entries; entry->url; entry++) {\n\
-    if (!strcmp(entry->url, url)) {\n\
-      *data = entry->data;\n\
-      *length = entry->length;\n\
-      return 1;\n\
-    }\n\
-  }\n\
-  \n\
-  return 0;\n\
-}\n");
+");
+
+  for (node = 0; node < node_count; node++)
+    print_node(node);
+  
+  printf("}\n");
   
   return 0;
 }
@@ -0,0 +1,784 @@
+/*
+ * This file is part of musicd.
+ * Copyright (C) 2011 Konsta Kokkinen <kray@tsundere.fi>
+ *
+ * Musicd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Musicd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Musicd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * HTTP load generator for a running musicd.
+ *
+ * First runs a weighted mix of /tracks, /albums, /image and /open requests
+ * from concurrent keep-alive connections and reports p50/p99 latency and
+ * requests per second per method. Then ramps up concurrent /open streams
+ * and reports how many can be served before a stream is delivered slower
+ * than its bitrate, i.e. a real client would underrun.
+ *
+ * Standalone, needs only libc and pthreads.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_IDS 10000
+#define BUFFER_SIZE 65536
+
+typedef enum {
+  REQ_TRACKS = 0,
+  REQ_ALBUMS,
+  REQ_IMAGE,
+  REQ_OPEN,
+  REQ_COUNT
+} request_type_t;
+
+static const char *request_names[REQ_COUNT] = {
+  "/tracks", "/albums", "/image", "/open"
+};
+
+/* Options */
+static const char *host = "127.0.0.1";
+static const char *port = "6800";
+static const char *unix_path = NULL;
+static const char *user = NULL;
+static const char *password = NULL;
+static int concurrency = 8;
+static int duration = 10;
+static int weights[REQ_COUNT] = { 40, 20, 30, 10 };
+static int max_streams = 64;
+static int bitrate = 192000;
+static int stream_window = 5;
+
+/* Session cookie, only set by prepare() before any worker starts */
+static char cookie[256] = "";
+static bool capture_cookie = false;
+
+static int64_t track_ids[MAX_IDS];
+static int track_ids_count = 0;
+static int64_t album_ids[MAX_IDS];
+static int album_ids_count = 0;
+static int64_t image_ids[MAX_IDS];
+static int image_ids_count = 0;
+
+typedef struct {
+  double *values;
+  int count;
+  int size;
+} samples_t;
+
+typedef struct {
+  samples_t latency[REQ_COUNT];
+  int errors[REQ_COUNT];
+  unsigned int seed;
+} worker_t;
+
+static volatile bool running;
+
+typedef struct {
+  int fd;
+  char buffer[BUFFER_SIZE + 1];
+  size_t begin;
+  size_t end;
+} connection_t;
+
+typedef struct {
+  int status;
+  int64_t content_length;
+  char *body;
+  size_t body_size;
+} response_t;
+
+
+static double now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void samples_add(samples_t *samples, double value)
+{
+  if (samples->count == samples->size) {
+    samples->size = samples->size ? samples->size * 2 : 1024;
+    samples->values =
+      realloc(samples->values, samples->size * sizeof(double));
+  }
+  samples->values[samples->count++] = value;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+static double percentile(samples_t *samples, double p)
+{
+  int i;
+  if (samples->count == 0) {
+    return 0;
+  }
+  i = samples->count * p;
+  if (i >= samples->count) {
+    i = samples->count - 1;
+  }
+  return samples->values[i];
+}
+
+
+static int connect_server()
+{
+  struct addrinfo hints, *info, *ai;
+  struct sockaddr_un address;
+  int fd = -1;
+
+  if (unix_path) {
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+      return -1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, unix_path, sizeof(address.sun_path) - 1);
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address))) {
+      close(fd);
+      return -1;
+    }
+    return fd;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &info)) {
+    return -1;
+  }
+  for (ai = info; ai; ai = ai->ai_next) {
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) {
+      continue;
+    }
+    if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(info);
+  return fd;
+}
+
+static void connection_close(connection_t *conn)
+{
+  if (conn->fd >= 0) {
+    close(conn->fd);
+  }
+  conn->fd = -1;
+  conn->begin = conn->end = 0;
+}
+
+/**
+ * Reads more data to the connection buffer.
+ * @returns amount of bytes read, 0 on EOF, < 0 on error.
+ */
+static ssize_t connection_fill(connection_t *conn)
+{
+  ssize_t n;
+
+  if (conn->begin > 0) {
+    memmove(conn->buffer, conn->buffer + conn->begin, conn->end - conn->begin);
+    conn->end -= conn->begin;
+    conn->begin = 0;
+  }
+  if (conn->end == BUFFER_SIZE) {
+    return -1;
+  }
+  do {
+    n = read(conn->fd, conn->buffer + conn->end, BUFFER_SIZE - conn->end);
+  } while (n < 0 && errno == EINTR);
+  if (n > 0) {
+    conn->end += n;
+  }
+  return n;
+}
+
+static bool send_request(connection_t *conn, const char *path)
+{
+  char request[1024];
+  int length, sent = 0, n;
+
+  if (conn->fd < 0) {
+    conn->fd = connect_server();
+    if (conn->fd < 0) {
+      return false;
+    }
+  }
+
+  length = snprintf(request, sizeof(request),
+                    "GET %s HTTP/1.1\r\n"
+                    "Host: %s\r\n"
+                    "Cookie: musicd-session=%s\r\n"
+                    "\r\n", path, host, cookie);
+  while (sent < length) {
+    n = write(conn->fd, request + sent, length - sent);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    sent += n;
+  }
+  return true;
+}
+
+/**
+ * Reads response headers, leaving the body in the connection buffer.
+ */
+static bool read_headers(connection_t *conn, response_t *response)
+{
+  char *end, *p;
+
+  response->status = 0;
+  response->content_length = -1;
+
+  while (1) {
+    conn->buffer[conn->end] = '\0';
+    end = strstr(conn->buffer + conn->begin, "\r\n\r\n");
+    if (end) {
+      break;
+    }
+    if (connection_fill(conn) <= 0) {
+      return false;
+    }
+  }
+  *end = '\0';
+
+  if (sscanf(conn->buffer + conn->begin, "HTTP/1.%*d %d", &response->status)
+      != 1) {
+    return false;
+  }
+
+  p = strstr(conn->buffer + conn->begin, "\r\nContent-Length: ");
+  if (p) {
+    response->content_length = strtoll(p + 18, NULL, 10);
+  }
+
+  p = strstr(conn->buffer + conn->begin, "\r\nSet-Cookie: musicd-session=");
+  if (p && capture_cookie) {
+    sscanf(p + 29, "%255[^;\r]", cookie);
+  }
+
+  conn->begin = end + 4 - conn->buffer;
+  return true;
+}
+
+/**
+ * Reads a complete response. If @p keep_body, the body is stored in
+ * @p response and must be freed.
+ */
+static bool read_response(connection_t *conn, response_t *response,
+                          bool keep_body)
+{
+  size_t available;
+  int64_t remaining;
+  ssize_t n;
+
+  response->body = NULL;
+  response->body_size = 0;
+
+  if (!read_headers(conn, response)) {
+    return false;
+  }
+
+  remaining = response->content_length;
+  while (remaining != 0) {
+    available = conn->end - conn->begin;
+    if (remaining > 0 && (int64_t)available > remaining) {
+      available = remaining;
+    }
+    if (keep_body && available > 0) {
+      response->body =
+        realloc(response->body, response->body_size + available + 1);
+      memcpy(response->body + response->body_size,
+             conn->buffer + conn->begin, available);
+      response->body_size += available;
+      response->body[response->body_size] = '\0';
+    }
+    conn->begin += available;
+    if (remaining > 0) {
+      remaining -= available;
+      if (remaining == 0) {
+        break;
+      }
+    }
+    n = connection_fill(conn);
+    if (n == 0 && remaining < 0) {
+      /* No Content-Length, body ends when the connection closes. */
+      connection_close(conn);
+      break;
+    }
+    if (n <= 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static bool request(connection_t *conn, const char *path, response_t *response,
+                    bool keep_body)
+{
+  /* The caller owns the previous body, only one read here may be freed */
+  response->body = NULL;
+
+  /* A kept-alive connection might have been closed by the server. */
+  if (send_request(conn, path) && read_response(conn, response, keep_body)) {
+    return true;
+  }
+  free(response->body);
+  response->body = NULL;
+  connection_close(conn);
+  return send_request(conn, path) && read_response(conn, response, keep_body);
+}
+
+
+static void parse_ids(const char *body, const char *key, int64_t *ids,
+                      int *count)
+{
+  const char *p = body;
+  size_t key_length = strlen(key);
+  int64_t id;
+
+  while (*count < MAX_IDS && (p = strstr(p, key))) {
+    p += key_length;
+    id = strtoll(p, NULL, 10);
+    if (id > 0) {
+      ids[(*count)++] = id;
+    }
+  }
+}
+
+static bool prepare(void)
+{
+  connection_t *conn = calloc(1, sizeof(connection_t));
+  response_t response = { 0, -1, NULL, 0 };
+  char path[512];
+  bool result = false;
+
+  conn->fd = -1;
+  capture_cookie = true;
+
+  if (user) {
+    snprintf(path, sizeof(path), "/auth?user=%s&password=%s", user,
+             password ? password : "");
+    if (!request(conn, path, &response, true) || !response.body
+     || !strstr(response.body, "\"ok\"")) {
+      fprintf(stderr, "authentication failed\n");
+      free(response.body);
+      goto finish;
+    }
+    free(response.body);
+  }
+
+  if (!request(conn, "/tracks?limit=10000", &response, true)
+   || response.status != 200 || !response.body) {
+    fprintf(stderr, "can't fetch tracks (status %d)\n", response.status);
+    free(response.body);
+    goto finish;
+  }
+  parse_ids(response.body, "{\"id\":", track_ids, &track_ids_count);
+  free(response.body);
+
+  if (!request(conn, "/albums?limit=10000", &response, true)
+   || response.status != 200 || !response.body) {
+    fprintf(stderr, "can't fetch albums (status %d)\n", response.status);
+    free(response.body);
+    goto finish;
+  }
+  parse_ids(response.body, "{\"id\":", album_ids, &album_ids_count);
+  parse_ids(response.body, "\"image\":", image_ids, &image_ids_count);
+  free(response.body);
+
+  printf("%d tracks, %d albums, %d images\n",
+         track_ids_count, album_ids_count, image_ids_count);
+
+  result = track_ids_count > 0;
+  if (!result) {
+    fprintf(stderr, "no tracks in library\n");
+  }
+
+finish:
+  capture_cookie = false;
+  connection_close(conn);
+  free(conn);
+  return result;
+}
+
+static int64_t random_id(int64_t *ids, int count, unsigned int *seed)
+{
+  return count ? ids[rand_r(seed) % count] : 1;
+}
+
+static request_type_t random_type(unsigned int *seed)
+{
+  int total = 0, i, r;
+  for (i = 0; i < REQ_COUNT; ++i) {
+    total += weights[i];
+  }
+  r = rand_r(seed) % total;
+  for (i = 0; i < REQ_COUNT - 1; ++i) {
+    if (r < weights[i]) {
+      break;
+    }
+    r -= weights[i];
+  }
+  return i;
+}
+
+static void *mix_thread(void *data)
+{
+  static const int image_sizes[] = { 64, 128, 256, 512 };
+  worker_t *worker = data;
+  connection_t *conn = calloc(1, sizeof(connection_t));
+  response_t response = { 0, -1, NULL, 0 };
+  request_type_t type;
+  char path[256];
+  double start;
+  ssize_t n;
+  bool ok;
+
+  conn->fd = -1;
+
+  while (running) {
+    type = random_type(&worker->seed);
+    switch (type) {
+    case REQ_TRACKS:
+      snprintf(path, sizeof(path), "/tracks?limit=50&offset=%d",
+               track_ids_count ? rand_r(&worker->seed) % track_ids_count : 0);
+      break;
+    case REQ_ALBUMS:
+      snprintf(path, sizeof(path), "/albums?limit=50&offset=%d",
+               album_ids_count ? rand_r(&worker->seed) % album_ids_count : 0);
+      break;
+    case REQ_IMAGE:
+      snprintf(path, sizeof(path), "/image?id=%" PRId64 "&size=%d",
+               random_id(image_ids, image_ids_count, &worker->seed),
+               image_sizes[rand_r(&worker->seed) % 4]);
+      break;
+    default:
+      snprintf(path, sizeof(path), "/open?id=%" PRId64 "&bitrate=%d",
+               random_id(track_ids, track_ids_count, &worker->seed), bitrate);
+      break;
+    }
+
+    start = now();
+    if (type == REQ_OPEN) {
+      /* Time to first byte of the stream, which is then dropped. */
+      ok = send_request(conn, path) && read_headers(conn, &response);
+      if (ok && conn->begin == conn->end) {
+        n = connection_fill(conn);
+        ok = n > 0;
+      }
+      ok = ok && response.status == 200;
+      connection_close(conn);
+    } else {
+      ok = request(conn, path, &response, false) && response.status == 200;
+    }
+
+    if (ok) {
+      samples_add(&worker->latency[type], now() - start);
+    } else {
+      ++worker->errors[type];
+      connection_close(conn);
+    }
+  }
+
+  connection_close(conn);
+  free(conn);
+  return NULL;
+}
+
+static void run_mix()
+{
+  worker_t *workers = calloc(concurrency, sizeof(worker_t));
+  pthread_t *threads = calloc(concurrency, sizeof(pthread_t));
+  samples_t all = { NULL, 0, 0 }, *samples;
+  int i, j, k, l, errors;
+  double start, elapsed;
+
+  printf("\nrequest mix: %d connections for %d s "
+         "(tracks %d, albums %d, image %d, open %d)\n",
+         concurrency, duration, weights[REQ_TRACKS], weights[REQ_ALBUMS],
+         weights[REQ_IMAGE], weights[REQ_OPEN]);
+
+  running = true;
+  start = now();
+  for (i = 0; i < concurrency; ++i) {
+    workers[i].seed = time(NULL) + i;
+    pthread_create(&threads[i], NULL, mix_thread, &workers[i]);
+  }
+  sleep(duration);
+  running = false;
+  for (i = 0; i < concurrency; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  elapsed = now() - start;
+
+  printf("%-10s %10s %10s %10s %10s %8s\n",
+         "method", "requests", "req/s", "p50 ms", "p99 ms", "errors");
+
+  for (j = 0; j <= REQ_COUNT; ++j) {
+    samples_t merged = { NULL, 0, 0 };
+    errors = 0;
+    for (i = 0; i < concurrency; ++i) {
+      for (k = 0; k < REQ_COUNT; ++k) {
+        if (j < REQ_COUNT && k != j) {
+          continue;
+        }
+        samples = &workers[i].latency[k];
+        for (l = 0; l < samples->count; ++l) {
+          samples_add(j < REQ_COUNT ? &merged : &all, samples->values[l]);
+        }
+        errors += workers[i].errors[k];
+      }
+    }
+    samples = j < REQ_COUNT ? &merged : &all;
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+    printf("%-10s %10d %10.1f %10.2f %10.2f %8d\n",
+           j < REQ_COUNT ? request_names[j] : "total",
+           samples->count, samples->count / elapsed,
+           percentile(samples, 0.50) * 1000, percentile(samples, 0.99) * 1000,
+           errors);
+    free(merged.values);
+  }
+
+  for (i = 0; i < concurrency; ++i) {
+    for (k = 0; k < REQ_COUNT; ++k) {
+      free(workers[i].latency[k].values);
+    }
+  }
+  free(all.values);
+  free(workers);
+  free(threads);
+}
+
+
+typedef struct {
+  unsigned int seed;
+  int64_t bytes;
+  double worst_rate;
+  int errors;
+} stream_worker_t;
+
+/**
+ * Keeps a stream open for the whole window, opening the next track when the
+ * previous ends. Records the lowest delivery rate seen over any one second
+ * after the first byte.
+ */
+static void *stream_thread(void *data)
+{
+  stream_worker_t *worker = data;
+  connection_t *conn = calloc(1, sizeof(connection_t));
+  response_t response = { 0, -1, NULL, 0 };
+  char path[256];
+  double second_start, t, rate;
+  int64_t second_bytes;
+  ssize_t n;
+
+  conn->fd = -1;
+  worker->worst_rate = -1;
+
+  while (running) {
+    snprintf(path, sizeof(path), "/open?id=%" PRId64 "&bitrate=%d",
+             random_id(track_ids, track_ids_count, &worker->seed), bitrate);
+    if (!send_request(conn, path) || !read_headers(conn, &response)
+     || response.status != 200) {
+      ++worker->errors;
+      connection_close(conn);
+      continue;
+    }
+
+    worker->bytes += conn->end - conn->begin;
+    conn->begin = conn->end;
+
+    second_start = now();
+    second_bytes = 0;
+    while (running) {
+      conn->begin = conn->end = 0;
+      n = connection_fill(conn);
+      if (n <= 0) {
+        break;
+      }
+      worker->bytes += n;
+      second_bytes += n;
+
+      t = now();
+      if (t - second_start >= 1.0) {
+        rate = second_bytes / (t - second_start);
+        if (worker->worst_rate < 0 || rate < worker->worst_rate) {
+          worker->worst_rate = rate;
+        }
+        second_start = t;
+        second_bytes = 0;
+      }
+    }
+    connection_close(conn);
+  }
+
+  free(conn);
+  return NULL;
+}
+
+/**
+ * @returns true if @p count streams were all delivered at least at bitrate.
+ */
+static bool run_streams(int count)
+{
+  stream_worker_t *workers = calloc(count, sizeof(stream_worker_t));
+  pthread_t *threads = calloc(count, sizeof(pthread_t));
+  double needed = bitrate / 8.0, worst = -1;
+  int64_t bytes = 0;
+  int i, errors = 0;
+  bool result;
+
+  running = true;
+  for (i = 0; i < count; ++i) {
+    workers[i].seed = time(NULL) * 31 + i;
+    pthread_create(&threads[i], NULL, stream_thread, &workers[i]);
+  }
+  sleep(stream_window);
+  running = false;
+  for (i = 0; i < count; ++i) {
+    pthread_join(threads[i], NULL);
+    bytes += workers[i].bytes;
+    errors += workers[i].errors;
+    if (workers[i].worst_rate >= 0
+     && (worst < 0 || workers[i].worst_rate < worst)) {
+      worst = workers[i].worst_rate;
+    }
+  }
+
+  result = errors == 0 && (worst < 0 || worst >= needed);
+
+  printf("%8d %12.1f %14.1f %8d %s\n",
+         count, bytes / (double)stream_window / count / 1024,
+         worst < 0 ? 0 : worst / 1024, errors, result ? "ok" : "underrun");
+
+  free(workers);
+  free(threads);
+  return result;
+}
+
+static void run_stream_ramp()
+{
+  int count, sustained = 0;
+
+  printf("\nstreams at %d bps (needs %.1f KiB/s each), %d s per step\n",
+         bitrate, bitrate / 8.0 / 1024, stream_window);
+  printf("%8s %12s %14s %8s\n", "streams", "avg KiB/s", "worst KiB/s",
+         "errors");
+
+  for (count = 1; count <= max_streams; count *= 2) {
+    if (!run_streams(count)) {
+      break;
+    }
+    sustained = count;
+  }
+
+  printf("sustained %d concurrent streams without underruns\n", sustained);
+}
+
+
+static void print_usage(const char *arg0)
+{
+  printf("Usage: %s [OPTION...]\n\n", arg0);
+  printf("  -h HOST\tServer host, default 127.0.0.1\n");
+  printf("  -p PORT\tServer port, default 6800\n");
+  printf("  -s PATH\tConnect to unix socket PATH instead\n");
+  printf("  -u USER\tUser to authenticate as\n");
+  printf("  -P PASSWORD\tPassword of the user\n");
+  printf("  -c N\t\tConcurrent connections in request mix, default 8\n");
+  printf("  -d SECONDS\tDuration of request mix, default 10\n");
+  printf("  -m T,A,I,O\tWeights of /tracks, /albums, /image and /open, "
+         "default 40,20,30,10\n");
+  printf("  -S N\t\tMaximum concurrent streams to try, default 64, "
+         "0 to skip\n");
+  printf("  -b BITRATE\tStream bitrate, default 192000\n");
+  printf("  -w SECONDS\tDuration of each stream step, default 5\n");
+}
+
+int main(int argc, char *argv[])
+{
+  int opt;
+
+  while ((opt = getopt(argc, argv, "h:p:s:u:P:c:d:m:S:b:w:")) != -1) {
+    switch (opt) {
+    case 'h': host = optarg; break;
+    case 'p': port = optarg; break;
+    case 's': unix_path = optarg; break;
+    case 'u': user = optarg; break;
+    case 'P': password = optarg; break;
+    case 'c': concurrency = atoi(optarg); break;
+    case 'd': duration = atoi(optarg); break;
+    case 'm':
+      if (sscanf(optarg, "%d,%d,%d,%d", &weights[REQ_TRACKS],
+                 &weights[REQ_ALBUMS], &weights[REQ_IMAGE],
+                 &weights[REQ_OPEN]) != 4) {
+        print_usage(argv[0]);
+        return 1;
+      }
+      break;
+    case 'S': max_streams = atoi(optarg); break;
+    case 'b': bitrate = atoi(optarg); break;
+    case 'w': stream_window = atoi(optarg); break;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (concurrency < 1 || duration < 1 || stream_window < 1
+   || weights[REQ_TRACKS] + weights[REQ_ALBUMS] + weights[REQ_IMAGE]
+    + weights[REQ_OPEN] <= 0) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  if (!prepare()) {
+    return 1;
+  }
+
+  run_mix();
+
+  if (max_streams > 0) {
+    run_stream_ramp();
+  }
+
+  return 0;
+}